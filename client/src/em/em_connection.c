@@ -17,10 +17,15 @@
 #include "em_status.h"
 #include "em_app_log.h"
 
+#include "pb_decode.h"
+#include "pb_encode.h"
+#include "electricmaple.pb.h"
+
 #include <gst/gstelement.h>
 #include <gst/gstobject.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 
 #define GST_USE_UNSTABLE_API
 #include <gst/webrtc/webrtc.h>
@@ -66,6 +71,7 @@ enum
 	SIGNAL_STATUS_CHANGE,
 	SIGNAL_ON_NEED_PIPELINE,
 	SIGNAL_ON_DROP_PIPELINE,
+	SIGNAL_ON_FRAME_DATA,
 	N_SIGNALS
 };
 
@@ -236,6 +242,16 @@ em_connection_class_init(EmConnectionClass *klass)
 	 */
 	signals[SIGNAL_ON_DROP_PIPELINE] = g_signal_new("on-drop-pipeline", G_OBJECT_CLASS_TYPE(klass),
 	                                                G_SIGNAL_RUN_LAST, 0, NULL, NULL, NULL, G_TYPE_NONE, 0);
+
+	/**
+	 * EmConnection::on-frame-data
+	 * @object: the #EmConnection
+	 * @frame_data: A const em_proto_DownFrameDataMessage pointer, only valid during the emission
+	 *
+	 * The server sent what it rendered a frame with. Emitted from the data channel's thread.
+	 */
+	signals[SIGNAL_ON_FRAME_DATA] = g_signal_new("on-frame-data", G_OBJECT_CLASS_TYPE(klass), G_SIGNAL_RUN_LAST,
+	                                             0, NULL, NULL, NULL, G_TYPE_NONE, 1, G_TYPE_POINTER);
 	ALOGE("RYLIE: %s: End", __FUNCTION__);
 }
 
@@ -332,6 +348,61 @@ emconn_data_channel_message_string_cb(GstWebRTCDataChannel *datachannel, gchar *
 	ALOGI("RYLIE: %s: Received data channel message: %s", __FUNCTION__, str);
 }
 
+/*!
+ * Answer a probe right away, the server measures the path from when they
+ * arrive here. Not an up message of the experience, so no id.
+ */
+static void
+emconn_reply_to_probe(EmConnection *emconn, const em_proto_ProbeMessage *probe, int64_t receive_ns, size_t size)
+{
+	em_proto_UpMessage msg = em_proto_UpMessage_init_default;
+	msg.has_probe_reply = true;
+	msg.probe_reply.sequence = probe->sequence;
+	msg.probe_reply.send_time = probe->send_time;
+	msg.probe_reply.receive_time = receive_ns;
+	msg.probe_reply.size = (int32_t)size;
+
+	uint8_t buffer[em_proto_UpMessage_size];
+	pb_ostream_t os = pb_ostream_from_buffer(buffer, sizeof(buffer));
+	if (!pb_encode(&os, &em_proto_UpMessage_msg, &msg)) {
+		ALOGE("%s: Failed to encode probe reply: %s", __FUNCTION__, PB_GET_ERROR(&os));
+		return;
+	}
+
+	GBytes *bytes = g_bytes_new(buffer, os.bytes_written);
+	em_connection_send_bytes(emconn, bytes);
+	g_bytes_unref(bytes);
+}
+
+static void
+emconn_data_channel_message_data_cb(GstWebRTCDataChannel *datachannel, GBytes *data, EmConnection *emconn)
+{
+	// Before anything else, the arrival time of probes is what they measure.
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	int64_t receive_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	em_proto_DownMessage message = em_proto_DownMessage_init_default;
+	size_t n = 0;
+
+	const unsigned char *buf = (const unsigned char *)g_bytes_get_data(data, &n);
+	pb_istream_t istream = pb_istream_from_buffer(buf, n);
+
+	// Probes are padded after a zero byte, which ends the message here.
+	if (!pb_decode_ex(&istream, &em_proto_DownMessage_msg, &message, PB_DECODE_NULLTERMINATED)) {
+		ALOGE("%s: Failed to decode down message: %s", __FUNCTION__, PB_GET_ERROR(&istream));
+		return;
+	}
+
+	if (message.has_probe) {
+		emconn_reply_to_probe(emconn, &message.probe, receive_ns, n);
+	}
+
+	if (message.has_frame_data) {
+		g_signal_emit(emconn, signals[SIGNAL_ON_FRAME_DATA], 0, &message.frame_data);
+	}
+}
+
 static void
 emconn_connect_internal(EmConnection *emconn, enum em_status status);
 
@@ -356,6 +427,7 @@ emconn_webrtc_prepare_data_channel_cb(GstElement *webrtc,
 	g_signal_connect(data_channel, "on-close", G_CALLBACK(emconn_data_channel_close_cb), emconn);
 	g_signal_connect(data_channel, "on-error", G_CALLBACK(emconn_data_channel_error_cb), emconn);
 	g_signal_connect(data_channel, "on-message-string", G_CALLBACK(emconn_data_channel_message_string_cb), emconn);
+	g_signal_connect(data_channel, "on-message-data", G_CALLBACK(emconn_data_channel_message_data_cb), emconn);
 }
 
 static void
@@ -50,5 +50,38 @@ FrameDataAccumulator::emitCompleteRecords(PfnEmitUpMessage pfn, void *userdata)
 	});
 }
 
+void
+DownFrameDataBuffer::record(em_proto_DownFrameDataMessage const &frameData)
+{
+	if (frameData.frame_sequence_id == id_data_accum::kSentinel) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	// A resend replaces what we have, the accumulator does not take duplicate IDs.
+	if (m_accum.updateDataFor(frameData.frame_sequence_id,
+	                          [&](em_proto_DownFrameDataMessage &data) { data = frameData; })) {
+		return;
+	}
+	m_accum.addDataFor(frameData.frame_sequence_id, em_proto_DownFrameDataMessage{frameData});
+}
+
+bool
+DownFrameDataBuffer::take(int64_t frameId, em_proto_DownFrameDataMessage &outFrameData)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	bool found = false;
+	// Frames come out of the decoder in order, older ones will never be asked for.
+	m_accum.visitAll([&](id_data_accum::IdType id, em_proto_DownFrameDataMessage const &data) {
+		if (id > frameId) {
+			return id_data_accum::Command::Keep;
+		}
+		if (id == frameId) {
+			outFrameData = data;
+			found = true;
+		}
+		return id_data_accum::Command::Drop;
+	});
+	return found;
+}
 
 } // namespace em
@@ -12,6 +12,7 @@
 #pragma once
 
 #include "em/em_id_data_accumulator.hpp"
+#include "electricmaple.pb.h"
 
 #include <glib-object.h>
 
@@ -19,8 +20,6 @@
 #include <cstdint>
 #include <mutex>
 
-typedef struct _em_proto_UpMessage em_proto_UpMessage;
-
 namespace em {
 
 using PfnEmitUpMessage = void (*)(em_proto_UpMessage *, void *);
@@ -51,4 +50,30 @@ private:
 	IdDataAccumulator<FrameData, kMaxFrameData> m_accum;
 	std::mutex m_mutex;
 };
+
+/*!
+ * Holds the frame data the server sends ahead of each frame, until that frame comes out of the decoder.
+ */
+class DownFrameDataBuffer
+{
+public:
+	DownFrameDataBuffer() = default;
+
+	void
+	record(em_proto_DownFrameDataMessage const &frameData);
+
+	/*!
+	 * Get the frame data for a decoded frame, forgetting it and that of any older frame.
+	 *
+	 * @return true if frame data for that frame arrived
+	 */
+	bool
+	take(int64_t frameId, em_proto_DownFrameDataMessage &outFrameData);
+
+private:
+	/// a few frames may be in the decoder at once
+	static constexpr std::size_t kMaxFrameData = 8;
+	IdDataAccumulator<em_proto_DownFrameDataMessage, kMaxFrameData> m_accum;
+	std::mutex m_mutex;
+};
 } // namespace em
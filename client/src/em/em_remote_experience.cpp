@@ -13,6 +13,7 @@
 
 #include "em_app_log.h"
 #include "em_connection.h"
+#include "em_frame_data.hpp"
 #include "em_stream_client.h"
 #include "gst_common.h"
 #include "render/GLSwapchain.h"
@@ -29,6 +30,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <exception>
 #include <linux/time.h>
@@ -44,6 +46,11 @@ struct _EmRemoteExperience
 	std::unique_ptr<Renderer> renderer;
 	struct em_sample *prev_sample;
 
+	//! Frame data from the server, until its frame is pulled.
+	std::unique_ptr<em::DownFrameDataBuffer> down_frame_data;
+	//! What the server rendered prev_sample with, has_* false where it did not say.
+	em_proto_DownFrameDataMessage prev_sample_frame_data;
+
 	XrExtent2Di eye_extents;
 
 
@@ -62,6 +69,11 @@ struct _EmRemoteExperience
 		XrSpace worldSpace;
 		XrSpace viewSpace;
 		XrSwapchain swapchain;
+
+		//! Only created with eye gaze interaction, null otherwise.
+		XrActionSet gazeActionSet;
+		XrAction gazeAction;
+		XrSpace gazeSpace;
 	} xr_owned;
 
 	GLSwapchain swapchainBuffers;
@@ -89,6 +101,51 @@ em_remote_experience_emit_upmessage(EmRemoteExperience *exp, em_proto_UpMessage
 	return bResult;
 }
 
+/*!
+ * Where the user looks, relative to view space. Leaves @p out_gaze alone and
+ * returns false if there is no eye gaze interaction.
+ */
+static bool
+em_remote_experience_locate_gaze(EmRemoteExperience *exp, XrTime time, em_proto_GazeMessage *out_gaze)
+{
+	if (exp->xr_owned.gazeSpace == XR_NULL_HANDLE) {
+		return false;
+	}
+
+	XrActiveActionSet activeActionSet = {exp->xr_owned.gazeActionSet, XR_NULL_PATH};
+	XrActionsSyncInfo syncInfo = {
+	    .type = XR_TYPE_ACTIONS_SYNC_INFO,
+	    .countActiveActionSets = 1,
+	    .activeActionSets = &activeActionSet,
+	};
+
+	XrResult result = xrSyncActions(exp->xr_not_owned.session, &syncInfo);
+	if (XR_FAILED(result)) {
+		return false;
+	}
+
+	XrEyeGazeSampleTimeEXT sampleTime = {.type = XR_TYPE_EYE_GAZE_SAMPLE_TIME_EXT};
+	XrSpaceLocation location = {.type = XR_TYPE_SPACE_LOCATION, .next = &sampleTime};
+	result = xrLocateSpace(exp->xr_owned.gazeSpace, exp->xr_owned.viewSpace, time, &location);
+	if (XR_FAILED(result)) {
+		return false;
+	}
+
+	// The gaze looks down -z of its pose.
+	const XrQuaternionf &q = location.pose.orientation;
+	out_gaze->has_direction = true;
+	out_gaze->direction.x = -2.f * (q.w * q.y + q.x * q.z);
+	out_gaze->direction.y = 2.f * (q.w * q.x - q.y * q.z);
+	out_gaze->direction.z = -(1.f - 2.f * (q.x * q.x + q.y * q.y));
+
+	// The extension has no confidence, only whether the eyes are tracked right now.
+	XrSpaceLocationFlags tracked = XR_SPACE_LOCATION_ORIENTATION_VALID_BIT | XR_SPACE_LOCATION_ORIENTATION_TRACKED_BIT;
+	out_gaze->confidence = (location.locationFlags & tracked) == tracked ? 1.f : 0.f;
+	out_gaze->timestamp = sampleTime.time;
+
+	return true;
+}
+
 static void
 em_remote_experience_report_pose(EmRemoteExperience *exp, XrTime predictedDisplayTime)
 {
@@ -124,12 +181,21 @@ em_remote_experience_report_pose(EmRemoteExperience *exp, XrTime predictedDispla
 	em_proto_UpMessage upMessage = em_proto_UpMessage_init_default;
 	upMessage.has_tracking = true;
 	upMessage.tracking = tracking;
+	upMessage.has_gaze = em_remote_experience_locate_gaze(exp, predictedDisplayTime, &upMessage.gaze);
 
 	if (!em_remote_experience_emit_upmessage(exp, &upMessage)) {
 		ALOGE("RYLIE: Could not queue HMD pose message!");
 	}
 }
 
+static void
+em_remote_experience_on_frame_data(EmConnection *connection,
+                                   const em_proto_DownFrameDataMessage *frame_data,
+                                   EmRemoteExperience *exp)
+{
+	exp->down_frame_data->record(*frame_data);
+}
+
 static void
 em_remote_experience_dispose(EmRemoteExperience *exp)
 {
@@ -147,11 +213,13 @@ em_remote_experience_dispose(EmRemoteExperience *exp)
 		}
 	}
 	if (exp->connection) {
+		g_signal_handlers_disconnect_by_data(exp->connection, exp);
 		em_connection_disconnect(exp->connection);
 	}
 	// stream client is not gobject (yet?)
 	em_stream_client_destroy(&exp->stream_client);
 	g_clear_object(&exp->connection);
+	exp->down_frame_data = nullptr;
 	exp->swapchainBuffers.reset();
 
 	if (exp->renderer) {
@@ -171,6 +239,18 @@ em_remote_experience_finalize(EmRemoteExperience *exp)
 		exp->xr_owned.swapchain = XR_NULL_HANDLE;
 	}
 
+	if (exp->xr_owned.gazeSpace != XR_NULL_HANDLE) {
+		xrDestroySpace(exp->xr_owned.gazeSpace);
+		exp->xr_owned.gazeSpace = XR_NULL_HANDLE;
+	}
+
+	// Destroys the action in it too.
+	if (exp->xr_owned.gazeActionSet != XR_NULL_HANDLE) {
+		xrDestroyActionSet(exp->xr_owned.gazeActionSet);
+		exp->xr_owned.gazeActionSet = XR_NULL_HANDLE;
+		exp->xr_owned.gazeAction = XR_NULL_HANDLE;
+	}
+
 	if (exp->xr_owned.viewSpace != XR_NULL_HANDLE) {
 		xrDestroySpace(exp->xr_owned.viewSpace);
 		exp->xr_owned.viewSpace = XR_NULL_HANDLE;
@@ -182,12 +262,89 @@ em_remote_experience_finalize(EmRemoteExperience *exp)
 	}
 }
 
+/*!
+ * Set up a pose action bound to the gaze, so it can be located each frame.
+ *
+ * Attaches the only action set of the session, nothing else may attach one.
+ */
+static bool
+em_remote_experience_init_gaze(EmRemoteExperience *exp)
+{
+	XrInstance instance = exp->xr_not_owned.instance;
+	XrSession session = exp->xr_not_owned.session;
+
+	XrActionSetCreateInfo actionSetInfo = {.type = XR_TYPE_ACTION_SET_CREATE_INFO};
+	strncpy(actionSetInfo.actionSetName, "gaze", XR_MAX_ACTION_SET_NAME_SIZE - 1);
+	strncpy(actionSetInfo.localizedActionSetName, "Gaze", XR_MAX_LOCALIZED_ACTION_SET_NAME_SIZE - 1);
+
+	XrResult result = xrCreateActionSet(instance, &actionSetInfo, &exp->xr_owned.gazeActionSet);
+	if (XR_FAILED(result)) {
+		ALOGE("%s: Failed to create gaze action set (%d)", __FUNCTION__, result);
+		return false;
+	}
+
+	XrActionCreateInfo actionInfo = {.type = XR_TYPE_ACTION_CREATE_INFO, .actionType = XR_ACTION_TYPE_POSE_INPUT};
+	strncpy(actionInfo.actionName, "eye_gaze", XR_MAX_ACTION_NAME_SIZE - 1);
+	strncpy(actionInfo.localizedActionName, "Eye Gaze", XR_MAX_LOCALIZED_ACTION_NAME_SIZE - 1);
+
+	result = xrCreateAction(exp->xr_owned.gazeActionSet, &actionInfo, &exp->xr_owned.gazeAction);
+	if (XR_FAILED(result)) {
+		ALOGE("%s: Failed to create gaze action (%d)", __FUNCTION__, result);
+		return false;
+	}
+
+	XrPath profile = XR_NULL_PATH;
+	XrActionSuggestedBinding binding = {exp->xr_owned.gazeAction, XR_NULL_PATH};
+	xrStringToPath(instance, "/interaction_profiles/ext/eye_gaze_interaction", &profile);
+	xrStringToPath(instance, "/user/eyes_ext/input/gaze_ext/pose", &binding.binding);
+
+	XrInteractionProfileSuggestedBinding suggestedBindings = {
+	    .type = XR_TYPE_INTERACTION_PROFILE_SUGGESTED_BINDING,
+	    .interactionProfile = profile,
+	    .countSuggestedBindings = 1,
+	    .suggestedBindings = &binding,
+	};
+
+	result = xrSuggestInteractionProfileBindings(instance, &suggestedBindings);
+	if (XR_FAILED(result)) {
+		ALOGE("%s: Failed to suggest gaze binding (%d)", __FUNCTION__, result);
+		return false;
+	}
+
+	XrSessionActionSetsAttachInfo attachInfo = {
+	    .type = XR_TYPE_SESSION_ACTION_SETS_ATTACH_INFO,
+	    .countActionSets = 1,
+	    .actionSets = &exp->xr_owned.gazeActionSet,
+	};
+
+	result = xrAttachSessionActionSets(session, &attachInfo);
+	if (XR_FAILED(result)) {
+		ALOGE("%s: Failed to attach gaze action set (%d)", __FUNCTION__, result);
+		return false;
+	}
+
+	XrActionSpaceCreateInfo spaceInfo = {
+	    .type = XR_TYPE_ACTION_SPACE_CREATE_INFO,
+	    .action = exp->xr_owned.gazeAction,
+	    .poseInActionSpace = {{0.f, 0.f, 0.f, 1.f}, {0.f, 0.f, 0.f}},
+	};
+
+	result = xrCreateActionSpace(session, &spaceInfo, &exp->xr_owned.gazeSpace);
+	if (XR_FAILED(result)) {
+		ALOGE("%s: Failed to create gaze space (%d)", __FUNCTION__, result);
+		return false;
+	}
+
+	return true;
+}
+
 EmRemoteExperience *
 em_remote_experience_new(EmConnection *connection,
                          EmStreamClient *stream_client,
                          XrInstance instance,
                          XrSession session,
-                         const XrExtent2Di *eye_extents)
+                         const XrExtent2Di *eye_extents,
+                         bool eye_gaze)
 {
 	EmRemoteExperience *self = reinterpret_cast<EmRemoteExperience *>(calloc(1, sizeof(EmRemoteExperience)));
 	self->connection = g_object_ref_sink(connection);
@@ -196,6 +353,9 @@ em_remote_experience_new(EmConnection *connection,
 	self->eye_extents = *eye_extents;
 	self->xr_not_owned.instance = instance;
 	self->xr_not_owned.session = session;
+	self->down_frame_data = std::make_unique<em::DownFrameDataBuffer>();
+	self->prev_sample_frame_data = em_proto_DownFrameDataMessage_init_default;
+	g_signal_connect(self->connection, "on-frame-data", G_CALLBACK(em_remote_experience_on_frame_data), self);
 
 	// Get the extension function for converting times.
 	{
@@ -291,6 +451,11 @@ em_remote_experience_new(EmConnection *connection,
 		}
 	}
 
+	// Without gaze the server keeps the foveation on the lens centers, not worth failing over.
+	if (eye_gaze && !em_remote_experience_init_gaze(self)) {
+		ALOGW("%s: Eye gaze interaction unavailable, not sending gaze", __FUNCTION__);
+	}
+
 	ALOGI("%s: done", __FUNCTION__);
 	return self;
 }
@@ -405,6 +570,7 @@ em_remote_experience_poll_and_render_frame(EmRemoteExperience *exp)
 
 static void
 report_frame_timing(EmRemoteExperience *exp,
+                    int64_t frameSequenceId,
                     const struct timespec *beginFrameTime,
                     const struct timespec *decodeEndTime,
                     XrTime predictedDisplayTime)
@@ -422,8 +588,7 @@ report_frame_timing(EmRemoteExperience *exp,
 		return;
 	}
 	em_proto_UpFrameMessage msg = em_proto_UpFrameMessage_init_default;
-	// TODO frame ID
-	// msg.frame_sequence_id = ???;
+	msg.frame_sequence_id = frameSequenceId;
 	msg.decode_complete_time = xrTimeDecodeEnd;
 	msg.begin_frame_time = xrTimeBeginFrame;
 	msg.display_time = predictedDisplayTime;
@@ -433,6 +598,42 @@ report_frame_timing(EmRemoteExperience *exp,
 	em_remote_experience_emit_upmessage(exp, &upMsg);
 }
 
+static inline XrPosef
+to_xr_pose(const em_proto_Pose &pose)
+{
+	XrPosef ret = {};
+	ret.orientation = {pose.orientation.x, pose.orientation.y, pose.orientation.z, pose.orientation.w};
+	ret.position = {pose.position.x, pose.position.y, pose.position.z};
+	return ret;
+}
+
+static inline XrFovf
+to_xr_fov(const em_proto_Fov &fov)
+{
+	return {fov.angle_left, fov.angle_right, fov.angle_up, fov.angle_down};
+}
+
+/*!
+ * Submit the frame with the views the server rendered it with, where it told us.
+ */
+static void
+apply_frame_data_views(const em_proto_DownFrameDataMessage *frame_data,
+                       XrCompositionLayerProjectionView *projectionViews)
+{
+	if (frame_data->has_P_localSpace_view0) {
+		projectionViews[0].pose = to_xr_pose(frame_data->P_localSpace_view0);
+	}
+	if (frame_data->has_P_localSpace_view1) {
+		projectionViews[1].pose = to_xr_pose(frame_data->P_localSpace_view1);
+	}
+	if (frame_data->has_fov0) {
+		projectionViews[0].fov = to_xr_fov(frame_data->fov0);
+	}
+	if (frame_data->has_fov1) {
+		projectionViews[1].fov = to_xr_fov(frame_data->fov1);
+	}
+}
+
 EmPollRenderResult
 em_remote_experience_inner_poll_and_render_frame(EmRemoteExperience *exp,
                                                  const struct timespec *beginFrameTime,
@@ -464,12 +665,13 @@ em_remote_experience_inner_poll_and_render_frame(EmRemoteExperience *exp,
 	projectionLayer->space = exp->xr_owned.worldSpace;
 
 	projectionViews[0].subImage.swapchain = exp->xr_owned.swapchain;
-	projectionViews[0].pose = views[0].pose; // TODO use poses from server
+	// Only used if the server did not say what it rendered with.
+	projectionViews[0].pose = views[0].pose;
 	projectionViews[0].fov = views[0].fov;
 	projectionViews[0].subImage.imageRect.offset = {0, 0};
 	projectionViews[0].subImage.imageRect.extent = {static_cast<int32_t>(width), static_cast<int32_t>(height)};
 	projectionViews[1].subImage.swapchain = exp->xr_owned.swapchain;
-	projectionViews[1].pose = views[1].pose; // TODO use poses from server
+	projectionViews[1].pose = views[1].pose;
 	projectionViews[1].fov = views[1].fov;
 	projectionViews[1].subImage.imageRect.offset = {static_cast<int32_t>(width), 0};
 	projectionViews[1].subImage.imageRect.extent = {static_cast<int32_t>(width), static_cast<int32_t>(height)};
@@ -479,6 +681,7 @@ em_remote_experience_inner_poll_and_render_frame(EmRemoteExperience *exp,
 
 	if (sample == nullptr) {
 		if (exp->prev_sample) {
+			apply_frame_data_views(&exp->prev_sample_frame_data, projectionViews);
 			return EM_POLL_RENDER_RESULT_REUSED_SAMPLE;
 		}
 		return EM_POLL_RENDER_RESULT_NO_SAMPLE_AVAILABLE;
@@ -508,7 +711,7 @@ em_remote_experience_inner_poll_and_render_frame(EmRemoteExperience *exp,
 
 	// for (uint32_t eye = 0; eye < 2; eye++) {
 	// 	glViewport(eye * width, 0, width, height);
-	exp->renderer->draw(sample->frame_texture_id, sample->frame_texture_target);
+	exp->renderer->draw(sample->frame_texture_id, sample->frame_texture_target, sample->foveation);
 	// }
 
 	// Release
@@ -526,8 +729,13 @@ em_remote_experience_inner_poll_and_render_frame(EmRemoteExperience *exp,
 	}
 	exp->prev_sample = sample;
 
+	if (!exp->down_frame_data->take(sample->frame_sequence_id, exp->prev_sample_frame_data)) {
+		exp->prev_sample_frame_data = em_proto_DownFrameDataMessage_init_default;
+	}
+	apply_frame_data_views(&exp->prev_sample_frame_data, projectionViews);
+
 	// Send frame report
-	report_frame_timing(exp, beginFrameTime, &decodeEndTime, predictedDisplayTime);
+	report_frame_timing(exp, sample->frame_sequence_id, beginFrameTime, &decodeEndTime, predictedDisplayTime);
 
 	return EM_POLL_RENDER_RESULT_NEW_SAMPLE;
 }
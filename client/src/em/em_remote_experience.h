@@ -73,6 +73,7 @@ em_poll_render_result_to_string(EmPollRenderResult res)
  * @param instance Your OpenXR instance: we only observe, do not take ownership.
  * @param session Your OpenXR session: we only observe, do not take ownership.
  * @param eye_extents Dimensions of the eye swapchain (max)
+ * @param eye_gaze Whether XR_EXT_eye_gaze_interaction is enabled and supported, the gaze is then sent upstream.
  *
  * @return EmRemoteExperience* or NULL in case of error
  */
@@ -81,7 +82,8 @@ em_remote_experience_new(EmConnection *connection,
                          EmStreamClient *stream_client,
                          XrInstance instance,
                          XrSession session,
-                         const XrExtent2Di *eye_extents);
+                         const XrExtent2Di *eye_extents,
+                         bool eye_gaze);
 
 
 /*!
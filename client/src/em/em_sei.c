@@ -0,0 +1,337 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Parsing of the frame id SEI the ElectricMaple server puts in every access unit, and of recovery points
+ * @ingroup em_client
+ */
+
+#include "em_sei.h"
+
+#include <string.h>
+
+#define NAL_TYPE_SEI (6)
+#define SEI_TYPE_USER_DATA_UNREGISTERED (5)
+#define SEI_TYPE_RECOVERY_POINT (6)
+
+// Strengths then centers, as big endian IEEE floats.
+#define FOVEATION_SIZE (6 * 4)
+
+const uint8_t em_sei_frame_id_uuid[16] = {
+    0xf8, 0xca, 0x29, 0x78, 0xb0, 0x40, 0x40, 0x59, 0x99, 0x64, 0x78, 0xd7, 0xec, 0x17, 0xd1, 0xec,
+};
+
+/*!
+ * Reads the payload of a NAL unit, dropping the emulation prevention bytes.
+ */
+struct rbsp_reader
+{
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+	int zeros;
+};
+
+static bool
+rbsp_read_byte(struct rbsp_reader *r, uint8_t *out_byte)
+{
+	if (r->pos >= r->size) {
+		return false;
+	}
+
+	uint8_t byte = r->data[r->pos++];
+	if (r->zeros == 2 && byte == 3) {
+		r->zeros = 0;
+		if (r->pos >= r->size) {
+			return false;
+		}
+		byte = r->data[r->pos++];
+	}
+
+	r->zeros = byte == 0 ? r->zeros + 1 : 0;
+	*out_byte = byte;
+
+	return true;
+}
+
+//! Payload type and size are coded as a run of 0xff bytes plus a final byte.
+static bool
+rbsp_read_sei_value(struct rbsp_reader *r, uint32_t *out_value)
+{
+	uint32_t value = 0;
+	uint8_t byte = 0;
+
+	do {
+		if (!rbsp_read_byte(r, &byte)) {
+			return false;
+		}
+		value += byte;
+	} while (byte == 0xff);
+
+	*out_value = value;
+
+	return true;
+}
+
+static bool
+rbsp_skip(struct rbsp_reader *r, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		uint8_t byte = 0;
+		if (!rbsp_read_byte(r, &byte)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*!
+ * Reads bit by bit, for the few fields that are not whole bytes.
+ */
+struct bit_reader
+{
+	struct rbsp_reader *r;
+	uint8_t byte;
+	int bits_left;
+};
+
+static bool
+bit_read(struct bit_reader *b, uint32_t *out_bit)
+{
+	if (b->bits_left == 0) {
+		if (!rbsp_read_byte(b->r, &b->byte)) {
+			return false;
+		}
+		b->bits_left = 8;
+	}
+
+	*out_bit = (b->byte >> --b->bits_left) & 1;
+
+	return true;
+}
+
+//! Exp-Golomb coded unsigned value.
+static bool
+bit_read_ue(struct bit_reader *b, uint32_t *out_value)
+{
+	uint32_t bit = 0;
+	int zeros = 0;
+
+	while (true) {
+		if (!bit_read(b, &bit)) {
+			return false;
+		}
+		if (bit == 1) {
+			break;
+		}
+		if (++zeros > 31) {
+			return false;
+		}
+	}
+
+	uint32_t value = 0;
+	for (int i = 0; i < zeros; i++) {
+		if (!bit_read(b, &bit)) {
+			return false;
+		}
+		value = (value << 1) | bit;
+	}
+
+	*out_value = (1u << zeros) - 1 + value;
+
+	return true;
+}
+
+static bool
+rbsp_at_trailing_bits(const struct rbsp_reader *r)
+{
+	return r->pos + 1 >= r->size && (r->pos >= r->size || r->data[r->pos] == 0x80);
+}
+
+static bool
+rbsp_read_be_float(struct rbsp_reader *r, float *out_value)
+{
+	uint32_t bits = 0;
+	for (int i = 0; i < 4; i++) {
+		uint8_t byte = 0;
+		if (!rbsp_read_byte(r, &byte)) {
+			return false;
+		}
+		bits = (bits << 8) | byte;
+	}
+
+	memcpy(out_value, &bits, sizeof(*out_value));
+
+	return true;
+}
+
+//! The foveation follows the id if the frame is foveated.
+static bool
+read_foveation(struct rbsp_reader *r, struct em_sei_foveation *out_foveation)
+{
+	float *values[6] = {
+	    &out_foveation->strength[0],   &out_foveation->strength[1],   //
+	    &out_foveation->centers[0][0], &out_foveation->centers[0][1], //
+	    &out_foveation->centers[1][0], &out_foveation->centers[1][1], //
+	};
+
+	for (int i = 0; i < 6; i++) {
+		if (!rbsp_read_be_float(r, values[i])) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool
+parse_frame_info_sei(const uint8_t *payload, size_t size, void *out)
+{
+	struct em_sei_frame_info *out_info = (struct em_sei_frame_info *)out;
+	struct rbsp_reader r = {payload, size, 0, 0};
+
+	while (!rbsp_at_trailing_bits(&r)) {
+		uint32_t type = 0;
+		uint32_t payload_size = 0;
+		if (!rbsp_read_sei_value(&r, &type) || !rbsp_read_sei_value(&r, &payload_size)) {
+			return false;
+		}
+
+		uint32_t read = 0;
+		if (type == SEI_TYPE_USER_DATA_UNREGISTERED && payload_size >= sizeof(em_sei_frame_id_uuid) + 8) {
+			uint8_t uuid[sizeof(em_sei_frame_id_uuid)];
+			for (; read < sizeof(uuid); read++) {
+				if (!rbsp_read_byte(&r, &uuid[read])) {
+					return false;
+				}
+			}
+
+			if (memcmp(uuid, em_sei_frame_id_uuid, sizeof(uuid)) == 0) {
+				uint64_t id = 0;
+				for (int i = 0; i < 8; i++) {
+					uint8_t byte = 0;
+					if (!rbsp_read_byte(&r, &byte)) {
+						return false;
+					}
+					id = (id << 8) | byte;
+				}
+
+				struct em_sei_frame_info info;
+				memset(&info, 0, sizeof(info));
+				info.frame_id = (int64_t)id;
+
+				bool foveated = payload_size >= sizeof(uuid) + 8 + FOVEATION_SIZE;
+				if (foveated && !read_foveation(&r, &info.foveation)) {
+					return false;
+				}
+
+				*out_info = info;
+				return true;
+			}
+		}
+
+		// Not ours, skip the rest of the message.
+		if (!rbsp_skip(&r, payload_size - read)) {
+			return false;
+		}
+	}
+
+	return false;
+}
+
+static bool
+parse_recovery_point_sei(const uint8_t *payload, size_t size, void *out)
+{
+	uint32_t *out_recovery_frame_count = (uint32_t *)out;
+	struct rbsp_reader r = {payload, size, 0, 0};
+
+	while (!rbsp_at_trailing_bits(&r)) {
+		uint32_t type = 0;
+		uint32_t payload_size = 0;
+		if (!rbsp_read_sei_value(&r, &type) || !rbsp_read_sei_value(&r, &payload_size)) {
+			return false;
+		}
+
+		if (type == SEI_TYPE_RECOVERY_POINT) {
+			// The flags after the count do not matter to us.
+			struct bit_reader b = {&r, 0, 0};
+			return bit_read_ue(&b, out_recovery_frame_count);
+		}
+
+		if (!rbsp_skip(&r, payload_size)) {
+			return false;
+		}
+	}
+
+	return false;
+}
+
+//! Returns the offset just past the next start code at or after @p pos, or @p size if there is none.
+static size_t
+find_start_code(const uint8_t *data, size_t size, size_t pos)
+{
+	for (; pos + 3 <= size; pos++) {
+		if (data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1) {
+			return pos + 3;
+		}
+	}
+
+	return size;
+}
+
+/*!
+ * Run @p parse on the payload of each SEI NAL unit in the access unit, until
+ * it returns true.
+ */
+static bool
+find_in_sei(const uint8_t *data, size_t size, bool (*parse)(const uint8_t *, size_t, void *), void *out)
+{
+	size_t start = find_start_code(data, size, 0);
+
+	while (start < size) {
+		size_t next = find_start_code(data, size, start);
+
+		// The NAL unit ends where the next start code, including any leading zeros, begins.
+		size_t end = next < size ? next - 3 : size;
+		while (end > start && data[end - 1] == 0) {
+			end--;
+		}
+
+		if (end > start && (data[start] & 0x1f) == NAL_TYPE_SEI &&
+		    parse(&data[start + 1], end - start - 1, out)) {
+			return true;
+		}
+
+		start = next;
+	}
+
+	return false;
+}
+
+bool
+em_sei_find_frame_info(const uint8_t *data, size_t size, struct em_sei_frame_info *out_info)
+{
+	return find_in_sei(data, size, parse_frame_info_sei, out_info);
+}
+
+bool
+em_sei_find_recovery_point(const uint8_t *data, size_t size, uint32_t *out_recovery_frame_count)
+{
+	return find_in_sei(data, size, parse_recovery_point_sei, out_recovery_frame_count);
+}
+
+bool
+em_sei_find_frame_id(const uint8_t *data, size_t size, int64_t *out_frame_id)
+{
+	struct em_sei_frame_info info;
+	if (!em_sei_find_frame_info(data, size, &info)) {
+		return false;
+	}
+
+	*out_frame_id = info.frame_id;
+
+	return true;
+}
@@ -0,0 +1,97 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Parsing of the frame id SEI the ElectricMaple server puts in every access unit, and of recovery points
+ * @ingroup em_client
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/*!
+ * Identifies the user_data_unregistered SEI message carrying the frame id,
+ * f8ca2978-b040-4059-9964-78d7ec17d1ec, must match the server.
+ */
+extern const uint8_t em_sei_frame_id_uuid[16];
+
+/*!
+ * How the server warped the views of a frame, to be undone when drawing it.
+ *
+ * Each axis is warped on either side of the center separately: a pixel at a
+ * fraction t of the way from the center to the edge of the picture shows the
+ * view at a fraction sinh(a t) / sinh(a) of the way to the edge of the view,
+ * a being the strength.
+ */
+struct em_sei_foveation
+{
+	//! Warp strength along x and y, zero is no warp.
+	float strength[2];
+
+	//! Point of full density of the left and right view, normalized to [0, 1].
+	float centers[2][2];
+};
+
+/*!
+ * Everything the server tells us about a frame in its SEI.
+ */
+struct em_sei_frame_info
+{
+	int64_t frame_id;
+
+	//! All zero if the frame isn't foveated.
+	struct em_sei_foveation foveation;
+};
+
+/*!
+ * Look for the frame id in a H.264 access unit in byte-stream format.
+ *
+ * @param data The access unit, starting with a start code
+ * @param size Size of @p data in bytes
+ * @param[out] out_frame_id The frame id, set only if found
+ *
+ * @return true if the access unit carries a frame id
+ */
+bool
+em_sei_find_frame_id(const uint8_t *data, size_t size, int64_t *out_frame_id);
+
+/*!
+ * Look for the frame id and whatever else the server sent with it in a H.264
+ * access unit in byte-stream format.
+ *
+ * @param data The access unit, starting with a start code
+ * @param size Size of @p data in bytes
+ * @param[out] out_info The frame info, set only if found
+ *
+ * @return true if the access unit carries a frame id
+ */
+bool
+em_sei_find_frame_info(const uint8_t *data, size_t size, struct em_sei_frame_info *out_info);
+
+/*!
+ * Look for a recovery point SEI in a H.264 access unit in byte-stream
+ * format. Decoding can start at such an access unit instead of an IDR
+ * frame, with intra refresh the server only sends those after the first
+ * frame. The pictures are only whole again once the count of frames after
+ * it have been decoded.
+ *
+ * @param data The access unit, starting with a start code
+ * @param size Size of @p data in bytes
+ * @param[out] out_recovery_frame_count Frames until the pictures are whole, set only if found
+ *
+ * @return true if the access unit is a recovery point
+ */
+bool
+em_sei_find_recovery_point(const uint8_t *data, size_t size, uint32_t *out_recovery_frame_count);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif // __cplusplus
@@ -11,6 +11,7 @@
 #include "em_stream_client.h"
 #include "em_app_log.h"
 #include "em_connection.h"
+#include "em_sei.h"
 #include "gst_common.h" // for em_sample
 #include "em/em_egl.h"
 
@@ -45,6 +46,9 @@ em_gst_message_debug(const char *function, GstMessage *msg);
 		em_gst_message_debug(__FUNCTION__, MSG);                                                               \
 	} while (0)
 
+// Frames that can be between the parser and the appsink, that is inside the decoder.
+#define MAX_PENDING_FRAME_IDS (16)
+
 struct em_sc_sample
 {
 	struct em_sample base;
@@ -96,6 +100,33 @@ struct _EmStreamClient
 	GMutex sample_mutex;
 	GstSample *sample;
 	struct timespec sample_decode_end_ts;
+	struct em_sei_frame_info sample_frame_info;
+
+	//! Frame info found in the bitstream keyed by timestamp, protected by @ref sample_mutex.
+	struct
+	{
+		GstClockTime pts[MAX_PENDING_FRAME_IDS];
+		struct em_sei_frame_info infos[MAX_PENDING_FRAME_IDS];
+		uint32_t next;
+	} frame_ids;
+
+	/*!
+	 * Decoding starts at an IDR frame or at a recovery point, with intra
+	 * refresh the server sends no IDR frames after the first one. From a
+	 * recovery point the pictures are only whole after the frames it says,
+	 * those before are decoded but not shown. Protected by @ref sample_mutex.
+	 */
+	struct
+	{
+		//! Nothing to start from has come yet, access units are dropped before the decoder.
+		bool waiting;
+
+		//! Access units to go until the pictures are whole.
+		uint32_t frames_to_recovery;
+
+		//! Decoded frames before this are not shown, GST_CLOCK_TIME_NONE until known.
+		GstClockTime shown_from_pts;
+	} sync;
 };
 
 #if 0
@@ -332,11 +363,77 @@ gst_bus_cb(GstBus *bus, GstMessage *message, gpointer data)
 	return TRUE;
 }
 
+static GstPadProbeReturn
+on_parsed_buffer_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	EmStreamClient *sc = (EmStreamClient *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+	GstMapInfo map;
+	if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+		return GST_PAD_PROBE_OK;
+	}
+
+	struct em_sei_frame_info info;
+	bool found = em_sei_find_frame_info(map.data, map.size, &info);
+	uint32_t recovery_frames = 0;
+	bool recovery_point = em_sei_find_recovery_point(map.data, map.size, &recovery_frames);
+	gst_buffer_unmap(buffer, &map);
+
+	g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->sample_mutex);
+
+	if (sc->sync.waiting) {
+		// h264parse flags IDR frames as not being delta units.
+		bool idr = !recovery_point && !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+		if (!idr && !recovery_point) {
+			return GST_PAD_PROBE_DROP;
+		}
+
+		ALOGI("%s: Starting to decode at %s", __FUNCTION__, idr ? "an IDR frame" : "a recovery point");
+		sc->sync.waiting = false;
+		sc->sync.frames_to_recovery = idr ? 0 : recovery_frames;
+	}
+
+	if (sc->sync.shown_from_pts == GST_CLOCK_TIME_NONE) {
+		if (sc->sync.frames_to_recovery == 0) {
+			sc->sync.shown_from_pts = GST_BUFFER_PTS(buffer);
+		} else {
+			sc->sync.frames_to_recovery--;
+		}
+	}
+
+	if (found) {
+		// The decoder keeps the timestamp, that is how we find the id again.
+		sc->frame_ids.pts[sc->frame_ids.next] = GST_BUFFER_PTS(buffer);
+		sc->frame_ids.infos[sc->frame_ids.next] = info;
+		sc->frame_ids.next = (sc->frame_ids.next + 1) % MAX_PENDING_FRAME_IDS;
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+//! Must be called with the sample mutex held, the info is all zero if none was found.
+static struct em_sei_frame_info
+take_frame_info_locked(EmStreamClient *sc, GstClockTime pts)
+{
+	struct em_sei_frame_info info;
+	memset(&info, 0, sizeof(info));
+
+	for (uint32_t i = 0; i < MAX_PENDING_FRAME_IDS; i++) {
+		if (sc->frame_ids.infos[i].frame_id != 0 && sc->frame_ids.pts[i] == pts) {
+			info = sc->frame_ids.infos[i];
+			sc->frame_ids.infos[i].frame_id = 0;
+			break;
+		}
+	}
+
+	return info;
+}
+
 static GstFlowReturn
 on_new_sample_cb(GstAppSink *appsink, gpointer user_data)
 {
 	EmStreamClient *sc = (EmStreamClient *)user_data;
-	// TODO record the frame ID, get frame pose
 	struct timespec ts;
 	int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
 	if (ret != 0) {
@@ -348,9 +445,16 @@ on_new_sample_cb(GstAppSink *appsink, gpointer user_data)
 	g_assert_nonnull(sample);
 	{
 		g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->sample_mutex);
+		GstClockTime pts = GST_BUFFER_PTS(gst_sample_get_buffer(sample));
+		if (sc->sync.shown_from_pts == GST_CLOCK_TIME_NONE || pts < sc->sync.shown_from_pts) {
+			// Still refreshing after a recovery point, parts of the picture are garbage.
+			gst_sample_unref(sample);
+			return GST_FLOW_OK;
+		}
 		prevSample = sc->sample;
 		sc->sample = sample;
 		sc->sample_decode_end_ts = ts;
+		sc->sample_frame_info = take_frame_info_locked(sc, GST_BUFFER_PTS(gst_sample_get_buffer(sample)));
 		sc->received_first_frame = true;
 	}
 	if (prevSample) {
@@ -383,7 +487,7 @@ on_need_pipeline_cb(EmConnection *emconn, EmStreamClient *sc)
 	gchar *pipeline_string = g_strdup_printf(
 	    "webrtcbin name=webrtc bundle-policy=max-bundle latency=0 ! "
 	    "rtph264depay ! "
-	    "h264parse ! "
+	    "h264parse name=parse ! "
 	    "video/x-h264,stream-format=(string)byte-stream, alignment=(string)au,parsed=(boolean)true !"
 	    "amcviddec-omxqcomvideodecoderavc ! "
 	    "glsinkbin name=glsink");
@@ -425,6 +529,17 @@ on_need_pipeline_cb(EmConnection *emconn, EmStreamClient *sc)
 	callbacks.new_sample = on_new_sample_cb;
 	gst_app_sink_set_callbacks(GST_APP_SINK(sc->appsink), &callbacks, sc, NULL);
 	sc->received_first_frame = false;
+	{
+		g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->sample_mutex);
+		sc->sync.waiting = true;
+		sc->sync.frames_to_recovery = 0;
+		sc->sync.shown_from_pts = GST_CLOCK_TIME_NONE;
+	}
+
+	// Picks up the frame id the server put in each access unit.
+	g_autoptr(GstElement) parse = gst_bin_get_by_name(GST_BIN(sc->pipeline), "parse");
+	g_autoptr(GstPad) parse_src = gst_element_get_static_pad(parse, "src");
+	gst_pad_add_probe(parse_src, GST_PAD_PROBE_TYPE_BUFFER, on_parsed_buffer_probe_cb, sc, NULL);
 
 	g_autoptr(GstElement) glsinkbin = gst_bin_get_by_name(GST_BIN(sc->pipeline), "glsink");
 	g_object_set(glsinkbin, "sink", sc->appsink, NULL);
@@ -596,11 +711,13 @@ em_stream_client_try_pull_sample(EmStreamClient *sc, struct timespec *out_decode
 	// pulled.
 	GstSample *sample = NULL;
 	struct timespec decode_end;
+	struct em_sei_frame_info frame_info;
 	{
 		g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&sc->sample_mutex);
 		sample = sc->sample;
 		sc->sample = NULL;
 		decode_end = sc->sample_decode_end_ts;
+		frame_info = sc->sample_frame_info;
 	}
 
 	if (sample == NULL) {
@@ -655,6 +772,8 @@ em_stream_client_try_pull_sample(EmStreamClient *sc, struct timespec *out_decode
 		}
 	}
 	ret->base.frame_texture_target = sc->frame_texture_target;
+	ret->base.frame_sequence_id = frame_info.frame_id;
+	ret->base.foveation = frame_info.foveation;
 
 	GstGLSyncMeta *sync_meta = gst_buffer_get_gl_sync_meta(buffer);
 	if (sync_meta) {
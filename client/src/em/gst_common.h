@@ -15,6 +15,8 @@
 
 #pragma once
 
+#include "em_sei.h"
+
 #include <GLES3/gl3.h>
 #include <GLES3/gl3ext.h>
 #include <EGL/egl.h>
@@ -31,9 +33,16 @@
 
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 struct em_sample
 {
 	GLuint frame_texture_id;
 	GLenum frame_texture_target;
+
+	//! Id the server gave the frame, matches the frame data sent down, 0 if unknown.
+	int64_t frame_sequence_id;
+
+	//! How the server warped the views, to be undone when drawing.
+	struct em_sei_foveation foveation;
 };
@@ -40,14 +40,40 @@ static constexpr const GLchar *fragmentShaderSource = R"(
     #version 300 es
     #extension GL_OES_EGL_image_external : require
     #extension GL_OES_EGL_image_external_essl3 : require
-    precision mediump float;
+    precision highp float;
 
     in vec2 frag_uv;
     out vec4 frag_color;
     uniform samplerExternalOES textureSampler;
 
+    // Foveation the server packed the views with, centers of the left eye in
+    // xy and of the right one in zw, see em_sei_foveation.
+    uniform vec2 foveationStrength;
+    uniform vec4 foveationCenters;
+
+    // Where in the picture a point of the view is, both normalized, the
+    // inverse of the server's warp on either side of the center.
+    float unfoveate(float v, float center, float strength) {
+        if (strength <= 0.0) {
+            return v;
+        }
+
+        float side = v >= center ? 1.0 - center : -center;
+        float s = (v - center) / side;
+
+        return center + side * asinh(s * sinh(strength)) / strength;
+    }
+
     void main() {
-        frag_color = texture(textureSampler, frag_uv);
+        // Side-by-side views, each eye gets its own half.
+        float eye = frag_uv.x < 0.5 ? 0.0 : 1.0;
+        vec2 local = vec2(frag_uv.x * 2.0 - eye, frag_uv.y);
+        vec2 center = eye == 0.0 ? foveationCenters.xy : foveationCenters.zw;
+
+        local = vec2(unfoveate(local.x, center.x, foveationStrength.x),
+                     unfoveate(local.y, center.y, foveationStrength.y));
+
+        frag_color = texture(textureSampler, vec2((local.x + eye) * 0.5, local.y));
     }
 )";
 
@@ -104,6 +130,8 @@ Renderer::setupShaders()
 	glDeleteShader(fragmentShader);
 
 	textureSamplerLocation_ = glGetUniformLocation(program, "textureSampler");
+	foveationStrengthLocation_ = glGetUniformLocation(program, "foveationStrength");
+	foveationCentersLocation_ = glGetUniformLocation(program, "foveationCenters");
 }
 
 struct TextureCoord
@@ -182,7 +210,7 @@ Renderer::reset()
 }
 
 void
-Renderer::draw(GLuint texture, GLenum texture_target) const
+Renderer::draw(GLuint texture, GLenum texture_target, const em_sei_foveation &foveation) const
 {
 	//    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
 
@@ -195,6 +223,10 @@ Renderer::draw(GLuint texture, GLenum texture_target) const
 	glBindTexture(texture_target, texture);
 	glUniform1i(textureSamplerLocation_, 0);
 
+	glUniform2f(foveationStrengthLocation_, foveation.strength[0], foveation.strength[1]);
+	glUniform4f(foveationCentersLocation_, foveation.centers[0][0], foveation.centers[0][1], foveation.centers[1][0],
+	            foveation.centers[1][1]);
+
 	// Draw the quad
 	glBindVertexArray(quadVAO);
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
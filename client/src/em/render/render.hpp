@@ -11,6 +11,8 @@
 
 #pragma once
 
+#include "../em_sei.h"
+
 #include <EGL/egl.h>
 #include <GLES3/gl3.h>
 #include <memory>
@@ -37,9 +39,9 @@ public:
 	void
 	reset();
 
-	/// Draw texture to framebuffer. Must call with EGL Context current.
+	/// Draw texture to framebuffer, undoing the server's foveation. Must call with EGL Context current.
 	void
-	draw(GLuint texture, GLenum texture_target) const;
+	draw(GLuint texture, GLenum texture_target, const em_sei_foveation &foveation) const;
 
 
 private:
@@ -53,4 +55,6 @@ private:
 	GLuint quadVBO = 0;
 
 	GLint textureSamplerLocation_ = 0;
+	GLint foveationStrengthLocation_ = 0;
+	GLint foveationCentersLocation_ = 0;
 };
@@ -49,7 +49,9 @@
 #include <assert.h>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <vector>
 
 
 #define XR_LOAD(fn) xrGetInstanceProcAddr(state.instance, #fn, (PFN_xrVoidFunction *)&fn);
@@ -65,6 +67,9 @@ struct em_state
 	XrSession session;
 	XrSessionState sessionState;
 
+	//! The runtime can tell us where the user looks, see XR_EXT_eye_gaze_interaction.
+	bool eyeGaze;
+
 	uint32_t width;
 	uint32_t height;
 
@@ -234,9 +239,25 @@ android_main(struct android_app *app)
 
 	// Create OpenXR instance
 
-	const char *extensions[] = {XR_KHR_OPENGL_ES_ENABLE_EXTENSION_NAME,
-	                            XR_KHR_ANDROID_CREATE_INSTANCE_EXTENSION_NAME,
-	                            XR_KHR_CONVERT_TIMESPEC_TIME_EXTENSION_NAME};
+	std::vector<const char *> extensions = {XR_KHR_OPENGL_ES_ENABLE_EXTENSION_NAME,
+	                                        XR_KHR_ANDROID_CREATE_INSTANCE_EXTENSION_NAME,
+	                                        XR_KHR_CONVERT_TIMESPEC_TIME_EXTENSION_NAME};
+
+	// Eye tracking is optional, if there is any the server foveates on the gaze.
+	bool eyeGazeExtension = false;
+	{
+		uint32_t count = 0;
+		xrEnumerateInstanceExtensionProperties(NULL, 0, &count, NULL);
+		std::vector<XrExtensionProperties> properties(count, {XR_TYPE_EXTENSION_PROPERTIES});
+		xrEnumerateInstanceExtensionProperties(NULL, count, &count, properties.data());
+
+		for (const XrExtensionProperties &property : properties) {
+			if (strcmp(property.extensionName, XR_EXT_EYE_GAZE_INTERACTION_EXTENSION_NAME) == 0) {
+				eyeGazeExtension = true;
+				extensions.push_back(XR_EXT_EYE_GAZE_INTERACTION_EXTENSION_NAME);
+			}
+		}
+	}
 
 	XrInstanceCreateInfoAndroidKHR androidInfo = {};
 	androidInfo.type = XR_TYPE_INSTANCE_CREATE_INFO_ANDROID_KHR;
@@ -254,8 +275,8 @@ android_main(struct android_app *app)
 	instanceInfo.applicationInfo.applicationName[XR_MAX_APPLICATION_NAME_SIZE - 1] = '\0';
 
 	instanceInfo.applicationInfo.apiVersion = XR_CURRENT_API_VERSION;
-	instanceInfo.enabledExtensionCount = sizeof(extensions) / sizeof(extensions[0]);
-	instanceInfo.enabledExtensionNames = extensions;
+	instanceInfo.enabledExtensionCount = (uint32_t)extensions.size();
+	instanceInfo.enabledExtensionNames = extensions.data();
 
 
 	result = xrCreateInstance(&instanceInfo, &state.instance);
@@ -272,6 +293,16 @@ android_main(struct android_app *app)
 
 	result = xrGetSystem(state.instance, &systemInfo, &state.system);
 
+	if (eyeGazeExtension) {
+		XrSystemEyeGazeInteractionPropertiesEXT eyeGazeProperties = {
+		    .type = XR_TYPE_SYSTEM_EYE_GAZE_INTERACTION_PROPERTIES_EXT};
+		XrSystemProperties systemProperties = {.type = XR_TYPE_SYSTEM_PROPERTIES, .next = &eyeGazeProperties};
+
+		result = xrGetSystemProperties(state.instance, state.system, &systemProperties);
+		state.eyeGaze = XR_SUCCEEDED(result) && eyeGazeProperties.supportsEyeGazeInteraction == XR_TRUE;
+	}
+	ALOGI("Eye gaze interaction: %s", state.eyeGaze ? "supported" : "not supported");
+
 	uint32_t viewConfigurationCount;
 	XrViewConfigurationType viewConfigurations[2];
 	result =
@@ -354,8 +385,8 @@ android_main(struct android_app *app)
 	em_connection_connect(state.connection);
 
 	XrExtent2Di eye_extents{static_cast<int32_t>(state.width), static_cast<int32_t>(state.height)};
-	EmRemoteExperience *remote_experience =
-	    em_remote_experience_new(state.connection, stream_client, state.instance, state.session, &eye_extents);
+	EmRemoteExperience *remote_experience = em_remote_experience_new(state.connection, stream_client, state.instance,
+	                                                                 state.session, &eye_extents, state.eyeGaze);
 	if (!remote_experience) {
 		ALOGE("%s: Failed during remote experience init.", __FUNCTION__);
 		return;
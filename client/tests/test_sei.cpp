@@ -0,0 +1,224 @@
+// Copyright 2023, Pluto VR, Inc.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ */
+
+#include "catch2/catch_message.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include "em/em_sei.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+namespace {
+
+using Bytes = std::vector<uint8_t>;
+
+const Bytes kAud = {0, 0, 0, 1, 0x09, 0xf0};
+const Bytes kSlice = {0, 0, 1, 0x65, 0x88, 0x84, 0x00, 0x21, 0xff};
+const uint8_t kOtherUuid[16] = {0xdc, 0x45, 0xe9, 0xbd, 0xe6, 0xd9, 0x48, 0xb7,
+                                0x96, 0x2c, 0xd8, 0x20, 0xd9, 0x23, 0xee, 0xef};
+
+/// Wrap SEI messages into a NAL unit, escaping them and adding the trailing bits.
+Bytes makeSeiNal(const Bytes &rbsp) {
+  Bytes nal = {0, 0, 0, 1, 0x06};
+  int zeros = 0;
+  for (uint8_t byte : rbsp) {
+    if (zeros == 2 && byte <= 3) {
+      nal.push_back(3);
+      zeros = 0;
+    }
+    nal.push_back(byte);
+    zeros = byte == 0 ? zeros + 1 : 0;
+  }
+  nal.push_back(0x80);
+  return nal;
+}
+
+/// The frame id SEI message, the foveation follows the id if given.
+Bytes makeFrameIdMessage(const uint8_t (&uuid)[16], int64_t id,
+                         const std::vector<float> &foveation = {}) {
+  Bytes rbsp = {5, uint8_t(16 + 8 + 4 * foveation.size())};
+  rbsp.insert(rbsp.end(), std::begin(uuid), std::end(uuid));
+  for (int i = 0; i < 8; i++) {
+    rbsp.push_back(uint8_t(uint64_t(id) >> (56 - 8 * i)));
+  }
+  for (float value : foveation) {
+    uint32_t bits = 0;
+    std::memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 4; i++) {
+      rbsp.push_back(uint8_t(bits >> (24 - 8 * i)));
+    }
+  }
+  return rbsp;
+}
+
+/// Build a complete SEI NAL unit the way the server does, the foveation follows the id if given.
+Bytes makeSei(const uint8_t (&uuid)[16], int64_t id,
+              const std::vector<float> &foveation = {}) {
+  return makeSeiNal(makeFrameIdMessage(uuid, id, foveation));
+}
+
+/// A recovery point SEI message as x264 writes it with intra refresh.
+Bytes makeRecoveryPointMessage(uint32_t count) {
+  std::vector<bool> bits;
+  uint32_t value = count + 1;
+  int length = 0;
+  while ((value >> length) > 1) {
+    length++;
+  }
+  bits.insert(bits.end(), length, false);
+  for (int i = length; i >= 0; i--) {
+    bits.push_back((value >> i) & 1);
+  }
+  // exact_match_flag, broken_link_flag and changing_slice_group_idc.
+  bits.insert(bits.end(), {true, false, false, false});
+  // Payload alignment: a one, then zeros up to the byte boundary.
+  bits.push_back(true);
+  while (bits.size() % 8 != 0) {
+    bits.push_back(false);
+  }
+
+  Bytes rbsp = {6, uint8_t(bits.size() / 8)};
+  for (size_t i = 0; i < bits.size(); i += 8) {
+    uint8_t byte = 0;
+    for (size_t j = 0; j < 8; j++) {
+      byte = uint8_t(byte << 1) | uint8_t(bits[i + j]);
+    }
+    rbsp.push_back(byte);
+  }
+  return rbsp;
+}
+
+Bytes concat(std::initializer_list<Bytes> parts) {
+  Bytes ret;
+  for (const auto &part : parts) {
+    ret.insert(ret.end(), part.begin(), part.end());
+  }
+  return ret;
+}
+
+bool findId(const Bytes &au, int64_t &id) {
+  return em_sei_find_frame_id(au.data(), au.size(), &id);
+}
+
+} // namespace
+
+TEST_CASE("FrameIdSei") {
+  int64_t id = 0;
+
+  SECTION("Plain id") {
+    CHECK(findId(concat({kAud, makeSei(em_sei_frame_id_uuid, 42), kSlice}), id));
+    CHECK(id == 42);
+  }
+
+  SECTION("Id needing emulation prevention") {
+    const int64_t kId = 0x0000000100000002;
+    Bytes sei = makeSei(em_sei_frame_id_uuid, kId);
+    INFO("The escaped SEI must be longer than the unescaped one");
+    CHECK(sei.size() > 4 + 1 + 2 + 16 + 8 + 1);
+
+    CHECK(findId(concat({kAud, sei, kSlice}), id));
+    CHECK(id == kId);
+  }
+
+  SECTION("After another SEI message") {
+    CHECK(findId(concat({kAud, makeSei(kOtherUuid, 7),
+                         makeSei(em_sei_frame_id_uuid, 1234), kSlice}),
+                 id));
+    CHECK(id == 1234);
+  }
+
+  SECTION("No SEI at all") {
+    CHECK_FALSE(findId(concat({kAud, kSlice}), id));
+    CHECK(id == 0);
+  }
+
+  SECTION("Someone else's SEI") {
+    CHECK_FALSE(findId(concat({kAud, makeSei(kOtherUuid, 7), kSlice}), id));
+    CHECK(id == 0);
+  }
+
+  SECTION("Truncated SEI") {
+    Bytes sei = makeSei(em_sei_frame_id_uuid, 42);
+    sei.resize(sei.size() - 4);
+    CHECK_FALSE(findId(sei, id));
+  }
+}
+
+TEST_CASE("FrameInfoSei") {
+  em_sei_frame_info info{};
+
+  SECTION("Without foveation") {
+    Bytes au = concat({kAud, makeSei(em_sei_frame_id_uuid, 42), kSlice});
+    CHECK(em_sei_find_frame_info(au.data(), au.size(), &info));
+    CHECK(info.frame_id == 42);
+    CHECK(info.foveation.strength[0] == 0.0f);
+    CHECK(info.foveation.strength[1] == 0.0f);
+  }
+
+  SECTION("With foveation") {
+    Bytes au = concat({kAud,
+                       makeSei(em_sei_frame_id_uuid, 43,
+                               {1.5f, 1.25f, 0.5f, 0.25f, 0.75f, 0.0f}),
+                       kSlice});
+    CHECK(em_sei_find_frame_info(au.data(), au.size(), &info));
+    CHECK(info.frame_id == 43);
+    CHECK(info.foveation.strength[0] == 1.5f);
+    CHECK(info.foveation.strength[1] == 1.25f);
+    CHECK(info.foveation.centers[0][0] == 0.5f);
+    CHECK(info.foveation.centers[0][1] == 0.25f);
+    CHECK(info.foveation.centers[1][0] == 0.75f);
+    CHECK(info.foveation.centers[1][1] == 0.0f);
+
+    INFO("Only reading the id still works");
+    int64_t id = 0;
+    CHECK(findId(au, id));
+    CHECK(id == 43);
+  }
+}
+
+TEST_CASE("RecoveryPointSei") {
+  uint32_t count = 12345;
+
+  SECTION("Next to the frame id") {
+    Bytes au = concat({kAud, makeSeiNal(makeRecoveryPointMessage(59)),
+                       makeSei(em_sei_frame_id_uuid, 42), kSlice});
+    CHECK(em_sei_find_recovery_point(au.data(), au.size(), &count));
+    CHECK(count == 59);
+
+    INFO("The frame id is still found");
+    int64_t id = 0;
+    CHECK(findId(au, id));
+    CHECK(id == 42);
+  }
+
+  SECTION("Counts of different lengths") {
+    for (uint32_t expected : {0u, 1u, 2u, 255u, 1000u, 70000u}) {
+      Bytes au =
+          concat({kAud, makeSeiNal(makeRecoveryPointMessage(expected)), kSlice});
+      INFO("Count " << expected);
+      CHECK(em_sei_find_recovery_point(au.data(), au.size(), &count));
+      CHECK(count == expected);
+    }
+  }
+
+  SECTION("After another message in the same SEI") {
+    Bytes rbsp = makeFrameIdMessage(kOtherUuid, 7);
+    Bytes recovery = makeRecoveryPointMessage(30);
+    rbsp.insert(rbsp.end(), recovery.begin(), recovery.end());
+    Bytes au = concat({kAud, makeSeiNal(rbsp), kSlice});
+    CHECK(em_sei_find_recovery_point(au.data(), au.size(), &count));
+    CHECK(count == 30);
+  }
+
+  SECTION("Only a frame id") {
+    Bytes au = concat({kAud, makeSei(em_sei_frame_id_uuid, 42), kSlice});
+    CHECK_FALSE(em_sei_find_recovery_point(au.data(), au.size(), &count));
+    CHECK(count == 12345);
+  }
+}
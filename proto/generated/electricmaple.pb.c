@@ -18,6 +18,9 @@ PB_BIND(em_proto_Vec2, em_proto_Vec2, AUTO)
 PB_BIND(em_proto_Pose, em_proto_Pose, AUTO)
 
 
+PB_BIND(em_proto_Fov, em_proto_Fov, AUTO)
+
+
 PB_BIND(em_proto_TrackingMessage, em_proto_TrackingMessage, 2)
 
 
@@ -42,12 +45,21 @@ PB_BIND(em_proto_TouchControllerRight, em_proto_TouchControllerRight, AUTO)
 PB_BIND(em_proto_UpFrameMessage, em_proto_UpFrameMessage, AUTO)
 
 
+PB_BIND(em_proto_GazeMessage, em_proto_GazeMessage, AUTO)
+
+
+PB_BIND(em_proto_ProbeReplyMessage, em_proto_ProbeReplyMessage, AUTO)
+
+
 PB_BIND(em_proto_UpMessage, em_proto_UpMessage, 2)
 
 
 PB_BIND(em_proto_DownFrameDataMessage, em_proto_DownFrameDataMessage, AUTO)
 
 
+PB_BIND(em_proto_ProbeMessage, em_proto_ProbeMessage, AUTO)
+
+
 PB_BIND(em_proto_DownMessage, em_proto_DownMessage, AUTO)
 
 
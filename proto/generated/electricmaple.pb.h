@@ -42,6 +42,14 @@ typedef struct _em_proto_Pose {
     em_proto_Quaternion orientation;
 } em_proto_Pose;
 
+/* Angles in radians, as in XrFovf */
+typedef struct _em_proto_Fov {
+    float angle_left;
+    float angle_right;
+    float angle_up;
+    float angle_down;
+} em_proto_Fov;
+
 typedef struct _em_proto_TrackingMessage {
     bool has_P_localSpace_viewSpace;
     em_proto_Pose P_localSpace_viewSpace;
@@ -117,24 +125,67 @@ typedef struct _em_proto_UpFrameMessage {
     int64_t display_time; /* nanoseconds, in client OpenXR time domain */
 } em_proto_UpFrameMessage;
 
+/* Where the user looks, from eye tracking */
+typedef struct _em_proto_GazeMessage {
+    bool has_direction;
+    em_proto_Vec3 direction; /* unit vector in view space, -z is straight ahead */
+    float confidence; /* 0 to 1, 0 when the eyes are not tracked */
+    int64_t timestamp; /* nanoseconds, in client OpenXR time domain, when the eyes were sampled */
+} em_proto_GazeMessage;
+
+/* Answer to a ProbeMessage, sent as soon as it arrives */
+typedef struct _em_proto_ProbeReplyMessage {
+    int32_t sequence; /* of the probe */
+    int64_t send_time; /* copied from the probe */
+    int64_t receive_time; /* nanoseconds, client monotonic clock, when the probe arrived */
+    int32_t size; /* bytes of the probe as received, with its padding */
+} em_proto_ProbeReplyMessage;
+
 typedef struct _em_proto_UpMessage {
     int64_t up_message_id;
     bool has_tracking;
     em_proto_TrackingMessage tracking;
     bool has_frame;
     em_proto_UpFrameMessage frame;
+    bool has_gaze;
+    em_proto_GazeMessage gaze;
+    bool has_probe_reply;
+    em_proto_ProbeReplyMessage probe_reply;
 } em_proto_UpMessage;
 
+/* Sent for every encoded frame, the frame carries the same id in a SEI NAL unit */
 typedef struct _em_proto_DownFrameDataMessage {
     int64_t frame_sequence_id;
     bool has_P_localSpace_viewSpace;
     em_proto_Pose P_localSpace_viewSpace;
-    int64_t display_time; /* TODO fovs here */
+    int64_t display_time; /* nanoseconds, predicted display time in server time domain */
+    bool has_P_localSpace_view0;
+    em_proto_Pose P_localSpace_view0; /* Left view the frame was rendered with */
+    bool has_P_localSpace_view1;
+    em_proto_Pose P_localSpace_view1; /* Right view the frame was rendered with */
+    bool has_fov0;
+    em_proto_Fov fov0;
+    bool has_fov1;
+    em_proto_Fov fov1;
+    /* Rows below the views holding their depth, 0 if the picture has no depth band */
+    int32_t depth_band_height;
+    /* Meters, the distance at full scale in the depth band, 0 if this frame has no depth */
+    float depth_near;
 } em_proto_DownFrameDataMessage;
 
+/* Sent in short trains when the data channel opens, to measure the path to the client.
+ Padding follows the encoded message after a zero byte, decode it null terminated. */
+typedef struct _em_proto_ProbeMessage {
+    int32_t sequence; /* counts up over all trains */
+    int32_t train; /* which train it belongs to */
+    int64_t send_time; /* nanoseconds, in server time domain */
+} em_proto_ProbeMessage;
+
 typedef struct _em_proto_DownMessage {
     bool has_frame_data;
     em_proto_DownFrameDataMessage frame_data;
+    bool has_probe;
+    em_proto_ProbeMessage probe;
 } em_proto_DownMessage;
 
 
@@ -162,12 +213,17 @@ extern "C" {
 
 
 
+
+
+
+
 
 /* Initializer values for message structs */
 #define em_proto_Quaternion_init_default         {0, 0, 0, 0}
 #define em_proto_Vec3_init_default               {0, 0, 0}
 #define em_proto_Vec2_init_default               {0, 0}
 #define em_proto_Pose_init_default               {false, em_proto_Vec3_init_default, false, em_proto_Quaternion_init_default}
+#define em_proto_Fov_init_default                {0, 0, 0, 0}
 #define em_proto_TrackingMessage_init_default    {false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, 0, 0}
 #define em_proto_InputThumbstick_init_default    {false, em_proto_Vec2_init_default, 0, 0}
 #define em_proto_InputValueTouch_init_default    {0, 0}
@@ -176,13 +232,17 @@ extern "C" {
 #define em_proto_TouchControllerLeft_init_default {false, em_proto_InputClickTouch_init_default, false, em_proto_InputClickTouch_init_default, false, em_proto_InputClickTouch_init_default, false, em_proto_TouchControllerCommon_init_default}
 #define em_proto_TouchControllerRight_init_default {false, em_proto_InputClickTouch_init_default, false, em_proto_InputClickTouch_init_default, false, em_proto_InputClickTouch_init_default, false, em_proto_TouchControllerCommon_init_default}
 #define em_proto_UpFrameMessage_init_default     {0, 0, 0, 0}
-#define em_proto_UpMessage_init_default          {0, false, em_proto_TrackingMessage_init_default, false, em_proto_UpFrameMessage_init_default}
-#define em_proto_DownFrameDataMessage_init_default {0, false, em_proto_Pose_init_default, 0}
-#define em_proto_DownMessage_init_default        {false, em_proto_DownFrameDataMessage_init_default}
+#define em_proto_GazeMessage_init_default        {false, em_proto_Vec3_init_default, 0, 0}
+#define em_proto_ProbeReplyMessage_init_default  {0, 0, 0, 0}
+#define em_proto_UpMessage_init_default          {0, false, em_proto_TrackingMessage_init_default, false, em_proto_UpFrameMessage_init_default, false, em_proto_GazeMessage_init_default, false, em_proto_ProbeReplyMessage_init_default}
+#define em_proto_DownFrameDataMessage_init_default {0, false, em_proto_Pose_init_default, 0, false, em_proto_Pose_init_default, false, em_proto_Pose_init_default, false, em_proto_Fov_init_default, false, em_proto_Fov_init_default, 0, 0}
+#define em_proto_ProbeMessage_init_default       {0, 0, 0}
+#define em_proto_DownMessage_init_default        {false, em_proto_DownFrameDataMessage_init_default, false, em_proto_ProbeMessage_init_default}
 #define em_proto_Quaternion_init_zero            {0, 0, 0, 0}
 #define em_proto_Vec3_init_zero                  {0, 0, 0}
 #define em_proto_Vec2_init_zero                  {0, 0}
 #define em_proto_Pose_init_zero                  {false, em_proto_Vec3_init_zero, false, em_proto_Quaternion_init_zero}
+#define em_proto_Fov_init_zero                   {0, 0, 0, 0}
 #define em_proto_TrackingMessage_init_zero       {false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, 0, 0}
 #define em_proto_InputThumbstick_init_zero       {false, em_proto_Vec2_init_zero, 0, 0}
 #define em_proto_InputValueTouch_init_zero       {0, 0}
@@ -191,9 +251,12 @@ extern "C" {
 #define em_proto_TouchControllerLeft_init_zero   {false, em_proto_InputClickTouch_init_zero, false, em_proto_InputClickTouch_init_zero, false, em_proto_InputClickTouch_init_zero, false, em_proto_TouchControllerCommon_init_zero}
 #define em_proto_TouchControllerRight_init_zero  {false, em_proto_InputClickTouch_init_zero, false, em_proto_InputClickTouch_init_zero, false, em_proto_InputClickTouch_init_zero, false, em_proto_TouchControllerCommon_init_zero}
 #define em_proto_UpFrameMessage_init_zero        {0, 0, 0, 0}
-#define em_proto_UpMessage_init_zero             {0, false, em_proto_TrackingMessage_init_zero, false, em_proto_UpFrameMessage_init_zero}
-#define em_proto_DownFrameDataMessage_init_zero  {0, false, em_proto_Pose_init_zero, 0}
-#define em_proto_DownMessage_init_zero           {false, em_proto_DownFrameDataMessage_init_zero}
+#define em_proto_GazeMessage_init_zero           {false, em_proto_Vec3_init_zero, 0, 0}
+#define em_proto_ProbeReplyMessage_init_zero     {0, 0, 0, 0}
+#define em_proto_UpMessage_init_zero             {0, false, em_proto_TrackingMessage_init_zero, false, em_proto_UpFrameMessage_init_zero, false, em_proto_GazeMessage_init_zero, false, em_proto_ProbeReplyMessage_init_zero}
+#define em_proto_DownFrameDataMessage_init_zero  {0, false, em_proto_Pose_init_zero, 0, false, em_proto_Pose_init_zero, false, em_proto_Pose_init_zero, false, em_proto_Fov_init_zero, false, em_proto_Fov_init_zero, 0, 0}
+#define em_proto_ProbeMessage_init_zero          {0, 0, 0}
+#define em_proto_DownMessage_init_zero           {false, em_proto_DownFrameDataMessage_init_zero, false, em_proto_ProbeMessage_init_zero}
 
 /* Field tags (for use in manual encoding/decoding) */
 #define em_proto_Quaternion_w_tag                1
@@ -207,6 +270,10 @@ extern "C" {
 #define em_proto_Vec2_y_tag                      2
 #define em_proto_Pose_position_tag               1
 #define em_proto_Pose_orientation_tag            2
+#define em_proto_Fov_angle_left_tag              1
+#define em_proto_Fov_angle_right_tag             2
+#define em_proto_Fov_angle_up_tag                3
+#define em_proto_Fov_angle_down_tag              4
 #define em_proto_TrackingMessage_P_localSpace_viewSpace_tag 1
 #define em_proto_TrackingMessage_P_viewSpace_view0_tag 2
 #define em_proto_TrackingMessage_P_viewSpace_view1_tag 3
@@ -239,13 +306,32 @@ extern "C" {
 #define em_proto_UpFrameMessage_decode_complete_time_tag 2
 #define em_proto_UpFrameMessage_begin_frame_time_tag 3
 #define em_proto_UpFrameMessage_display_time_tag 4
+#define em_proto_GazeMessage_direction_tag       1
+#define em_proto_GazeMessage_confidence_tag      2
+#define em_proto_GazeMessage_timestamp_tag       3
+#define em_proto_ProbeReplyMessage_sequence_tag  1
+#define em_proto_ProbeReplyMessage_send_time_tag 2
+#define em_proto_ProbeReplyMessage_receive_time_tag 3
+#define em_proto_ProbeReplyMessage_size_tag      4
 #define em_proto_UpMessage_up_message_id_tag     1
 #define em_proto_UpMessage_tracking_tag          2
 #define em_proto_UpMessage_frame_tag             3
+#define em_proto_UpMessage_gaze_tag              4
+#define em_proto_UpMessage_probe_reply_tag       5
 #define em_proto_DownFrameDataMessage_frame_sequence_id_tag 1
 #define em_proto_DownFrameDataMessage_P_localSpace_viewSpace_tag 2
 #define em_proto_DownFrameDataMessage_display_time_tag 3
+#define em_proto_DownFrameDataMessage_P_localSpace_view0_tag 4
+#define em_proto_DownFrameDataMessage_P_localSpace_view1_tag 5
+#define em_proto_DownFrameDataMessage_fov0_tag   6
+#define em_proto_DownFrameDataMessage_fov1_tag   7
+#define em_proto_DownFrameDataMessage_depth_band_height_tag 8
+#define em_proto_DownFrameDataMessage_depth_near_tag 9
+#define em_proto_ProbeMessage_sequence_tag       1
+#define em_proto_ProbeMessage_train_tag          2
+#define em_proto_ProbeMessage_send_time_tag      3
 #define em_proto_DownMessage_frame_data_tag      1
+#define em_proto_DownMessage_probe_tag           2
 
 /* Struct field encoding specification for nanopb */
 #define em_proto_Quaternion_FIELDLIST(X, a) \
@@ -277,6 +363,14 @@ X(a, STATIC,   OPTIONAL, MESSAGE,  orientation,       2)
 #define em_proto_Pose_position_MSGTYPE em_proto_Vec3
 #define em_proto_Pose_orientation_MSGTYPE em_proto_Quaternion
 
+#define em_proto_Fov_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, FLOAT,    angle_left,        1) \
+X(a, STATIC,   SINGULAR, FLOAT,    angle_right,       2) \
+X(a, STATIC,   SINGULAR, FLOAT,    angle_up,          3) \
+X(a, STATIC,   SINGULAR, FLOAT,    angle_down,        4)
+#define em_proto_Fov_CALLBACK NULL
+#define em_proto_Fov_DEFAULT NULL
+
 #define em_proto_TrackingMessage_FIELDLIST(X, a) \
 X(a, STATIC,   OPTIONAL, MESSAGE,  P_localSpace_viewSpace,   1) \
 X(a, STATIC,   OPTIONAL, MESSAGE,  P_viewSpace_view0,   2) \
@@ -360,33 +454,73 @@ X(a, STATIC,   SINGULAR, INT64,    display_time,      4)
 #define em_proto_UpFrameMessage_CALLBACK NULL
 #define em_proto_UpFrameMessage_DEFAULT NULL
 
+#define em_proto_GazeMessage_FIELDLIST(X, a) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  direction,         1) \
+X(a, STATIC,   SINGULAR, FLOAT,    confidence,        2) \
+X(a, STATIC,   SINGULAR, INT64,    timestamp,         3)
+#define em_proto_GazeMessage_CALLBACK NULL
+#define em_proto_GazeMessage_DEFAULT NULL
+#define em_proto_GazeMessage_direction_MSGTYPE em_proto_Vec3
+
+#define em_proto_ProbeReplyMessage_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, INT32,    sequence,          1) \
+X(a, STATIC,   SINGULAR, INT64,    send_time,         2) \
+X(a, STATIC,   SINGULAR, INT64,    receive_time,      3) \
+X(a, STATIC,   SINGULAR, INT32,    size,              4)
+#define em_proto_ProbeReplyMessage_CALLBACK NULL
+#define em_proto_ProbeReplyMessage_DEFAULT NULL
+
 #define em_proto_UpMessage_FIELDLIST(X, a) \
 X(a, STATIC,   SINGULAR, INT64,    up_message_id,     1) \
 X(a, STATIC,   OPTIONAL, MESSAGE,  tracking,          2) \
-X(a, STATIC,   OPTIONAL, MESSAGE,  frame,             3)
+X(a, STATIC,   OPTIONAL, MESSAGE,  frame,             3) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  gaze,              4) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  probe_reply,       5)
 #define em_proto_UpMessage_CALLBACK NULL
 #define em_proto_UpMessage_DEFAULT NULL
 #define em_proto_UpMessage_tracking_MSGTYPE em_proto_TrackingMessage
 #define em_proto_UpMessage_frame_MSGTYPE em_proto_UpFrameMessage
+#define em_proto_UpMessage_gaze_MSGTYPE em_proto_GazeMessage
+#define em_proto_UpMessage_probe_reply_MSGTYPE em_proto_ProbeReplyMessage
 
 #define em_proto_DownFrameDataMessage_FIELDLIST(X, a) \
 X(a, STATIC,   SINGULAR, INT64,    frame_sequence_id,   1) \
 X(a, STATIC,   OPTIONAL, MESSAGE,  P_localSpace_viewSpace,   2) \
-X(a, STATIC,   SINGULAR, INT64,    display_time,      3)
+X(a, STATIC,   SINGULAR, INT64,    display_time,      3) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  P_localSpace_view0,   4) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  P_localSpace_view1,   5) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  fov0,              6) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  fov1,              7) \
+X(a, STATIC,   SINGULAR, INT32,    depth_band_height,   8) \
+X(a, STATIC,   SINGULAR, FLOAT,    depth_near,        9)
 #define em_proto_DownFrameDataMessage_CALLBACK NULL
 #define em_proto_DownFrameDataMessage_DEFAULT NULL
 #define em_proto_DownFrameDataMessage_P_localSpace_viewSpace_MSGTYPE em_proto_Pose
+#define em_proto_DownFrameDataMessage_P_localSpace_view0_MSGTYPE em_proto_Pose
+#define em_proto_DownFrameDataMessage_P_localSpace_view1_MSGTYPE em_proto_Pose
+#define em_proto_DownFrameDataMessage_fov0_MSGTYPE em_proto_Fov
+#define em_proto_DownFrameDataMessage_fov1_MSGTYPE em_proto_Fov
+
+#define em_proto_ProbeMessage_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, INT32,    sequence,          1) \
+X(a, STATIC,   SINGULAR, INT32,    train,             2) \
+X(a, STATIC,   SINGULAR, INT64,    send_time,         3)
+#define em_proto_ProbeMessage_CALLBACK NULL
+#define em_proto_ProbeMessage_DEFAULT NULL
 
 #define em_proto_DownMessage_FIELDLIST(X, a) \
-X(a, STATIC,   OPTIONAL, MESSAGE,  frame_data,        1)
+X(a, STATIC,   OPTIONAL, MESSAGE,  frame_data,        1) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  probe,             2)
 #define em_proto_DownMessage_CALLBACK NULL
 #define em_proto_DownMessage_DEFAULT NULL
 #define em_proto_DownMessage_frame_data_MSGTYPE em_proto_DownFrameDataMessage
+#define em_proto_DownMessage_probe_MSGTYPE em_proto_ProbeMessage
 
 extern const pb_msgdesc_t em_proto_Quaternion_msg;
 extern const pb_msgdesc_t em_proto_Vec3_msg;
 extern const pb_msgdesc_t em_proto_Vec2_msg;
 extern const pb_msgdesc_t em_proto_Pose_msg;
+extern const pb_msgdesc_t em_proto_Fov_msg;
 extern const pb_msgdesc_t em_proto_TrackingMessage_msg;
 extern const pb_msgdesc_t em_proto_InputThumbstick_msg;
 extern const pb_msgdesc_t em_proto_InputValueTouch_msg;
@@ -395,8 +529,11 @@ extern const pb_msgdesc_t em_proto_TouchControllerCommon_msg;
 extern const pb_msgdesc_t em_proto_TouchControllerLeft_msg;
 extern const pb_msgdesc_t em_proto_TouchControllerRight_msg;
 extern const pb_msgdesc_t em_proto_UpFrameMessage_msg;
+extern const pb_msgdesc_t em_proto_GazeMessage_msg;
+extern const pb_msgdesc_t em_proto_ProbeReplyMessage_msg;
 extern const pb_msgdesc_t em_proto_UpMessage_msg;
 extern const pb_msgdesc_t em_proto_DownFrameDataMessage_msg;
+extern const pb_msgdesc_t em_proto_ProbeMessage_msg;
 extern const pb_msgdesc_t em_proto_DownMessage_msg;
 
 /* Defines for backwards compatibility with code written before nanopb-0.4.0 */
@@ -404,6 +541,7 @@ extern const pb_msgdesc_t em_proto_DownMessage_msg;
 #define em_proto_Vec3_fields &em_proto_Vec3_msg
 #define em_proto_Vec2_fields &em_proto_Vec2_msg
 #define em_proto_Pose_fields &em_proto_Pose_msg
+#define em_proto_Fov_fields &em_proto_Fov_msg
 #define em_proto_TrackingMessage_fields &em_proto_TrackingMessage_msg
 #define em_proto_InputThumbstick_fields &em_proto_InputThumbstick_msg
 #define em_proto_InputValueTouch_fields &em_proto_InputValueTouch_msg
@@ -412,24 +550,31 @@ extern const pb_msgdesc_t em_proto_DownMessage_msg;
 #define em_proto_TouchControllerLeft_fields &em_proto_TouchControllerLeft_msg
 #define em_proto_TouchControllerRight_fields &em_proto_TouchControllerRight_msg
 #define em_proto_UpFrameMessage_fields &em_proto_UpFrameMessage_msg
+#define em_proto_GazeMessage_fields &em_proto_GazeMessage_msg
+#define em_proto_ProbeReplyMessage_fields &em_proto_ProbeReplyMessage_msg
 #define em_proto_UpMessage_fields &em_proto_UpMessage_msg
 #define em_proto_DownFrameDataMessage_fields &em_proto_DownFrameDataMessage_msg
+#define em_proto_ProbeMessage_fields &em_proto_ProbeMessage_msg
 #define em_proto_DownMessage_fields &em_proto_DownMessage_msg
 
 /* Maximum encoded size of messages (where known) */
-#define em_proto_DownFrameDataMessage_size       63
-#define em_proto_DownMessage_size                65
+#define em_proto_DownFrameDataMessage_size       205
+#define em_proto_DownMessage_size                243
+#define em_proto_Fov_size                        20
+#define em_proto_GazeMessage_size                33
 #define em_proto_InputClickTouch_size            4
 #define em_proto_InputThumbstick_size            16
 #define em_proto_InputValueTouch_size            7
 #define em_proto_Pose_size                       39
+#define em_proto_ProbeMessage_size               33
+#define em_proto_ProbeReplyMessage_size          44
 #define em_proto_Quaternion_size                 20
 #define em_proto_TouchControllerCommon_size      38
 #define em_proto_TouchControllerLeft_size        58
 #define em_proto_TouchControllerRight_size       58
 #define em_proto_TrackingMessage_size            309
 #define em_proto_UpFrameMessage_size             44
-#define em_proto_UpMessage_size                  369
+#define em_proto_UpMessage_size                  450
 #define em_proto_Vec2_size                       10
 #define em_proto_Vec3_size                       15
 
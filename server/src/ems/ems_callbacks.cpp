@@ -56,6 +56,22 @@ ems_callbacks_add(struct ems_callbacks *callbacks, uint32_t event_mask, ems_call
 	callbacks->callbacks_collection.addCallback(func, event_mask, userdata);
 }
 
+void
+ems_callbacks_remove(struct ems_callbacks *callbacks, uint32_t event_mask, void *userdata)
+{
+	std::unique_lock<std::mutex> lock(callbacks->mutex);
+	auto remover = [=](enum ems_callbacks_event, ems_callbacks_func_t, void *callback_userdata) {
+		return callback_userdata == userdata; // remove, without calling
+	};
+
+	// Goes through the callbacks of one event at a time.
+	for (uint32_t bit = 1; bit != 0 && bit <= event_mask; bit <<= 1u) {
+		if ((event_mask & bit) != 0) {
+			callbacks->callbacks_collection.invokeCallbacks((enum ems_callbacks_event)bit, remover);
+		}
+	}
+}
+
 void
 ems_callbacks_reset(struct ems_callbacks *callbacks)
 {
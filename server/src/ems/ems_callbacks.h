@@ -25,6 +25,8 @@ enum ems_callbacks_event
 {
 	EMS_CALLBACKS_EVENT_TRACKING = 1u << 0u,
 	EMS_CALLBACKS_EVENT_CONTROLLER = 1u << 1u,
+	EMS_CALLBACKS_EVENT_FRAME = 1u << 2u,
+	EMS_CALLBACKS_EVENT_GAZE = 1u << 3u,
 };
 
 /// Callback function type
@@ -58,6 +60,18 @@ ems_callbacks_destroy(struct ems_callbacks **ptr_callbacks);
 void
 ems_callbacks_add(struct ems_callbacks *callbacks, uint32_t event_mask, ems_callbacks_func_t func, void *userdata);
 
+/// Remove the callbacks added with @p userdata for any of the events in @p event_mask.
+///
+/// Waits for callbacks being called to return, they won't be called again afterwards.
+///
+/// @param callbacks self
+/// @param event_mask Bitmask of @ref ems_callbacks_event to remove the callbacks of.
+/// @param userdata The opaque pointer the callbacks were added with
+///
+/// @public @memberof ems_callbacks
+void
+ems_callbacks_remove(struct ems_callbacks *callbacks, uint32_t event_mask, void *userdata);
+
 /// Call all callbacks that are interested in @p event
 ///
 /// @param callbacks self
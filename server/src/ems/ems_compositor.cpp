@@ -16,6 +16,8 @@
  */
 
 #include "ems_compositor.h"
+#include "ems_callbacks.h"
+#include "gst/ems_gstreamer_probe.h"
 
 #include "gstreamer/gst_internal.h"
 #include "os/os_time.h"
@@ -29,33 +31,71 @@
 
 #include "util/comp_vulkan.h"
 
+#include "math/m_api.h"
+
 #include "multi/comp_multi_interface.h"
 
-#include "vk/vk_image_readback_to_xf_pool.h"
+#include "vk/vk_helpers.h"
 #include "vk/vk_cmd.h"
 #include "vk/vk_cmd_pool.h"
 
+#include "shaders/pack_nv12.comp.h"
+
+#include "electricmaple.pb.h"
+
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
 
-// native quest resolution
-// #define APP_VIEW_W (1832)
-// #define APP_VIEW_H (1920)
+// The native Quest resolution is 1832x1920 per view.
+#define DEFAULT_VIEW_W (1920)
+#define DEFAULT_VIEW_H (1920)
 
+// Limits for the encoded picture, sizes are also rounded down to what NV12 packing needs.
+#define MIN_ENCODE_W (64)
+#define MIN_ENCODE_H (32)
+#define MAX_ENCODE_W (8192)
+#define MAX_ENCODE_H (4096)
 
-#define APP_VIEW_W (1920)
-#define APP_VIEW_H (1920)
+// Unchanged frames are still pushed this often as key frames, so the client recovers from lost packets.
+#define STATIC_FRAME_REFRESH_NS (500 * U_TIME_1MS_IN_NS)
 
-// TODO making this 1 causes readback failures
-// I assume this means there is some kind of buffer creation failing and we aren't handling the error right.
-#define READBACK_DIV_FACTOR (2)
+// Gaze is extrapolated at most this far ahead, eye movements are not predictable beyond that.
+#define GAZE_MAX_PREDICTION_NS (50 * U_TIME_1MS_IN_NS)
 
-#define READBACK_W2 (APP_VIEW_W / READBACK_DIV_FACTOR)
-#define READBACK_W (READBACK_W2 * 2)
-#define READBACK_H (APP_VIEW_H / READBACK_DIV_FACTOR)
+// Gaze older than this is not followed, the client has stopped tracking the eyes.
+#define GAZE_TIMEOUT_NS (200 * U_TIME_1MS_IN_NS)
+
+// Eye distance for frames without a projection layer, the device doesn't know the user's.
+#define FALLBACK_IPD_M (0.063f)
 
 
 DEBUG_GET_ONCE_LOG_OPTION(log, "XRT_COMPOSITOR_LOG", U_LOGGING_INFO)
+DEBUG_GET_ONCE_NUM_OPTION(readback_depth, "EMS_READBACK_DEPTH", 2)
+DEBUG_GET_ONCE_BOOL_OPTION(readback_dmabuf, "EMS_READBACK_DMABUF", false)
+DEBUG_GET_ONCE_BOOL_OPTION(readback_host_import, "EMS_READBACK_HOST_IMPORT", true)
+DEBUG_GET_ONCE_NUM_OPTION(view_width, "EMS_VIEW_WIDTH", DEFAULT_VIEW_W)
+DEBUG_GET_ONCE_NUM_OPTION(view_height, "EMS_VIEW_HEIGHT", DEFAULT_VIEW_H)
+// Zero means half of the view size for each eye.
+DEBUG_GET_ONCE_NUM_OPTION(encode_width, "EMS_ENCODE_WIDTH", 0)
+DEBUG_GET_ONCE_NUM_OPTION(encode_height, "EMS_ENCODE_HEIGHT", 0)
+DEBUG_GET_ONCE_NUM_OPTION(pacing_margin_us, "EMS_PACING_MARGIN_US", 2000)
+DEBUG_GET_ONCE_NUM_OPTION(max_encode_backlog, "EMS_MAX_ENCODE_BACKLOG", 2)
+DEBUG_GET_ONCE_BOOL_OPTION(skip_static_frames, "EMS_SKIP_STATIC_FRAMES", true)
+DEBUG_GET_ONCE_BOOL_OPTION(stream_depth, "EMS_STREAM_DEPTH", false)
+DEBUG_GET_ONCE_BOOL_OPTION(compute_queue, "EMS_COMPUTE_QUEUE", true)
+DEBUG_GET_ONCE_BOOL_OPTION(pack_bounce, "EMS_PACK_BOUNCE", false)
+DEBUG_GET_ONCE_BOOL_OPTION(pack_cmd_per_frame, "EMS_PACK_CMD_PER_FRAME", false)
+DEBUG_GET_ONCE_FLOAT_OPTION(foveation, "EMS_FOVEATION", 1.0f)
+DEBUG_GET_ONCE_BOOL_OPTION(foveation_gaze, "EMS_FOVEATION_GAZE", true)
+DEBUG_GET_ONCE_FLOAT_OPTION(foveation_gaze_confidence, "EMS_FOVEATION_GAZE_CONFIDENCE", 0.5f)
+DEBUG_GET_ONCE_BOOL_OPTION(rate_control, "EMS_RATE_CONTROL", true)
+DEBUG_GET_ONCE_NUM_OPTION(bitrate_kbps, "EMS_BITRATE_KBPS", 8000)
+DEBUG_GET_ONCE_NUM_OPTION(bitrate_min_kbps, "EMS_BITRATE_MIN_KBPS", 1000)
+DEBUG_GET_ONCE_NUM_OPTION(bitrate_max_kbps, "EMS_BITRATE_MAX_KBPS", 50000)
 
 
 /*
@@ -70,6 +110,19 @@ get_vk(struct ems_compositor *c)
 	return &c->base.vk;
 }
 
+/*!
+ * The pack shader writes 4x2 blocks, clamp and round down to that.
+ */
+static void
+align_encode_size(uint32_t *width, uint32_t *height)
+{
+	uint32_t w = std::clamp<uint32_t>(*width, MIN_ENCODE_W, MAX_ENCODE_W);
+	uint32_t h = std::clamp<uint32_t>(*height, MIN_ENCODE_H, MAX_ENCODE_H);
+
+	*width = w & ~3u;
+	*height = h & ~1u;
+}
+
 
 /*
  *
@@ -153,6 +206,12 @@ static const char *optional_device_extensions[] = {
 #ifdef VK_EXT_robustness2
     VK_EXT_ROBUSTNESS_2_EXTENSION_NAME,
 #endif
+#ifdef VK_EXT_external_memory_dma_buf
+    VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME,
+#endif
+#ifdef VK_EXT_external_memory_host
+    VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME,
+#endif
 };
 
 static VkResult
@@ -165,88 +224,2051 @@ select_instances_extensions(struct ems_compositor *c, struct u_string_list *requ
 	return VK_SUCCESS;
 }
 
+/*!
+ * Everything we do is compute and transfer, on a queue family without
+ * graphics it runs on a separate hardware queue to the app's rendering
+ * instead of being scheduled behind it.
+ */
+static void
+compositor_check_queue(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+	uint32_t count = 0;
+
+	c->queue.family_index = vk->queue_family_index;
+
+	vk->vkGetPhysicalDeviceQueueFamilyProperties(vk->physical_device, &count, NULL);
+
+	VkQueueFamilyProperties *props = U_TYPED_ARRAY_CALLOC(VkQueueFamilyProperties, count);
+	vk->vkGetPhysicalDeviceQueueFamilyProperties(vk->physical_device, &count, props);
+
+	if (c->queue.family_index < count) {
+		c->queue.compute_only = (props[c->queue.family_index].queueFlags & VK_QUEUE_GRAPHICS_BIT) == 0;
+	}
+
+	free(props);
+
+	EMS_COMP_INFO(c, "Using queue family %u, %s", c->queue.family_index,
+	              c->queue.compute_only ? "async compute" : "shared with graphics");
+}
+
+static bool
+compositor_init_vulkan(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+	VkResult ret;
+
+	// every backend needs at least the common extensions
+	struct u_string_list *required_instance_ext_list =
+	    u_string_list_create_from_array(instance_extensions_common, ARRAY_SIZE(instance_extensions_common));
+
+	struct u_string_list *optional_instance_ext_list = u_string_list_create();
+
+	ret = select_instances_extensions(c, required_instance_ext_list, optional_instance_ext_list);
+	if (ret != VK_SUCCESS) {
+		VK_ERROR(vk, "select_instances_extensions: %s\n\tFailed to select instance extensions.",
+		         vk_result_string(ret));
+		u_string_list_destroy(&required_instance_ext_list);
+		u_string_list_destroy(&optional_instance_ext_list);
+		return ret;
+	}
+
+	struct u_string_list *required_device_extension_list =
+	    u_string_list_create_from_array(required_device_extensions, ARRAY_SIZE(required_device_extensions));
+
+	struct u_string_list *optional_device_extension_list =
+	    u_string_list_create_from_array(optional_device_extensions, ARRAY_SIZE(optional_device_extensions));
+
+	struct comp_vulkan_arguments vk_args = {};
+
+	vk_args.get_instance_proc_address = vkGetInstanceProcAddr;
+	vk_args.required_instance_version = VK_MAKE_VERSION(1, 0, 0);
+	vk_args.required_instance_extensions = required_instance_ext_list;
+	vk_args.optional_instance_extensions = optional_instance_ext_list;
+	vk_args.required_device_extensions = required_device_extension_list;
+	vk_args.optional_device_extensions = optional_device_extension_list;
+	vk_args.log_level = c->settings.log_level;
+	// Monado prefers a family without graphics then, see compositor_check_queue.
+	vk_args.only_compute_queue = debug_get_bool_option_compute_queue();
+	vk_args.selected_gpu_index = -1;   // Auto
+	vk_args.client_gpu_index = -1;     // Auto
+	vk_args.timeline_semaphore = true; // Flag is optional, not a hard requirement.
+
+
+	struct comp_vulkan_results vk_res = {};
+	bool bundle_ret = comp_vulkan_init_bundle(vk, &vk_args, &vk_res);
+
+	u_string_list_destroy(&required_instance_ext_list);
+	u_string_list_destroy(&optional_instance_ext_list);
+	u_string_list_destroy(&required_device_extension_list);
+	u_string_list_destroy(&optional_device_extension_list);
+
+	if (!bundle_ret) {
+		return false;
+	}
+
+	// clang-format off
+	static_assert(ARRAY_SIZE(vk_res.client_gpu_deviceUUID.data) == XRT_UUID_SIZE, "array size mismatch");
+	static_assert(ARRAY_SIZE(vk_res.selected_gpu_deviceUUID.data) == XRT_UUID_SIZE, "array size mismatch");
+	static_assert(ARRAY_SIZE(vk_res.client_gpu_deviceUUID.data) == ARRAY_SIZE(c->sys_info.client_vk_deviceUUID.data), "array size mismatch");
+	static_assert(ARRAY_SIZE(vk_res.selected_gpu_deviceUUID.data) == ARRAY_SIZE(c->sys_info.compositor_vk_deviceUUID.data), "array size mismatch");
+	static_assert(ARRAY_SIZE(vk_res.client_gpu_deviceLUID.data) == XRT_LUID_SIZE, "array size mismatch");
+	static_assert(ARRAY_SIZE(vk_res.client_gpu_deviceLUID.data) == ARRAY_SIZE(c->sys_info.client_d3d_deviceLUID.data), "array size mismatch");
+	// clang-format on
+
+	c->sys_info.client_vk_deviceUUID = vk_res.client_gpu_deviceUUID;
+	c->sys_info.compositor_vk_deviceUUID = vk_res.selected_gpu_deviceUUID;
+	c->sys_info.client_d3d_deviceLUID = vk_res.client_gpu_deviceLUID;
+	c->sys_info.client_d3d_deviceLUID_valid = vk_res.client_gpu_deviceLUID_valid;
+
+	compositor_check_queue(c);
+
+	// Init command pool, each readback slot re-records its own command buffer unless comparing against that.
+	VkCommandPoolCreateFlags flags = c->readback.cmd_per_frame ? VK_COMMAND_POOL_CREATE_TRANSIENT_BIT
+	                                                           : VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	// U_LOG_I("%s", vk_result_string(ret));
+	ret = vk_cmd_pool_init(vk, &c->cmd_pool, flags);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vk_cmd_pool_init: %s", vk_result_string(ret));
+		return false;
+	}
+
+	// Init shared swapchain resources.
+	xrt_result_t xret = comp_swapchain_shared_init(&c->base.cscs, vk);
+	if (xret != XRT_SUCCESS) {
+		EMS_COMP_ERROR(c, "comp_swapchain_shared_init: %u", xret);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ *
+ * Other init functions.
+ *
+ */
+
+/*!
+ * Find the warp strength a that gives the centers @p gain times the pixels,
+ * that is sinh(a) / a = gain, which grows monotonically with a.
+ */
+static void
+compositor_init_foveation(struct ems_compositor *c, float gain)
+{
+	c->foveation.gain = 1.0f;
+	c->foveation.strength = 0.0f;
+
+	if (gain <= 1.0f) {
+		return;
+	}
+
+	// Beyond this the periphery is all but gone.
+	gain = std::min(gain, 3.0f);
+
+	float low = 0.0f;
+	float high = 4.0f;
+	for (int i = 0; i < 32; i++) {
+		float a = (low + high) * 0.5f;
+		if (sinhf(a) / a < gain) {
+			low = a;
+		} else {
+			high = a;
+		}
+	}
+
+	c->foveation.gain = gain;
+	c->foveation.strength = (low + high) * 0.5f;
+
+	EMS_COMP_INFO(c, "Foveation: %.2fx center density, strength %.3f", gain, c->foveation.strength);
+}
+
+static bool
+compositor_init_pacing(struct ems_compositor *c)
+{
+	int64_t margin_us = std::max<int64_t>(debug_get_num_option_pacing_margin_us(), 0);
+
+	ems_pacing_init(&c->pacing, c->settings.frame_interval_ns, (uint64_t)margin_us * 1000, os_monotonic_get_ns());
+
+	// At least one frame has to be allowed to be encoding.
+	c->backlog.max_frames = (uint32_t)std::max<int64_t>(debug_get_num_option_max_encode_backlog(), 1);
+
+	return true;
+}
+
+/*!
+ * Frame reports from the client steer the pacing and measure the latency to
+ * its display, called on the data channel thread.
+ */
+static void
+compositor_handle_frame_report(enum ems_callbacks_event event, const em_proto_UpMessage *message, void *userdata)
+{
+	struct ems_compositor *c = (struct ems_compositor *)userdata;
+
+	if (!message->has_frame) {
+		return;
+	}
+
+	struct ems_pacing_frame_report report = {
+	    .sequence_id = message->frame.frame_sequence_id,
+	    .decode_complete_ns = message->frame.decode_complete_time,
+	    .begin_frame_ns = message->frame.begin_frame_time,
+	    .display_ns = message->frame.display_time,
+	    .received_ns = os_monotonic_get_ns(),
+	};
+
+	ems_pacing_feedback(&c->pacing, &report);
+}
+
+/*!
+ * Request the base size scaled by @p scale, as rate control has stepped it.
+ */
+static void
+encode_request_scaled_size(struct ems_compositor *c, float scale)
+{
+	os_mutex_lock(&c->encode.mutex);
+	uint32_t width = (uint32_t)((float)c->encode.base_width * scale);
+	uint32_t height = (uint32_t)((float)c->encode.base_height * scale);
+	os_mutex_unlock(&c->encode.mutex);
+
+	ems_compositor_request_encode_size(c, width, height);
+}
+
+/*!
+ * Pixels per second at the base encode size, for the bits per pixel.
+ */
+static uint64_t
+rate_get_full_pixel_rate(struct ems_compositor *c)
+{
+	os_mutex_lock(&c->encode.mutex);
+	uint64_t full_pixels = (uint64_t)c->encode.base_width * c->encode.base_height;
+	os_mutex_unlock(&c->encode.mutex);
+
+	uint64_t frame_rate = U_TIME_1S_IN_NS / std::max<uint64_t>(c->settings.frame_interval_ns, 1);
+
+	return full_pixels * frame_rate;
+}
+
+/*!
+ * Hand what rate control decided to the encoder, called with the rate mutex held.
+ */
+static void
+rate_apply(struct ems_compositor *c)
+{
+	// Some encoders reconfigure on every change, small steps are not worth it.
+	uint32_t kbps = c->rate.control.target_kbps;
+	uint32_t step = std::max<uint32_t>(c->rate.applied_kbps / 20, 1);
+	if (kbps >= c->rate.applied_kbps + step || kbps + step <= c->rate.applied_kbps) {
+		ems_gstreamer_pipeline_set_bitrate(c->gstreamer_pipeline, kbps);
+		c->rate.applied_kbps = kbps;
+	}
+
+	float scale = ems_rate_control_get_scale(&c->rate.control);
+	if (scale != c->rate.applied_scale) {
+		EMS_COMP_INFO(c, "Rate control: %u kbps, encode size scaled to %.2f", kbps, scale);
+		c->rate.applied_scale = scale;
+		encode_request_scaled_size(c, scale);
+	}
+}
+
+/*!
+ * Transport stats of the stream drive the encoder bitrate and size, called
+ * on a thread of the webrtc element.
+ */
+static void
+compositor_handle_network_stats(const struct ems_gstreamer_pipeline_stats *stats, void *userdata)
+{
+	struct ems_compositor *c = (struct ems_compositor *)userdata;
+
+	if (!c->rate.enabled) {
+		return;
+	}
+
+	struct ems_rate_control_stats rate_stats = {
+	    .timestamp_ns = stats->timestamp_ns,
+	    .bytes_sent = stats->bytes_sent,
+	    .rtt_ns = stats->rtt_ns,
+	    .fraction_lost = stats->fraction_lost,
+	};
+
+	uint64_t full_pixel_rate = rate_get_full_pixel_rate(c);
+
+	os_mutex_lock(&c->rate.mutex);
+	ems_rate_control_update(&c->rate.control, &rate_stats, full_pixel_rate);
+	rate_apply(c);
+	os_mutex_unlock(&c->rate.mutex);
+}
+
+/*!
+ * A new client's path has been probed, start at what it takes instead of
+ * converging there over seconds. Called on the main loop of the pipeline.
+ */
+static void
+compositor_handle_probe(const struct ems_gstreamer_probe_result *result, void *userdata)
+{
+	struct ems_compositor *c = (struct ems_compositor *)userdata;
+
+	if (!c->rate.enabled) {
+		return;
+	}
+
+	if (result->bandwidth_kbps == 0) {
+		EMS_COMP_WARN(c, "Probe could not measure the bandwidth, starting at %u kbps", c->rate.applied_kbps);
+		return;
+	}
+
+	uint64_t full_pixel_rate = rate_get_full_pixel_rate(c);
+
+	os_mutex_lock(&c->rate.mutex);
+	ems_rate_control_start_from_probe(&c->rate.control, result->bandwidth_kbps, result->rtt_ns, full_pixel_rate);
+	rate_apply(c);
+	os_mutex_unlock(&c->rate.mutex);
+}
+
+/*!
+ * Gaze from clients with eye tracking, called on the data channel thread.
+ * Keeps the last sample and how fast the gaze moves, the velocity is taken
+ * from the client's sample times so network jitter does not disturb it.
+ */
+static void
+compositor_handle_gaze(enum ems_callbacks_event event, const em_proto_UpMessage *message, void *userdata)
+{
+	struct ems_compositor *c = (struct ems_compositor *)userdata;
+
+	if (!message->has_gaze || !message->gaze.has_direction) {
+		return;
+	}
+
+	const em_proto_GazeMessage *gaze = &message->gaze;
+
+	// Gaze far off to the side has no useful tangent, treat it as not tracked.
+	bool ahead = gaze->direction.z < -0.1f;
+	float tangents[2] = {0.0f, 0.0f};
+	if (ahead) {
+		tangents[0] = gaze->direction.x / -gaze->direction.z;
+		tangents[1] = gaze->direction.y / -gaze->direction.z;
+	}
+
+	uint64_t now_ns = os_monotonic_get_ns();
+
+	os_mutex_lock(&c->gaze.mutex);
+
+	// The client sends the same sample again if the eye tracker has not delivered a new one.
+	if (gaze->timestamp != 0 && gaze->timestamp == c->gaze.sample_ns) {
+		os_mutex_unlock(&c->gaze.mutex);
+		return;
+	}
+
+	int64_t dt_ns = gaze->timestamp - c->gaze.sample_ns;
+	bool continuous = ahead && c->gaze.confidence > 0.0f && c->gaze.sample_ns != 0 && dt_ns > 0 &&
+	                  dt_ns < (int64_t)GAZE_TIMEOUT_NS;
+
+	for (uint32_t i = 0; i < 2; i++) {
+		if (continuous) {
+			float velocity = (tangents[i] - c->gaze.tangents[i]) / (float)time_ns_to_s(dt_ns);
+			c->gaze.velocity[i] = (c->gaze.velocity[i] + velocity) * 0.5f;
+		} else {
+			c->gaze.velocity[i] = 0.0f;
+		}
+		c->gaze.tangents[i] = tangents[i];
+	}
+
+	c->gaze.confidence = ahead ? gaze->confidence : 0.0f;
+	c->gaze.sample_ns = gaze->timestamp;
+	c->gaze.received_ns = now_ns;
+
+	os_mutex_unlock(&c->gaze.mutex);
+}
+
+/*!
+ * Where the user is predicted to look at @p display_ns, as tangents in view
+ * space. Returns false if the gaze should not be followed, then the lens
+ * centers are used instead.
+ */
+static bool
+compositor_get_gaze(struct ems_compositor *c, uint64_t display_ns, float out_tangents[2])
+{
+	if (!c->gaze.enabled) {
+		return false;
+	}
+
+	uint64_t now_ns = os_monotonic_get_ns();
+
+	os_mutex_lock(&c->gaze.mutex);
+
+	bool fresh = c->gaze.received_ns != 0 && now_ns - c->gaze.received_ns < GAZE_TIMEOUT_NS;
+	bool follow = fresh && c->gaze.confidence >= c->gaze.min_confidence;
+
+	if (follow) {
+		// Covers from the sample arriving to the frame being displayed, not the uplink before that.
+		int64_t horizon_ns = (int64_t)display_ns - (int64_t)c->gaze.received_ns;
+		horizon_ns = std::clamp<int64_t>(horizon_ns, 0, GAZE_MAX_PREDICTION_NS);
+
+		for (uint32_t i = 0; i < 2; i++) {
+			out_tangents[i] = c->gaze.tangents[i] + c->gaze.velocity[i] * (float)time_ns_to_s(horizon_ns);
+		}
+		c->gaze.frames++;
+	} else if (fresh) {
+		c->gaze.fallbacks++;
+	}
+
+	os_mutex_unlock(&c->gaze.mutex);
+
+	return follow;
+}
+
+static bool
+compositor_init_info(struct ems_compositor *c)
+{
+	struct xrt_compositor_info *info = &c->base.base.base.info;
+
+	struct comp_vulkan_formats formats = {};
+	comp_vulkan_formats_check(get_vk(c), &formats);
+	comp_vulkan_formats_copy_to_info(&formats, info);
+	comp_vulkan_formats_log(c->settings.log_level, &formats);
+
+	return true;
+}
+
+static bool
+compositor_init_sys_info(struct ems_compositor *c, struct xrt_device *xdev)
+{
+	struct xrt_system_compositor_info *sys_info = &c->sys_info;
+
+	// Required by OpenXR spec.
+	sys_info->max_layers = 16;
+
+	// UUIDs and LUID already set in vk init.
+	(void)sys_info->compositor_vk_deviceUUID;
+	(void)sys_info->client_vk_deviceUUID;
+	(void)sys_info->client_d3d_deviceLUID;
+	(void)sys_info->client_d3d_deviceLUID_valid;
+
+	uint32_t w = c->settings.view_width;
+	uint32_t h = c->settings.view_height;
+	uint32_t max_w = std::max<uint32_t>(w, 2048);
+	uint32_t max_h = std::max<uint32_t>(h, 2048);
+
+	// clang-format off
+
+	// These seem to control the
+	sys_info->views[0].recommended.width_pixels  = w;
+	sys_info->views[0].recommended.height_pixels = h;
+	sys_info->views[0].recommended.sample_count  = 1;
+	sys_info->views[0].max.width_pixels          = max_w;
+	sys_info->views[0].max.height_pixels         = max_h;
+	sys_info->views[0].max.sample_count          = 1;
+
+	sys_info->views[1].recommended.width_pixels  = w;
+	sys_info->views[1].recommended.height_pixels = h;
+	sys_info->views[1].recommended.sample_count  = 1;
+	sys_info->views[1].max.width_pixels          = max_w;
+	sys_info->views[1].max.height_pixels         = max_h;
+	sys_info->views[1].max.sample_count          = 1;
+	// clang-format on
+
+	// Copy the list directly.
+	assert(xdev->hmd->blend_mode_count <= XRT_MAX_DEVICE_BLEND_MODES);
+	assert(xdev->hmd->blend_mode_count != 0);
+	assert(xdev->hmd->blend_mode_count <= ARRAY_SIZE(sys_info->supported_blend_modes));
+	for (size_t i = 0; i < xdev->hmd->blend_mode_count; ++i) {
+		assert(u_verify_blend_mode_valid(xdev->hmd->blend_modes[i]));
+		sys_info->supported_blend_modes[i] = xdev->hmd->blend_modes[i];
+	}
+	sys_info->supported_blend_mode_count = (uint8_t)xdev->hmd->blend_mode_count;
+
+	// Refresh rates.
+	sys_info->num_refresh_rates = 1;
+	sys_info->refresh_rates[0] = (float)(1. / time_ns_to_s(c->settings.frame_interval_ns));
+
+	return true;
+}
+
+
+/*
+ *
+ * Pack pipeline functions.
+ *
+ */
+
+/*!
+ * Push constants for the pack shader, must match shaders/pack_nv12.comp.
+ */
+struct pack_push_constants
+{
+	//! Size of the views.
+	int32_t extent[2];
+
+	//! Rows of the depth band below the views.
+	int32_t depth_rows;
+};
+
+/*!
+ * Must match the defines in shaders/pack_nv12.comp.
+ */
+enum compose_layer_type
+{
+	COMPOSE_LAYER_PROJECTION = 0,
+	COMPOSE_LAYER_QUAD = 1,
+	COMPOSE_LAYER_CYLINDER = 2,
+};
+
+/*!
+ * Must match the defines in shaders/pack_nv12.comp.
+ */
+enum compose_blend
+{
+	COMPOSE_BLEND_OPAQUE = 0,
+	COMPOSE_BLEND_PREMULTIPLIED = 1,
+	COMPOSE_BLEND_UNPREMULTIPLIED = 2,
+};
+
+/*!
+ * A single layer in the uniform buffer, std140 so everything is a vec4.
+ */
+struct compose_layer
+{
+	//! Type, blend mode, eye visibility mask.
+	int32_t info[4];
+
+	//! Normalized sub image rect of each eye, offset then extent.
+	float rects[2][4];
+
+	//! Tangents of the fov of each eye, projection layers only.
+	float fovs[2][4];
+
+	//! Pose of each eye's view or of the layer as seen by each eye.
+	float orientations[2][4];
+	float positions[2][4];
+
+	//! Quad size or cylinder radius, central angle and aspect ratio.
+	float params[4];
+};
+
+/*!
+ * Uniform buffer of the pack shader, must match shaders/pack_nv12.comp.
+ */
+struct compose_ubo
+{
+	float eye_orientations[2][4];
+	float eye_positions[2][4];
+	float eye_fovs[2][4];
+	float depth_rects[2][4];
+	float depth_ranges[2][4];
+	float depth_info[4];
+	float foveation[2][4];
+	int32_t layer_count[4];
+	struct compose_layer layers[EMS_MAX_LAYERS];
+};
+
+/*!
+ * Everything the pack dispatch needs to flatten the layers of a frame.
+ */
+struct compose_state
+{
+	struct compose_ubo ubo;
+
+	//! Left and right view of each layer.
+	VkImageView views[EMS_MAX_LAYERS * 2];
+
+	//! Left and right depth view of the first projection layer.
+	VkImageView depth_views[2];
+
+	//! Swapchain images behind @ref views and @ref depth_views.
+	struct comp_swapchain *image_swapchains[EMS_MAX_FRAME_IMAGES];
+	uint32_t image_indices[EMS_MAX_FRAME_IMAGES];
+	uint32_t image_count;
+
+	//! Distance that is full scale in the depth band, zero if the frame has no depth.
+	float depth_near;
+
+	//! How the views are warped, also in the uniform buffer.
+	struct ems_foveation foveation;
+
+	//! The views we compose for, sent to the client with the frame.
+	struct xrt_pose eye_poses[2];
+	struct xrt_fov eye_fovs[2];
+};
+
+static bool
+pack_init(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+	VkResult ret;
+
+	VkSamplerCreateInfo sampler_info = {
+	    .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+	    .magFilter = VK_FILTER_LINEAR,
+	    .minFilter = VK_FILTER_LINEAR,
+	    .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+	    .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+	    .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+	    .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+	    .maxAnisotropy = 1.0f,
+	    .borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_BLACK,
+	};
+
+	ret = vk->vkCreateSampler(vk->device, &sampler_info, NULL, &c->pack.sampler);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vkCreateSampler: %s", vk_result_string(ret));
+		return false;
+	}
+
+	sampler_info.magFilter = VK_FILTER_NEAREST;
+	sampler_info.minFilter = VK_FILTER_NEAREST;
+
+	ret = vk->vkCreateSampler(vk->device, &sampler_info, NULL, &c->pack.depth_sampler);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vkCreateSampler: %s", vk_result_string(ret));
+		return false;
+	}
+
+	// One set per readback slot, each with one image per eye and layer, the target, the hashes and the depth.
+	VkDescriptorPoolSize pool_sizes[] = {
+	    {
+	        .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+	        .descriptorCount = EMS_READBACK_MAX_DEPTH * (EMS_MAX_LAYERS + 1) * 2,
+	    },
+	    {
+	        .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+	        .descriptorCount = EMS_READBACK_MAX_DEPTH,
+	    },
+	    {
+	        .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+	        .descriptorCount = EMS_READBACK_MAX_DEPTH * 2,
+	    },
+	};
+
+	VkDescriptorPoolCreateInfo descriptor_pool_info = {
+	    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+	    .maxSets = EMS_READBACK_MAX_DEPTH,
+	    .poolSizeCount = ARRAY_SIZE(pool_sizes),
+	    .pPoolSizes = pool_sizes,
+	};
+
+	ret = vk->vkCreateDescriptorPool(vk->device, &descriptor_pool_info, NULL, &c->pack.descriptor_pool);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vkCreateDescriptorPool: %s", vk_result_string(ret));
+		return false;
+	}
+
+	VkDescriptorSetLayoutBinding bindings[] = {
+	    {
+	        .binding = 0,
+	        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+	        .descriptorCount = EMS_MAX_LAYERS * 2,
+	        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+	    },
+	    {
+	        .binding = 1,
+	        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+	        .descriptorCount = 1,
+	        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+	    },
+	    {
+	        .binding = 2,
+	        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+	        .descriptorCount = 1,
+	        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+	    },
+	    {
+	        .binding = 3,
+	        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+	        .descriptorCount = 1,
+	        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+	    },
+	    {
+	        .binding = 4,
+	        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+	        .descriptorCount = 2,
+	        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+	    },
+	};
+
+	VkDescriptorSetLayoutCreateInfo set_layout_info = {
+	    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+	    .bindingCount = ARRAY_SIZE(bindings),
+	    .pBindings = bindings,
+	};
+
+	ret = vk->vkCreateDescriptorSetLayout(vk->device, &set_layout_info, NULL, &c->pack.descriptor_set_layout);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vkCreateDescriptorSetLayout: %s", vk_result_string(ret));
+		return false;
+	}
+
+	VkPushConstantRange push_range = {
+	    .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+	    .offset = 0,
+	    .size = sizeof(struct pack_push_constants),
+	};
+
+	VkPipelineLayoutCreateInfo pipeline_layout_info = {
+	    .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+	    .setLayoutCount = 1,
+	    .pSetLayouts = &c->pack.descriptor_set_layout,
+	    .pushConstantRangeCount = 1,
+	    .pPushConstantRanges = &push_range,
+	};
+
+	ret = vk->vkCreatePipelineLayout(vk->device, &pipeline_layout_info, NULL, &c->pack.pipeline_layout);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vkCreatePipelineLayout: %s", vk_result_string(ret));
+		return false;
+	}
+
+	VkShaderModuleCreateInfo shader_info = {
+	    .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+	    .codeSize = sizeof(shaders_pack_nv12_comp),
+	    .pCode = shaders_pack_nv12_comp,
+	};
+
+	ret = vk->vkCreateShaderModule(vk->device, &shader_info, NULL, &c->pack.shader);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vkCreateShaderModule: %s", vk_result_string(ret));
+		return false;
+	}
+
+	VkComputePipelineCreateInfo pipeline_info = {
+	    .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+	    .stage =
+	        {
+	            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+	            .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+	            .module = c->pack.shader,
+	            .pName = "main",
+	        },
+	    .layout = c->pack.pipeline_layout,
+	};
+
+	ret = vk->vkCreateComputePipelines(vk->device, VK_NULL_HANDLE, 1, &pipeline_info, NULL, &c->pack.pipeline);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vkCreateComputePipelines: %s", vk_result_string(ret));
+		return false;
+	}
+
+	return true;
+}
+
+static void
+pack_fini(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	if (vk->device == VK_NULL_HANDLE) {
+		return;
+	}
+
+	// Also frees the descriptor sets allocated from it.
+	if (c->pack.descriptor_pool != VK_NULL_HANDLE) {
+		vk->vkDestroyDescriptorPool(vk->device, c->pack.descriptor_pool, NULL);
+		c->pack.descriptor_pool = VK_NULL_HANDLE;
+	}
+	if (c->pack.pipeline != VK_NULL_HANDLE) {
+		vk->vkDestroyPipeline(vk->device, c->pack.pipeline, NULL);
+		c->pack.pipeline = VK_NULL_HANDLE;
+	}
+	if (c->pack.shader != VK_NULL_HANDLE) {
+		vk->vkDestroyShaderModule(vk->device, c->pack.shader, NULL);
+		c->pack.shader = VK_NULL_HANDLE;
+	}
+	if (c->pack.pipeline_layout != VK_NULL_HANDLE) {
+		vk->vkDestroyPipelineLayout(vk->device, c->pack.pipeline_layout, NULL);
+		c->pack.pipeline_layout = VK_NULL_HANDLE;
+	}
+	if (c->pack.descriptor_set_layout != VK_NULL_HANDLE) {
+		vk->vkDestroyDescriptorSetLayout(vk->device, c->pack.descriptor_set_layout, NULL);
+		c->pack.descriptor_set_layout = VK_NULL_HANDLE;
+	}
+	if (c->pack.depth_sampler != VK_NULL_HANDLE) {
+		vk->vkDestroySampler(vk->device, c->pack.depth_sampler, NULL);
+		c->pack.depth_sampler = VK_NULL_HANDLE;
+	}
+	if (c->pack.sampler != VK_NULL_HANDLE) {
+		vk->vkDestroySampler(vk->device, c->pack.sampler, NULL);
+		c->pack.sampler = VK_NULL_HANDLE;
+	}
+}
+
+/*!
+ * Point the slot's descriptor set at the layer and depth views, its uniform
+ * and hash buffers and the frame's buffer, the slot must not be in flight.
+ */
+static void
+pack_update_descriptor_set(struct ems_compositor *c, struct ems_readback_slot *slot, const struct compose_state *cs)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	VkDescriptorImageInfo image_infos[EMS_MAX_LAYERS * 2];
+	for (uint32_t i = 0; i < ARRAY_SIZE(image_infos); i++) {
+		image_infos[i] = {
+		    .sampler = c->pack.sampler,
+		    .imageView = cs->views[i],
+		    .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+		};
+	}
+
+	VkDescriptorImageInfo depth_infos[2];
+	for (uint32_t i = 0; i < ARRAY_SIZE(depth_infos); i++) {
+		depth_infos[i] = {
+		    .sampler = c->pack.depth_sampler,
+		    .imageView = cs->depth_views[i],
+		    .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+		};
+	}
+
+	VkDescriptorBufferInfo ubo_info = {
+	    .buffer = slot->ubo_buffer,
+	    .offset = 0,
+	    .range = VK_WHOLE_SIZE,
+	};
+
+	VkDescriptorBufferInfo buffer_info = {
+	    .buffer = slot->rf->buffer,
+	    .offset = 0,
+	    .range = VK_WHOLE_SIZE,
+	};
+
+	VkDescriptorBufferInfo hash_info = {
+	    .buffer = slot->hash_buffer,
+	    .offset = 0,
+	    .range = VK_WHOLE_SIZE,
+	};
+
+	VkWriteDescriptorSet writes[] = {
+	    {
+	        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+	        .dstSet = slot->descriptor_set,
+	        .dstBinding = 0,
+	        .descriptorCount = ARRAY_SIZE(image_infos),
+	        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+	        .pImageInfo = image_infos,
+	    },
+	    {
+	        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+	        .dstSet = slot->descriptor_set,
+	        .dstBinding = 1,
+	        .descriptorCount = 1,
+	        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+	        .pBufferInfo = &ubo_info,
+	    },
+	    {
+	        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+	        .dstSet = slot->descriptor_set,
+	        .dstBinding = 2,
+	        .descriptorCount = 1,
+	        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+	        .pBufferInfo = &buffer_info,
+	    },
+	    {
+	        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+	        .dstSet = slot->descriptor_set,
+	        .dstBinding = 3,
+	        .descriptorCount = 1,
+	        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+	        .pBufferInfo = &hash_info,
+	    },
+	    {
+	        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+	        .dstSet = slot->descriptor_set,
+	        .dstBinding = 4,
+	        .descriptorCount = ARRAY_SIZE(depth_infos),
+	        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+	        .pImageInfo = depth_infos,
+	    },
+	};
+
+	vk->vkUpdateDescriptorSets(vk->device, ARRAY_SIZE(writes), writes, 0, NULL);
+}
+
+
+/*
+ *
+ * Bounce image functions.
+ *
+ */
+
+static bool
+bounce_init(struct ems_compositor *c, uint32_t width, uint32_t height)
+{
+	VkExtent2D extent = {width, height};
+
+	VkResult ret = vk_create_image_simple(                            //
+	    &c->base.vk,                                                  // vk_bundle
+	    extent,                                                       // extent
+	    VK_FORMAT_R8G8B8A8_SRGB,                                      // format
+	    VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, // usage
+	    &c->bounce.device_memory,                                     // out_mem
+	    &c->bounce.image);                                            // out_image
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vk_create_image_simple: %s", vk_result_string(ret));
+		return false;
+	}
+
+	c->bounce.extent = extent;
+
+	return true;
+}
+
+static void
+bounce_fini(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	if (c->bounce.image != VK_NULL_HANDLE) {
+		vk->vkDestroyImage(vk->device, c->bounce.image, NULL);
+		vk->vkFreeMemory(vk->device, c->bounce.device_memory, NULL);
+		c->bounce.image = VK_NULL_HANDLE;
+		c->bounce.device_memory = VK_NULL_HANDLE;
+	}
+}
+
+/*!
+ * Blit the first two views of the frame side-by-side into the bounce image,
+ * with the barriers around it the old pack pass had. Needs a graphics queue.
+ */
+static void
+bounce_record_locked(struct ems_compositor *c, VkCommandBuffer cmd, const struct compose_state *cs)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	// Left and right of the first layer, the only one the old pass had.
+	if (cs->image_count < 2) {
+		return;
+	}
+
+	VkImageSubresourceRange subresource_range = {
+	    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+	    .baseMipLevel = 0,
+	    .levelCount = 1,
+	    .baseArrayLayer = 0,
+	    .layerCount = 1,
+	};
+
+	struct vk_cmd_blit_images_side_by_side_info info = {};
+	VkImage src_images[2];
+
+	for (uint32_t i = 0; i < 2; i++) {
+		struct comp_swapchain *sc = cs->image_swapchains[i];
+		src_images[i] = sc->vkic.images[cs->image_indices[i]].handle;
+
+		info.src[i].old_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		info.src[i].src_access_mask = VK_ACCESS_SHADER_READ_BIT;
+		info.src[i].src_stage_mask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+		info.src[i].rect.extent.w = (int)sc->vkic.info.width;
+		info.src[i].rect.extent.h = (int)sc->vkic.info.height;
+		info.src[i].fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
+		info.src[i].fm_image.base_array_layer = 0;
+		info.src[i].fm_image.image = src_images[i];
+	}
+
+	info.dst.old_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+	info.dst.src_access_mask = VK_ACCESS_SHADER_READ_BIT;
+	info.dst.src_stage_mask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	info.dst.size = (xrt_size){(int)c->bounce.extent.width, (int)c->bounce.extent.height};
+	info.dst.fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
+	info.dst.fm_image.base_array_layer = 0;
+	info.dst.fm_image.image = c->bounce.image;
+
+	vk_cmd_blit_images_side_by_side_locked(vk, cmd, &info);
+
+	// The dispatch samples the swapchains in the shader read layout.
+	for (uint32_t i = 0; i < 2; i++) {
+		vk_cmd_image_barrier_locked(                  //
+		    vk,                                       // vk_bundle
+		    cmd,                                      // cmdbuffer
+		    src_images[i],                            // image
+		    VK_ACCESS_TRANSFER_READ_BIT,              // srcAccessMask
+		    VK_ACCESS_SHADER_READ_BIT,                // dstAccessMask
+		    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,     // oldImageLayout
+		    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, // newImageLayout
+		    VK_PIPELINE_STAGE_TRANSFER_BIT,           // srcStageMask
+		    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,     // dstStageMask
+		    subresource_range);                       // subresourceRange
+	}
+
+	// As if the dispatch sampled it, like it used to.
+	vk_cmd_image_barrier_locked(                  //
+	    vk,                                       // vk_bundle
+	    cmd,                                      // cmdbuffer
+	    c->bounce.image,                          // image
+	    VK_ACCESS_TRANSFER_WRITE_BIT,             // srcAccessMask
+	    VK_ACCESS_SHADER_READ_BIT,                // dstAccessMask
+	    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,     // oldImageLayout
+	    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, // newImageLayout
+	    VK_PIPELINE_STAGE_TRANSFER_BIT,           // srcStageMask
+	    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,     // dstStageMask
+	    subresource_range);                       // subresourceRange
+}
+
+
+/*
+ *
+ * Stage timing functions.
+ *
+ */
+
+static void
+stage_stats_add_duration(struct ems_stage_stats *s, uint64_t duration_ns)
+{
+	uint64_t us = duration_ns / 1000;
+
+	s->count++;
+	s->total_us += us;
+	s->max_us = std::max(s->max_us, us);
+	s->last_us = us;
+}
+
+static void
+stage_stats_add(struct ems_stage_stats *s, uint64_t start_ns)
+{
+	stage_stats_add_duration(s, os_monotonic_get_ns() - start_ns);
+}
+
+
+/*
+ *
+ * GPU timestamp functions.
+ *
+ */
+
+static bool
+gpu_timestamps_init(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	if (!vk->features.timestamp_compute_and_graphics || vk->features.timestamp_valid_bits == 0) {
+		EMS_COMP_INFO(c, "No GPU timestamps, the queue can't write them.");
+		return true;
+	}
+
+	VkQueryPoolCreateInfo create_info = {
+	    .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+	    .queryType = VK_QUERY_TYPE_TIMESTAMP,
+	    .queryCount = EMS_READBACK_MAX_DEPTH * EMS_GPU_TIMESTAMP_COUNT,
+	};
+
+	VkResult ret = vk->vkCreateQueryPool(vk->device, &create_info, NULL, &c->gpu_timestamps.pool);
+	if (ret != VK_SUCCESS) {
+		// Nice to have, not worth failing over.
+		EMS_COMP_WARN(c, "vkCreateQueryPool: %s", vk_result_string(ret));
+		c->gpu_timestamps.pool = VK_NULL_HANDLE;
+		return true;
+	}
+
+	c->gpu_timestamps.calibrated = vk->has_EXT_calibrated_timestamps;
+
+	return true;
+}
+
+static void
+gpu_timestamps_fini(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	if (c->gpu_timestamps.pool != VK_NULL_HANDLE) {
+		vk->vkDestroyQueryPool(vk->device, c->gpu_timestamps.pool, NULL);
+		c->gpu_timestamps.pool = VK_NULL_HANDLE;
+	}
+}
+
+static uint32_t
+gpu_timestamps_first(struct ems_compositor *c, const struct ems_readback_slot *slot)
+{
+	return (uint32_t)(slot - c->readback.slots) * EMS_GPU_TIMESTAMP_COUNT;
+}
+
+/*!
+ * Write one of the slot's timestamps once @p stage is done, resetting them
+ * all first for @ref EMS_GPU_TIMESTAMP_BEGIN.
+ */
+static void
+gpu_timestamps_write(struct ems_compositor *c,
+                     struct ems_readback_slot *slot,
+                     VkPipelineStageFlagBits stage,
+                     enum ems_gpu_timestamp which)
+{
+	struct vk_bundle *vk = get_vk(c);
+	VkQueryPool pool = c->gpu_timestamps.pool;
+	uint32_t first = gpu_timestamps_first(c, slot);
+
+	if (pool == VK_NULL_HANDLE) {
+		return;
+	}
+
+	if (which == EMS_GPU_TIMESTAMP_BEGIN) {
+		vk->vkCmdResetQueryPool(slot->cmd, pool, first, EMS_GPU_TIMESTAMP_COUNT);
+	}
+
+	vk->vkCmdWriteTimestamp(slot->cmd, stage, pool, first + which);
+}
+
+/*!
+ * Account the slot's GPU time, its fence must have signalled. Called from the
+ * readback thread.
+ */
+static void
+gpu_timestamps_read(struct ems_compositor *c, struct ems_readback_slot *slot)
+{
+	struct vk_bundle *vk = get_vk(c);
+	VkQueryPool pool = c->gpu_timestamps.pool;
+
+	if (pool == VK_NULL_HANDLE) {
+		return;
+	}
+
+	uint64_t ts[EMS_GPU_TIMESTAMP_COUNT];
+	VkResult ret = vk->vkGetQueryPoolResults( //
+	    vk->device,                           // device
+	    pool,                                 // queryPool
+	    gpu_timestamps_first(c, slot),        // firstQuery
+	    EMS_GPU_TIMESTAMP_COUNT,              // queryCount
+	    sizeof(ts),                           // dataSize
+	    ts,                                   // pData
+	    sizeof(ts[0]),                        // stride
+	    VK_QUERY_RESULT_64_BIT);              // flags
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_DEBUG(c, "vkGetQueryPoolResults: %s", vk_result_string(ret));
+		return;
+	}
+
+	uint32_t bits = vk->features.timestamp_valid_bits;
+	uint64_t mask = bits >= 64 ? UINT64_MAX : (1ull << bits) - 1;
+	double period_ns = vk->features.timestamp_period;
+
+	// Masking keeps the difference right when the counter wraps.
+	uint64_t clear_ticks = (ts[EMS_GPU_TIMESTAMP_CLEARED] - ts[EMS_GPU_TIMESTAMP_BEGIN]) & mask;
+	uint64_t pack_ticks = (ts[EMS_GPU_TIMESTAMP_PACKED] - ts[EMS_GPU_TIMESTAMP_CLEARED]) & mask;
+
+	stage_stats_add_duration(&c->stages.gpu_clear, (uint64_t)((double)clear_ticks * period_ns));
+	stage_stats_add_duration(&c->stages.gpu_pack, (uint64_t)((double)pack_ticks * period_ns));
+
+	if (!c->gpu_timestamps.calibrated) {
+		return;
+	}
+
+	ret = vk_convert_timestamps_to_host_ns(vk, EMS_GPU_TIMESTAMP_COUNT, ts);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_DEBUG(c, "vk_convert_timestamps_to_host_ns: %s", vk_result_string(ret));
+		return;
+	}
+
+	// The GPU may pick it up before we got to note the time.
+	uint64_t begin_ns = ts[EMS_GPU_TIMESTAMP_BEGIN];
+	stage_stats_add_duration(&c->stages.gpu_queue, begin_ns > slot->submit_ns ? begin_ns - slot->submit_ns : 0);
+
+#ifdef U_TRACE_PERCETTO
+	U_TRACE_EVENT_BEGIN_ON_TRACK(timing, pc_gpu, begin_ns, "ems_clear");
+	U_TRACE_EVENT_END_ON_TRACK(timing, pc_gpu, ts[EMS_GPU_TIMESTAMP_CLEARED]);
+	U_TRACE_EVENT_BEGIN_ON_TRACK(timing, pc_gpu, ts[EMS_GPU_TIMESTAMP_CLEARED], "ems_pack");
+	U_TRACE_EVENT_END_ON_TRACK(timing, pc_gpu, ts[EMS_GPU_TIMESTAMP_PACKED]);
+#endif
+}
+
+
+/*
+ *
+ * Readback ring functions.
+ *
+ */
+
+static bool
+readback_init(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+	VkResult ret;
+
+	int64_t depth = debug_get_num_option_readback_depth();
+	if (depth < 1) {
+		depth = 1;
+	} else if (depth > EMS_READBACK_MAX_DEPTH) {
+		depth = EMS_READBACK_MAX_DEPTH;
+	}
+
+	c->readback.depth = (uint32_t)depth;
+	c->readback.head = 0;
+	c->readback.count = 0;
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(c->readback.slots); i++) {
+		VkFenceCreateInfo create_info = {
+		    .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+		};
+
+		ret = vk->vkCreateFence(vk->device, &create_info, NULL, &c->readback.slots[i].fence);
+		if (ret != VK_SUCCESS) {
+			EMS_COMP_ERROR(c, "vkCreateFence: %s", vk_result_string(ret));
+			return false;
+		}
+
+		VkDescriptorSetAllocateInfo alloc_info = {
+		    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+		    .descriptorPool = c->pack.descriptor_pool,
+		    .descriptorSetCount = 1,
+		    .pSetLayouts = &c->pack.descriptor_set_layout,
+		};
+
+		ret = vk->vkAllocateDescriptorSets(vk->device, &alloc_info, &c->readback.slots[i].descriptor_set);
+		if (ret != VK_SUCCESS) {
+			EMS_COMP_ERROR(c, "vkAllocateDescriptorSets: %s", vk_result_string(ret));
+			return false;
+		}
+
+		// Otherwise allocated with each frame.
+		if (!c->readback.cmd_per_frame) {
+			ret = vk_cmd_pool_create_cmd_buffer(vk, &c->cmd_pool, &c->readback.slots[i].cmd);
+			if (ret != VK_SUCCESS) {
+				EMS_COMP_ERROR(c, "vk_cmd_pool_create_cmd_buffer: %s", vk_result_string(ret));
+				return false;
+			}
+		}
+
+		struct ems_readback_slot *slot = &c->readback.slots[i];
+		VkMemoryPropertyFlags props =
+		    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+		if (!vk_buffer_init(vk, sizeof(struct compose_ubo), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, props,
+		                    &slot->ubo_buffer, &slot->ubo_memory)) {
+			EMS_COMP_ERROR(c, "vk_buffer_init: Failed to create uniform buffer!");
+			return false;
+		}
+
+		ret = vk->vkMapMemory(vk->device, slot->ubo_memory, 0, VK_WHOLE_SIZE, 0, &slot->ubo_ptr);
+		if (ret != VK_SUCCESS) {
+			EMS_COMP_ERROR(c, "vkMapMemory: %s", vk_result_string(ret));
+			return false;
+		}
+
+		VkBufferUsageFlags hash_usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+		if (!vk_buffer_init(vk, sizeof(uint32_t) * EMS_PACK_HASH_BUCKETS, hash_usage, props, &slot->hash_buffer,
+		                    &slot->hash_memory)) {
+			EMS_COMP_ERROR(c, "vk_buffer_init: Failed to create hash buffer!");
+			return false;
+		}
+
+		ret = vk->vkMapMemory(vk->device, slot->hash_memory, 0, VK_WHOLE_SIZE, 0, (void **)&slot->hash_ptr);
+		if (ret != VK_SUCCESS) {
+			EMS_COMP_ERROR(c, "vkMapMemory: %s", vk_result_string(ret));
+			return false;
+		}
+	}
+
+	int iret = os_thread_helper_init(&c->readback.oth);
+	if (iret < 0) {
+		EMS_COMP_ERROR(c, "os_thread_helper_init: %i", iret);
+		return false;
+	}
+
+	iret = os_thread_helper_start(&c->readback.oth, readback_thread_func, c);
+	if (iret != 0) {
+		EMS_COMP_ERROR(c, "os_thread_helper_start: %i", iret);
+		return false;
+	}
+
+	EMS_COMP_INFO(c, "Readback depth: %u", c->readback.depth);
+
+	return true;
+}
+
+/*!
+ * Create a readback pool, exporting the buffers as DMA-BUFs or importing host
+ * allocations if enabled. Whatever the device can't do is turned off for good
+ * and we fall back to host visible memory allocated by Vulkan.
+ */
+static bool
+readback_pool_create(struct ems_compositor *c, uint32_t width, uint32_t height, struct ems_readback_pool **out_pool)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	if (c->readback.dmabuf) {
+		if (ems_readback_pool_create(vk, width, height, EMS_READBACK_MEMORY_DMABUF, out_pool)) {
+			return true;
+		}
+
+		EMS_COMP_WARN(c, "Failed to export readback buffers as DMA-BUFs, falling back.");
+		c->readback.dmabuf = false;
+	}
+
+	if (c->readback.host_import) {
+		if (ems_readback_pool_create(vk, width, height, EMS_READBACK_MEMORY_HOST, out_pool)) {
+			return true;
+		}
+
+		EMS_COMP_WARN(c, "Failed to import host memory for readback buffers, falling back.");
+		c->readback.host_import = false;
+	}
+
+	return ems_readback_pool_create(vk, width, height, EMS_READBACK_MEMORY_DEVICE, out_pool);
+}
+
+/*!
+ * Is the picture in @p slot the same as the last one pushed? Remembers its
+ * hashes if not, the GPU must be done with it. Called from the readback thread.
+ */
+static bool
+readback_slot_is_unchanged(struct ems_compositor *c, struct ems_readback_slot *slot)
+{
+	uint64_t now_ns = os_monotonic_get_ns();
+	const size_t size = sizeof(c->static_frames.last_hashes);
+
+	bool unchanged = memcmp(slot->hash_ptr, c->static_frames.last_hashes, size) == 0;
+	if (unchanged && c->static_frames.enabled && now_ns - c->static_frames.last_push_ns < STATIC_FRAME_REFRESH_NS) {
+		return true;
+	}
+
+	/*
+	 * Push one anyway now and then, as a key frame: the same picture again
+	 * would be coded as skipped blocks and repair nothing a lost packet broke,
+	 * and intra refresh only advances with the frames that are encoded.
+	 */
+	if (unchanged && c->static_frames.enabled) {
+		ems_gstreamer_src_request_key_frame(c->gstreamer_src);
+	}
+
+	memcpy(c->static_frames.last_hashes, slot->hash_ptr, size);
+	c->static_frames.last_push_ns = now_ns;
+
+	return false;
+}
+
+/*!
+ * Keep the swapchain images @p cs samples in use until the slot is finished,
+ * the app's wait on them blocks until then.
+ */
+static void
+readback_slot_hold_images(struct ems_readback_slot *slot, const struct compose_state *cs)
+{
+	for (uint32_t i = 0; i < cs->image_count; i++) {
+		xrt_swapchain_reference(&slot->image_swapchains[i], &cs->image_swapchains[i]->base.base);
+		slot->image_indices[i] = cs->image_indices[i];
+		xrt_swapchain_inc_image_use(slot->image_swapchains[i], slot->image_indices[i]);
+	}
+	slot->image_count = cs->image_count;
+}
+
+static void
+readback_slot_release_images(struct ems_readback_slot *slot)
+{
+	for (uint32_t i = 0; i < slot->image_count; i++) {
+		xrt_swapchain_dec_image_use(slot->image_swapchains[i], slot->image_indices[i]);
+		xrt_swapchain_reference(&slot->image_swapchains[i], NULL);
+	}
+	slot->image_count = 0;
+}
+
+/*!
+ * Free the slot's command buffer if it is allocated every frame, the GPU must
+ * be done with it or it must never have been submitted.
+ */
+static void
+readback_slot_free_cmd_locked(struct ems_compositor *c, struct ems_readback_slot *slot)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	if (!c->readback.cmd_per_frame || slot->cmd == VK_NULL_HANDLE) {
+		return;
+	}
+
+	vk->vkFreeCommandBuffers(vk->device, c->cmd_pool.pool, 1, &slot->cmd);
+	slot->cmd = VK_NULL_HANDLE;
+}
+
+/*!
+ * Hand a finished readback to the encoder and release the slot, the GPU must
+ * be done with it. Called from the readback thread.
+ */
+static void
+readback_slot_finish(struct ems_compositor *c, struct ems_readback_slot *slot)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	if (slot->wait_semaphore != VK_NULL_HANDLE) {
+		vk->vkDestroySemaphore(vk->device, slot->wait_semaphore, NULL);
+		slot->wait_semaphore = VK_NULL_HANDLE;
+	}
+
+	vk_cmd_pool_lock(&c->cmd_pool);
+	readback_slot_free_cmd_locked(c, slot);
+	vk_cmd_pool_unlock(&c->cmd_pool);
+
+	// The app may render into the images again.
+	readback_slot_release_images(slot);
+
+	// Make the GPU writes visible to whoever reads the frame, use the frame's pool it might have been resized.
+	VkResult ret = ems_readback_pool_invalidate_frame(slot->rf->pool, slot->rf);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "ems_readback_pool_invalidate_frame: %s", vk_result_string(ret));
+	}
+
+	struct ems_readback_frame *rf = slot->rf;
+	xrt_frame *frame = &rf->base_frame;
+	slot->rf = NULL;
+
+	// The frame data has been sent already, the client keeps showing the last picture.
+	if (readback_slot_is_unchanged(c, slot)) {
+		c->static_frames.skipped++;
+		xrt_frame_reference(&frame, NULL);
+		return;
+	}
+
+	if (!c->pipeline_playing) {
+		ems_gstreamer_pipeline_play(c->gstreamer_pipeline);
+		c->pipeline_playing = true;
+	}
+
+	uint64_t push_start_ns = os_monotonic_get_ns();
+
+	ems_gstreamer_src_set_foveation(c->gstreamer_src, &slot->foveation);
+
+	u_sink_debug_push_frame(&c->debug_sink, frame);
+
+	if (c->readback.dmabuf && rf->dmabuf_fd >= 0) {
+		ems_gstreamer_src_push_dmabuf(c->gstreamer_src, frame, rf->dmabuf_fd);
+	} else {
+		xrt_sink_push_frame(c->frame_sink, frame);
+	}
+
+	stage_stats_add(&c->stages.push, push_start_ns);
+
+	// Dereference this frame - by now we should have pushed it.
+	xrt_frame_reference(&frame, NULL);
+}
+
+/*!
+ * Waits on the oldest in-flight readback and pushes it, in submission order.
+ */
+static void *
+readback_thread_func(void *ptr)
+{
+	struct ems_compositor *c = (struct ems_compositor *)ptr;
+	struct vk_bundle *vk = get_vk(c);
+
+	U_TRACE_SET_THREAD_NAME("EMS: Readback");
+
+	os_thread_helper_lock(&c->readback.oth);
+
+	while (os_thread_helper_is_running_locked(&c->readback.oth)) {
+		if (c->readback.count == 0) {
+			os_thread_helper_wait_locked(&c->readback.oth);
+			continue;
+		}
+
+		// The slot was submitted before it was counted, safe to wait on without the lock.
+		struct ems_readback_slot *slot = &c->readback.slots[c->readback.head];
+		os_thread_helper_unlock(&c->readback.oth);
+
+		uint64_t wait_start_ns = os_monotonic_get_ns();
+
+		VkResult ret = vk->vkWaitForFences(vk->device, 1, &slot->fence, VK_TRUE, UINT64_MAX);
+		if (ret != VK_SUCCESS) {
+			EMS_COMP_ERROR(c, "vkWaitForFences: %s", vk_result_string(ret));
+		}
+
+		stage_stats_add(&c->stages.wait, wait_start_ns);
+
+		gpu_timestamps_read(c, slot);
+
+		readback_slot_finish(c, slot);
+
+		os_thread_helper_lock(&c->readback.oth);
+
+		c->readback.head = (c->readback.head + 1) % c->readback.depth;
+		c->readback.count--;
+
+		// Wake up layer commit if it is waiting for a free slot.
+		os_thread_helper_signal_locked(&c->readback.oth);
+	}
+
+	os_thread_helper_unlock(&c->readback.oth);
+
+	return NULL;
+}
+
+/*!
+ * Waits until at most @p max_count readbacks are in flight, call with the
+ * thread helper lock held.
+ *
+ * The worker only waits on the condition variable when nothing is in flight,
+ * so we never both wait on it at the same time.
+ */
+static void
+readback_wait_for_count_locked(struct ems_compositor *c, uint32_t max_count)
+{
+	while (c->readback.count > max_count && os_thread_helper_is_running_locked(&c->readback.oth)) {
+		os_thread_helper_wait_locked(&c->readback.oth);
+	}
+}
+
+/*!
+ * Waits for all in-flight readbacks to be pushed.
+ */
+static void
+readback_drain(struct ems_compositor *c)
+{
+	os_thread_helper_lock(&c->readback.oth);
+	readback_wait_for_count_locked(c, 0);
+	os_thread_helper_unlock(&c->readback.oth);
+}
+
+static void
+readback_fini(struct ems_compositor *c)
+{
+	struct vk_bundle *vk = get_vk(c);
+
+	if (vk->device == VK_NULL_HANDLE) {
+		return;
+	}
+
+	// Init might have failed before the thread was created.
+	if (c->readback.oth.initialized) {
+		readback_drain(c);
+
+		// Stops and joins the thread.
+		os_thread_helper_destroy(&c->readback.oth);
+	}
+
+	vk_cmd_pool_lock(&c->cmd_pool);
+	for (uint32_t i = 0; i < ARRAY_SIZE(c->readback.slots); i++) {
+		if (c->readback.slots[i].cmd != VK_NULL_HANDLE) {
+			vk->vkFreeCommandBuffers(vk->device, c->cmd_pool.pool, 1, &c->readback.slots[i].cmd);
+			c->readback.slots[i].cmd = VK_NULL_HANDLE;
+		}
+	}
+	vk_cmd_pool_unlock(&c->cmd_pool);
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(c->readback.slots); i++) {
+		struct ems_readback_slot *slot = &c->readback.slots[i];
+
+		if (slot->fence != VK_NULL_HANDLE) {
+			vk->vkDestroyFence(vk->device, slot->fence, NULL);
+			slot->fence = VK_NULL_HANDLE;
+		}
+		if (slot->ubo_ptr != NULL) {
+			vk->vkUnmapMemory(vk->device, slot->ubo_memory);
+			slot->ubo_ptr = NULL;
+		}
+		if (slot->ubo_buffer != VK_NULL_HANDLE) {
+			vk->vkDestroyBuffer(vk->device, slot->ubo_buffer, NULL);
+			slot->ubo_buffer = VK_NULL_HANDLE;
+		}
+		if (slot->ubo_memory != VK_NULL_HANDLE) {
+			vk->vkFreeMemory(vk->device, slot->ubo_memory, NULL);
+			slot->ubo_memory = VK_NULL_HANDLE;
+		}
+		if (slot->hash_ptr != NULL) {
+			vk->vkUnmapMemory(vk->device, slot->hash_memory);
+			slot->hash_ptr = NULL;
+		}
+		if (slot->hash_buffer != VK_NULL_HANDLE) {
+			vk->vkDestroyBuffer(vk->device, slot->hash_buffer, NULL);
+			slot->hash_buffer = VK_NULL_HANDLE;
+		}
+		if (slot->hash_memory != VK_NULL_HANDLE) {
+			vk->vkFreeMemory(vk->device, slot->hash_memory, NULL);
+			slot->hash_memory = VK_NULL_HANDLE;
+		}
+	}
+}
+
+
+/*
+ *
+ * Encode size functions.
+ *
+ */
+
+/*!
+ * Rows of the depth band below views @p height rows high: a quarter of the
+ * rows, cut into @ref EMS_DEPTH_STRIPS strips.
+ */
+static uint32_t
+encode_get_depth_band_height(struct ems_compositor *c, uint32_t height)
+{
+	if (!c->depth.enabled) {
+		return 0;
+	}
+
+	return std::max(2u, (height / (4 * EMS_DEPTH_STRIPS)) & ~1u);
+}
+
+/*!
+ * Re-create everything that depends on the size of the encoded picture, on
+ * failure the old size is kept.
+ */
+static void
+encode_apply_pending_size(struct ems_compositor *c)
+{
+	os_mutex_lock(&c->encode.mutex);
+	bool pending = c->encode.pending;
+	uint32_t width = c->encode.pending_width;
+	uint32_t height = c->encode.pending_height;
+	c->encode.pending = false;
+	os_mutex_unlock(&c->encode.mutex);
+
+	if (!pending || (width == c->encode.width && height == c->encode.height)) {
+		return;
+	}
+
+	EMS_COMP_INFO(c, "Resizing encoded picture from %ux%u to %ux%u", c->encode.width, c->encode.height, width,
+	              height);
+
+	// Push the frames of the old size before the caps change.
+	readback_drain(c);
+
+	uint32_t band_height = encode_get_depth_band_height(c, height);
+
+	struct ems_readback_pool *pool = NULL;
+	if (!readback_pool_create(c, width, height + band_height, &pool)) {
+		EMS_COMP_ERROR(c, "Failed to create readback pool, keeping old size!");
+		return;
+	}
+
+	// Frames still held by the pipeline keep the old pool alive until released.
+	ems_readback_pool_destroy(&c->pool);
+	c->pool = pool;
+
+	ems_gstreamer_src_set_size(c->gstreamer_src, width, height + band_height);
+
+	c->encode.width = width;
+	c->encode.height = height;
+	c->depth.band_height = band_height;
+	c->encode.ui_width = (int32_t)width;
+	c->encode.ui_height = (int32_t)height;
+}
+
+static void
+encode_apply_btn_cb(void *ptr)
+{
+	struct ems_compositor *c = (struct ems_compositor *)ptr;
+
+	os_mutex_lock(&c->encode.mutex);
+	c->encode.base_width = (uint32_t)std::max(c->encode.ui_width, 0);
+	c->encode.base_height = (uint32_t)std::max(c->encode.ui_height, 0);
+	os_mutex_unlock(&c->encode.mutex);
+
+	// Rate control may change the scale from the stats thread, it requests under the same lock.
+	os_mutex_lock(&c->rate.mutex);
+	encode_request_scaled_size(c, c->rate.applied_scale);
+	os_mutex_unlock(&c->rate.mutex);
+}
+
+
+/*
+ *
+ * Compose functions.
+ *
+ */
+
+static void
+compose_set_pose(float orientation[4], float position[4], const struct xrt_pose *pose)
+{
+	orientation[0] = pose->orientation.x;
+	orientation[1] = pose->orientation.y;
+	orientation[2] = pose->orientation.z;
+	orientation[3] = pose->orientation.w;
+	position[0] = pose->position.x;
+	position[1] = pose->position.y;
+	position[2] = pose->position.z;
+	position[3] = 0.0f;
+}
+
+static void
+compose_set_fov(float out[4], const struct xrt_fov *fov)
+{
+	out[0] = tanf(fov->angle_left);
+	out[1] = tanf(fov->angle_right);
+	out[2] = tanf(fov->angle_up);
+	out[3] = tanf(fov->angle_down);
+}
+
+static void
+compose_set_rect(float out[4], struct comp_swapchain *sc, const struct xrt_sub_image *sub, bool flip_y)
+{
+	float width = (float)sc->vkic.info.width;
+	float height = (float)sc->vkic.info.height;
+
+	out[0] = (float)sub->rect.offset.w / width;
+	out[1] = (float)sub->rect.offset.h / height;
+	out[2] = (float)sub->rect.extent.w / width;
+	out[3] = (float)sub->rect.extent.h / height;
+
+	if (flip_y) {
+		out[1] += out[3];
+		out[3] = -out[3];
+	}
+}
+
+static enum compose_blend
+compose_get_blend(enum xrt_layer_composition_flags flags)
+{
+	if ((flags & XRT_LAYER_COMPOSITION_BLEND_TEXTURE_SOURCE_ALPHA_BIT) == 0) {
+		return COMPOSE_BLEND_OPAQUE;
+	}
+	if ((flags & XRT_LAYER_COMPOSITION_UNPREMULTIPLIED_ALPHA_BIT) != 0) {
+		return COMPOSE_BLEND_UNPREMULTIPLIED;
+	}
+	return COMPOSE_BLEND_PREMULTIPLIED;
+}
+
+static int32_t
+compose_get_eye_mask(enum xrt_layer_eye_visibility visibility)
+{
+	int32_t mask = 0;
+	mask |= (visibility & XRT_LAYER_EYE_VISIBILITY_LEFT_BIT) != 0 ? 1 : 0;
+	mask |= (visibility & XRT_LAYER_EYE_VISIBILITY_RIGHT_BIT) != 0 ? 2 : 0;
+	return mask;
+}
+
+/*!
+ * Get the view to sample @p sub through, remembers the image so the slot can
+ * keep it in use until the GPU is done with it.
+ */
+static VkImageView
+compose_get_view(struct compose_state *cs, struct comp_swapchain *sc, const struct xrt_sub_image *sub, bool alpha)
+{
+	struct comp_swapchain_image *image = &sc->images[sub->image_index];
+
+	// Two per layer and the depth views, the layer count is capped before adding.
+	cs->image_swapchains[cs->image_count] = sc;
+	cs->image_indices[cs->image_count] = sub->image_index;
+	cs->image_count++;
+
+	return alpha ? image->views.alpha[sub->array_index] : image->views.no_alpha[sub->array_index];
+}
+
+/*!
+ * Add a quad or cylinder layer, @p pose is placed in front of each eye if the
+ * layer is in view space.
+ */
+static void
+compose_add_placed_layer(struct compose_state *cs,
+                         const struct xrt_pose eye_poses[2],
+                         const struct comp_layer *layer,
+                         enum compose_layer_type type,
+                         enum xrt_layer_eye_visibility visibility,
+                         const struct xrt_sub_image *sub,
+                         const struct xrt_pose *pose)
+{
+	uint32_t index = cs->ubo.layer_count[0]++;
+	struct compose_layer *cl = &cs->ubo.layers[index];
+	enum compose_blend blend = compose_get_blend(layer->data.flags);
+
+	cl->info[0] = type;
+	cl->info[1] = blend;
+	cl->info[2] = compose_get_eye_mask(visibility);
+
+	bool alpha = blend != COMPOSE_BLEND_OPAQUE;
+	for (uint32_t eye = 0; eye < 2; eye++) {
+		struct xrt_pose placed = *pose;
+		if ((layer->data.flags & XRT_LAYER_COMPOSITION_VIEW_SPACE_BIT) != 0) {
+			math_pose_transform(&eye_poses[eye], pose, &placed);
+		}
+
+		compose_set_pose(cl->orientations[eye], cl->positions[eye], &placed);
+		compose_set_rect(cl->rects[eye], layer->sc_array[0], sub, layer->data.flip_y);
+		cs->views[index * 2 + eye] = compose_get_view(cs, layer->sc_array[0], sub, alpha);
+	}
+}
+
+static void
+compose_add_projection_layer(struct compose_state *cs,
+                             const struct comp_layer *layer,
+                             const struct xrt_layer_projection_view_data *lvd,
+                             const struct xrt_layer_projection_view_data *rvd)
+{
+	uint32_t index = cs->ubo.layer_count[0]++;
+	struct compose_layer *cl = &cs->ubo.layers[index];
+	enum compose_blend blend = compose_get_blend(layer->data.flags);
+
+	cl->info[0] = COMPOSE_LAYER_PROJECTION;
+	cl->info[1] = blend;
+	cl->info[2] = 3;
+
+	bool alpha = blend != COMPOSE_BLEND_OPAQUE;
+	for (uint32_t eye = 0; eye < 2; eye++) {
+		const struct xrt_layer_projection_view_data *vd = eye == 0 ? lvd : rvd;
+
+		compose_set_pose(cl->orientations[eye], cl->positions[eye], &vd->pose);
+		compose_set_fov(cl->fovs[eye], &vd->fov);
+		compose_set_rect(cl->rects[eye], layer->sc_array[eye], &vd->sub, layer->data.flip_y);
+		cs->views[index * 2 + eye] = compose_get_view(cs, layer->sc_array[eye], &vd->sub, alpha);
+	}
+}
+
+static float
+compose_inverse_distance(float distance)
+{
+	// Infinite far or, with reversed depth, near planes are allowed.
+	return isinf(distance) ? 0.0f : 1.0f / distance;
+}
+
+/*!
+ * Set up the depth band from the depth of @p layer, leaves it empty if the
+ * depth can't be interpreted.
+ */
+static void
+compose_set_depth(struct ems_compositor *c, struct compose_state *cs, const struct comp_layer *layer)
+{
+	const struct xrt_layer_stereo_projection_depth_data *sd = &layer->data.stereo_depth;
+	struct compose_ubo *ubo = &cs->ubo;
+	float nearest = INFINITY;
+
+	for (uint32_t eye = 0; eye < 2; eye++) {
+		const struct xrt_layer_depth_data *d = eye == 0 ? &sd->l_d : &sd->r_d;
+		struct comp_swapchain *sc = layer->sc_array[2 + eye];
+
+		if (d->max_depth <= d->min_depth || !(d->near_z > 0.0f) || !(d->far_z > 0.0f)) {
+			EMS_COMP_TRACE(c, "Unusable depth range, not sending depth");
+			return;
+		}
+
+		ubo->depth_ranges[eye][0] = compose_inverse_distance(d->near_z);
+		ubo->depth_ranges[eye][1] = compose_inverse_distance(d->far_z);
+		ubo->depth_ranges[eye][2] = d->min_depth;
+		ubo->depth_ranges[eye][3] = d->max_depth;
+		compose_set_rect(ubo->depth_rects[eye], sc, &d->sub, layer->data.flip_y);
+		cs->depth_views[eye] = compose_get_view(cs, sc, &d->sub, false);
+
+		nearest = std::min(nearest, std::min(d->near_z, d->far_z));
+	}
+
+	if (isinf(nearest)) {
+		return;
+	}
+
+	ubo->depth_info[0] = 1.0f;
+	ubo->depth_info[1] = nearest;
+	cs->depth_near = nearest;
+}
+
+/*!
+ * Where the gaze, given as tangents in view space, lands in the view of
+ * @p eye, relative to the view's size. Returns false if it is outside of
+ * what the view could show.
+ */
+static bool
+compose_get_gaze_center(const struct compose_state *cs, uint32_t eye, const float gaze[2], float *out_x, float *out_y)
+{
+	// View space looks the way the left eye does, see frame_data_send, this takes canted views into account.
+	struct xrt_quat eye_inv;
+	struct xrt_quat view_to_eye;
+	math_quat_invert(&cs->eye_poses[eye].orientation, &eye_inv);
+	math_quat_rotate(&eye_inv, &cs->eye_poses[0].orientation, &view_to_eye);
+
+	struct xrt_vec3 dir = {gaze[0], gaze[1], -1.0f};
+	struct xrt_vec3 eye_dir;
+	math_quat_rotate_vec3(&view_to_eye, &dir, &eye_dir);
+
+	if (eye_dir.z > -0.1f) {
+		return false;
+	}
+
+	const float *fov = cs->ubo.eye_fovs[eye];
+	float x = eye_dir.x / -eye_dir.z;
+	float y = eye_dir.y / -eye_dir.z;
+
+	*out_x = (x - fov[0]) / (fov[1] - fov[0]);
+	*out_y = (fov[2] - y) / (fov[2] - fov[3]);
+
+	return true;
+}
+
+/*!
+ * Keep full density where the user looks if the client tracks the eyes,
+ * otherwise where the optical axis of each view is, the lenses are sharpest
+ * there, by centering the warp on the point the fov tangents are zero.
+ */
+static void
+compose_set_foveation(struct ems_compositor *c, struct compose_state *cs)
+{
+	if (c->foveation.strength <= 0.0f) {
+		return;
+	}
+
+	float gaze[2];
+	bool follow_gaze = compositor_get_gaze(c, c->base.slot.data.display_time_ns, gaze);
+
+	for (uint32_t eye = 0; eye < 2; eye++) {
+		const float *fov = cs->ubo.eye_fovs[eye];
+		float x = -fov[0] / (fov[1] - fov[0]);
+		float y = fov[2] / (fov[2] - fov[3]);
+
+		if (follow_gaze) {
+			compose_get_gaze_center(cs, eye, gaze, &x, &y);
+		}
+
+		// Keep some of the picture on each side of the center.
+		cs->foveation.centers[eye][0] = std::clamp(x, 0.1f, 0.9f);
+		cs->foveation.centers[eye][1] = std::clamp(y, 0.1f, 0.9f);
+	}
+
+	cs->foveation.strength[0] = c->foveation.strength;
+	cs->foveation.strength[1] = c->foveation.strength;
+
+	for (uint32_t eye = 0; eye < 2; eye++) {
+		cs->ubo.foveation[eye][0] = cs->foveation.centers[eye][0];
+		cs->ubo.foveation[eye][1] = cs->foveation.centers[eye][1];
+		cs->ubo.foveation[eye][2] = cs->foveation.strength[0];
+		cs->ubo.foveation[eye][3] = cs->foveation.strength[1];
+	}
+}
+
+static void
+compose_get_projection_views(const struct comp_layer *layer,
+                             const struct xrt_layer_projection_view_data **out_lvd,
+                             const struct xrt_layer_projection_view_data **out_rvd)
+{
+	if (layer->data.type == XRT_LAYER_STEREO_PROJECTION_DEPTH) {
+		*out_lvd = &layer->data.stereo_depth.l;
+		*out_rvd = &layer->data.stereo_depth.r;
+	} else {
+		*out_lvd = &layer->data.stereo.l;
+		*out_rvd = &layer->data.stereo.r;
+	}
+}
+
+static bool
+is_projection_layer(const struct comp_layer *layer)
+{
+	return layer->data.type == XRT_LAYER_STEREO_PROJECTION ||
+	       layer->data.type == XRT_LAYER_STEREO_PROJECTION_DEPTH;
+}
+
+/*!
+ * The views at the predicted head pose for the frame's display time, in the
+ * space the app's layer poses are in.
+ */
+static void
+compose_get_predicted_views(struct ems_compositor *c, struct xrt_pose out_poses[2], struct xrt_fov out_fovs[2])
+{
+	const struct xrt_vec3 eye_relation = {FALLBACK_IPD_M, 0.0f, 0.0f};
+	struct xrt_space_relation head = XRT_SPACE_RELATION_ZERO;
+	struct xrt_pose view_poses[2];
+
+	xrt_device_get_view_poses(             //
+	    c->xdev,                           // xdev
+	    &eye_relation,                     // default_eye_relation
+	    c->base.slot.data.display_time_ns, // at_timestamp_ns
+	    2,                                 // view_count
+	    &head,                             // out_head_relation
+	    out_fovs,                          // out_fovs
+	    view_poses);                       // out_poses
+
+	for (uint32_t eye = 0; eye < 2; eye++) {
+		math_pose_transform(&head.pose, &view_poses[eye], &out_poses[eye]);
+	}
+}
+
+/*!
+ * Gather all layers of the frame into @p cs, the views we compose for are the
+ * ones of the first projection layer. Frames with only quad and cylinder
+ * layers, loading screens and menus, are composed for the predicted views.
+ * Returns false if there is nothing we can compose.
+ */
 static bool
-compositor_init_vulkan(struct ems_compositor *c)
+compose_layers(struct ems_compositor *c, struct compose_state *cs)
 {
-	struct vk_bundle *vk = get_vk(c);
-	VkResult ret;
-
-	// every backend needs at least the common extensions
-	struct u_string_list *required_instance_ext_list =
-	    u_string_list_create_from_array(instance_extensions_common, ARRAY_SIZE(instance_extensions_common));
-
-	struct u_string_list *optional_instance_ext_list = u_string_list_create();
+	const struct comp_layer *base = NULL;
+	for (uint32_t i = 0; i < c->base.slot.layer_count; i++) {
+		if (is_projection_layer(&c->base.slot.layers[i])) {
+			base = &c->base.slot.layers[i];
+			break;
+		}
+	}
 
-	ret = select_instances_extensions(c, required_instance_ext_list, optional_instance_ext_list);
-	if (ret != VK_SUCCESS) {
-		VK_ERROR(vk, "select_instances_extensions: %s\n\tFailed to select instance extensions.",
-		         vk_result_string(ret));
-		u_string_list_destroy(&required_instance_ext_list);
-		u_string_list_destroy(&optional_instance_ext_list);
-		return ret;
+	if (c->base.slot.layer_count == 0) {
+		return false;
 	}
 
-	struct u_string_list *required_device_extension_list =
-	    u_string_list_create_from_array(required_device_extensions, ARRAY_SIZE(required_device_extensions));
+	U_ZERO(cs);
+
+	struct xrt_pose eye_poses[2];
+	struct xrt_fov eye_fovs[2];
+	if (base != NULL) {
+		const struct xrt_layer_projection_view_data *lvd = NULL;
+		const struct xrt_layer_projection_view_data *rvd = NULL;
+		compose_get_projection_views(base, &lvd, &rvd);
+
+		eye_poses[0] = lvd->pose;
+		eye_poses[1] = rvd->pose;
+		eye_fovs[0] = lvd->fov;
+		eye_fovs[1] = rvd->fov;
+	} else {
+		compose_get_predicted_views(c, eye_poses, eye_fovs);
+	}
 
-	struct u_string_list *optional_device_extension_list =
-	    u_string_list_create_from_array(optional_device_extensions, ARRAY_SIZE(optional_device_extensions));
+	for (uint32_t eye = 0; eye < 2; eye++) {
+		compose_set_pose(cs->ubo.eye_orientations[eye], cs->ubo.eye_positions[eye], &eye_poses[eye]);
+		compose_set_fov(cs->ubo.eye_fovs[eye], &eye_fovs[eye]);
+		cs->eye_poses[eye] = eye_poses[eye];
+		cs->eye_fovs[eye] = eye_fovs[eye];
+	}
 
-	struct comp_vulkan_arguments vk_args = {};
+	compose_set_foveation(c, cs);
 
-	vk_args.get_instance_proc_address = vkGetInstanceProcAddr;
-	vk_args.required_instance_version = VK_MAKE_VERSION(1, 0, 0);
-	vk_args.required_instance_extensions = required_instance_ext_list;
-	vk_args.optional_instance_extensions = optional_instance_ext_list;
-	vk_args.required_device_extensions = required_device_extension_list;
-	vk_args.optional_device_extensions = optional_device_extension_list;
-	vk_args.log_level = c->settings.log_level;
-	vk_args.only_compute_queue = false; // Regular GFX
-	vk_args.selected_gpu_index = -1;    // Auto
-	vk_args.client_gpu_index = -1;      // Auto
-	vk_args.timeline_semaphore = true;  // Flag is optional, not a hard requirement.
+	for (uint32_t i = 0; i < c->base.slot.layer_count; i++) {
+		const struct comp_layer *layer = &c->base.slot.layers[i];
 
+		if (cs->ubo.layer_count[0] >= EMS_MAX_LAYERS) {
+			EMS_COMP_WARN(c, "Too many layers, dropping %u", c->base.slot.layer_count - i);
+			break;
+		}
 
-	struct comp_vulkan_results vk_res = {};
-	bool bundle_ret = comp_vulkan_init_bundle(vk, &vk_args, &vk_res);
+		switch (layer->data.type) {
+		case XRT_LAYER_STEREO_PROJECTION:
+		case XRT_LAYER_STEREO_PROJECTION_DEPTH: {
+			const struct xrt_layer_projection_view_data *l = NULL;
+			const struct xrt_layer_projection_view_data *r = NULL;
+			compose_get_projection_views(layer, &l, &r);
 
-	u_string_list_destroy(&required_instance_ext_list);
-	u_string_list_destroy(&optional_instance_ext_list);
-	u_string_list_destroy(&required_device_extension_list);
-	u_string_list_destroy(&optional_device_extension_list);
+			compose_add_projection_layer(cs, layer, l, r);
+		} break;
+		case XRT_LAYER_QUAD: {
+			const struct xrt_layer_quad_data *q = &layer->data.quad;
+			struct compose_layer *cl = &cs->ubo.layers[cs->ubo.layer_count[0]];
+
+			compose_add_placed_layer(cs, eye_poses, layer, COMPOSE_LAYER_QUAD, q->visibility, &q->sub,
+			                         &q->pose);
+			cl->params[0] = q->size.x;
+			cl->params[1] = q->size.y;
+		} break;
+		case XRT_LAYER_CYLINDER: {
+			const struct xrt_layer_cylinder_data *cyl = &layer->data.cylinder;
+			struct compose_layer *cl = &cs->ubo.layers[cs->ubo.layer_count[0]];
+
+			compose_add_placed_layer(cs, eye_poses, layer, COMPOSE_LAYER_CYLINDER, cyl->visibility,
+			                         &cyl->sub, &cyl->pose);
+			cl->params[0] = cyl->radius;
+			cl->params[1] = cyl->central_angle;
+			cl->params[2] = cyl->aspect_ratio;
+		} break;
+		default: {
+			uint32_t bit = 1u << ((uint32_t)layer->data.type % 32);
+			if ((c->warned_layer_types & bit) == 0) {
+				EMS_COMP_WARN(c, "Unhandled layer type %d, not composed", layer->data.type);
+				c->warned_layer_types |= bit;
+			}
+		} break;
+		}
+	}
 
-	if (!bundle_ret) {
+	// Only unhandled layers, there are no views to sample.
+	if (cs->ubo.layer_count[0] == 0) {
 		return false;
 	}
 
-	// clang-format off
-	static_assert(ARRAY_SIZE(vk_res.client_gpu_deviceUUID.data) == XRT_UUID_SIZE, "array size mismatch");
-	static_assert(ARRAY_SIZE(vk_res.selected_gpu_deviceUUID.data) == XRT_UUID_SIZE, "array size mismatch");
-	static_assert(ARRAY_SIZE(vk_res.client_gpu_deviceUUID.data) == ARRAY_SIZE(c->sys_info.client_vk_deviceUUID.data), "array size mismatch");
-	static_assert(ARRAY_SIZE(vk_res.selected_gpu_deviceUUID.data) == ARRAY_SIZE(c->sys_info.compositor_vk_deviceUUID.data), "array size mismatch");
-	static_assert(ARRAY_SIZE(vk_res.client_gpu_deviceLUID.data) == XRT_LUID_SIZE, "array size mismatch");
-	static_assert(ARRAY_SIZE(vk_res.client_gpu_deviceLUID.data) == ARRAY_SIZE(c->sys_info.client_d3d_deviceLUID.data), "array size mismatch");
-	// clang-format on
-
-	c->sys_info.client_vk_deviceUUID = vk_res.client_gpu_deviceUUID;
-	c->sys_info.compositor_vk_deviceUUID = vk_res.selected_gpu_deviceUUID;
-	c->sys_info.client_d3d_deviceLUID = vk_res.client_gpu_deviceLUID;
-	c->sys_info.client_d3d_deviceLUID_valid = vk_res.client_gpu_deviceLUID_valid;
-
-	// Init command pool.
-	constexpr VkCommandPoolCreateFlags flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
-	// U_LOG_I("%s", vk_result_string(ret));
-	ret = vk_cmd_pool_init(vk, &c->cmd_pool, flags);
-	if (ret != VK_SUCCESS) {
-		EMS_COMP_ERROR(c, "vk_cmd_pool_init: %s", vk_result_string(ret));
-		return false;
+	if (c->depth.enabled && base != NULL && base->data.type == XRT_LAYER_STEREO_PROJECTION_DEPTH) {
+		compose_set_depth(c, cs, base);
 	}
 
-	// Init shared swapchain resources.
-	xrt_result_t xret = comp_swapchain_shared_init(&c->base.cscs, vk);
-	if (xret != XRT_SUCCESS) {
-		EMS_COMP_ERROR(c, "comp_swapchain_shared_init: %u", xret);
-		return false;
+	// Every descriptor must be valid, fill unused ones with any view.
+	for (uint32_t i = cs->ubo.layer_count[0] * 2; i < ARRAY_SIZE(cs->views); i++) {
+		cs->views[i] = cs->views[0];
+	}
+	for (uint32_t i = 0; i < ARRAY_SIZE(cs->depth_views); i++) {
+		if (cs->depth_views[i] == VK_NULL_HANDLE) {
+			cs->depth_views[i] = cs->views[0];
+		}
 	}
 
 	return true;
@@ -255,82 +2277,72 @@ compositor_init_vulkan(struct ems_compositor *c)
 
 /*
  *
- * Other init functions.
+ * Frame data functions.
  *
  */
 
-static bool
-compositor_init_pacing(struct ems_compositor *c)
+static void
+frame_data_set_pose(em_proto_Pose *out, const struct xrt_pose *pose)
 {
-	xrt_result_t xret = u_pc_fake_create(c->settings.frame_interval_ns, os_monotonic_get_ns(), &c->upc);
-	if (xret != XRT_SUCCESS) {
-		EMS_COMP_ERROR(c, "Failed to create fake pacing helper!");
-		return false;
-	}
-
-	return true;
+	out->has_position = true;
+	out->position.x = pose->position.x;
+	out->position.y = pose->position.y;
+	out->position.z = pose->position.z;
+
+	out->has_orientation = true;
+	out->orientation.w = pose->orientation.w;
+	out->orientation.x = pose->orientation.x;
+	out->orientation.y = pose->orientation.y;
+	out->orientation.z = pose->orientation.z;
 }
 
-static bool
-compositor_init_info(struct ems_compositor *c)
+static void
+frame_data_set_fov(em_proto_Fov *out, const struct xrt_fov *fov)
 {
-	struct xrt_compositor_info *info = &c->base.base.base.info;
-
-	struct comp_vulkan_formats formats = {};
-	comp_vulkan_formats_check(get_vk(c), &formats);
-	comp_vulkan_formats_copy_to_info(&formats, info);
-	comp_vulkan_formats_log(c->settings.log_level, &formats);
-
-	return true;
+	out->angle_left = fov->angle_left;
+	out->angle_right = fov->angle_right;
+	out->angle_up = fov->angle_up;
+	out->angle_down = fov->angle_down;
 }
 
-static bool
-compositor_init_sys_info(struct ems_compositor *c, struct xrt_device *xdev)
+/*!
+ * Tell the client which views frame @p frame_id was rendered with and when it
+ * is to be displayed, so it can submit the frame with the same poses and let
+ * the runtime reproject it.
+ */
+static void
+frame_data_send(struct ems_compositor *c, int64_t frame_id, const struct compose_state *cs)
 {
-	struct xrt_system_compositor_info *sys_info = &c->sys_info;
-
-	// Required by OpenXR spec.
-	sys_info->max_layers = 16;
+	em_proto_DownMessage msg = em_proto_DownMessage_init_default;
+	em_proto_DownFrameDataMessage *fd = &msg.frame_data;
 
-	// UUIDs and LUID already set in vk init.
-	(void)sys_info->compositor_vk_deviceUUID;
-	(void)sys_info->client_vk_deviceUUID;
-	(void)sys_info->client_d3d_deviceLUID;
-	(void)sys_info->client_d3d_deviceLUID_valid;
+	msg.has_frame_data = true;
+	fd->frame_sequence_id = frame_id;
+	fd->display_time = (int64_t)c->base.slot.data.display_time_ns;
 
-	// clang-format off
+	// The view space pose sits between the eyes, looking the way the left eye does.
+	struct xrt_pose view_space = cs->eye_poses[0];
+	math_vec3_accum(&cs->eye_poses[1].position, &view_space.position);
+	math_vec3_scalar_mul(0.5f, &view_space.position);
 
-	// These seem to control the
-	sys_info->views[0].recommended.width_pixels  = APP_VIEW_W;
-	sys_info->views[0].recommended.height_pixels = APP_VIEW_H;
-	sys_info->views[0].recommended.sample_count  = 1;
-	sys_info->views[0].max.width_pixels          = 2048;
-	sys_info->views[0].max.height_pixels         = 2048;
-	sys_info->views[0].max.sample_count          = 1;
+	fd->has_P_localSpace_viewSpace = true;
+	frame_data_set_pose(&fd->P_localSpace_viewSpace, &view_space);
 
-	sys_info->views[1].recommended.width_pixels  = APP_VIEW_W;
-	sys_info->views[1].recommended.height_pixels = APP_VIEW_H;
-	sys_info->views[1].recommended.sample_count  = 1;
-	sys_info->views[1].max.width_pixels          = 2048;
-	sys_info->views[1].max.height_pixels         = 2048;
-	sys_info->views[1].max.sample_count          = 1;
-	// clang-format on
+	fd->has_P_localSpace_view0 = true;
+	frame_data_set_pose(&fd->P_localSpace_view0, &cs->eye_poses[0]);
+	fd->has_P_localSpace_view1 = true;
+	frame_data_set_pose(&fd->P_localSpace_view1, &cs->eye_poses[1]);
 
-	// Copy the list directly.
-	assert(xdev->hmd->blend_mode_count <= XRT_MAX_DEVICE_BLEND_MODES);
-	assert(xdev->hmd->blend_mode_count != 0);
-	assert(xdev->hmd->blend_mode_count <= ARRAY_SIZE(sys_info->supported_blend_modes));
-	for (size_t i = 0; i < xdev->hmd->blend_mode_count; ++i) {
-		assert(u_verify_blend_mode_valid(xdev->hmd->blend_modes[i]));
-		sys_info->supported_blend_modes[i] = xdev->hmd->blend_modes[i];
-	}
-	sys_info->supported_blend_mode_count = (uint8_t)xdev->hmd->blend_mode_count;
+	fd->has_fov0 = true;
+	frame_data_set_fov(&fd->fov0, &cs->eye_fovs[0]);
+	fd->has_fov1 = true;
+	frame_data_set_fov(&fd->fov1, &cs->eye_fovs[1]);
 
-	// Refresh rates.
-	sys_info->num_refresh_rates = 1;
-	sys_info->refresh_rates[0] = (float)(1. / time_ns_to_s(c->settings.frame_interval_ns));
+	fd->depth_band_height = (int32_t)c->depth.band_height;
+	fd->depth_near = cs->depth_near;
 
-	return true;
+	// Fails if no client is connected, nothing to do then.
+	ems_gstreamer_pipeline_send_down_message(c->gstreamer_pipeline, &msg);
 }
 
 
@@ -340,190 +2352,280 @@ compositor_init_sys_info(struct ems_compositor *c, struct xrt_device *xdev)
  *
  */
 
-void
-pack_blit_and_encode(struct ems_compositor *c,
-                     const struct xrt_layer_projection_view_data *lvd,
-                     const struct xrt_layer_projection_view_data *rvd,
-                     struct comp_swapchain *lsc,
-                     struct comp_swapchain *rsc)
+/*!
+ * Is the encoder so far behind that a frame packed now would be stale before
+ * it got encoded? Counts the frames in the readback ring too, they are on
+ * their way to the encoder.
+ */
+static bool
+encode_is_backlogged(struct ems_compositor *c)
+{
+	uint32_t encoder_frames = ems_gstreamer_src_get_backlog(c->gstreamer_src);
+
+	os_thread_helper_lock(&c->readback.oth);
+	uint32_t readback_frames = c->readback.count;
+	os_thread_helper_unlock(&c->readback.oth);
+
+	c->backlog.frames = encoder_frames + readback_frames;
+	if (c->backlog.frames <= c->backlog.max_frames) {
+		return false;
+	}
+
+	if (encoder_frames > c->backlog.max_frames) {
+		c->backlog.skipped_encoder++;
+	} else {
+		c->backlog.skipped_readback++;
+	}
+
+	EMS_COMP_TRACE(c, "Skipping frame, %u frames to the encoder and %u in readback", encoder_frames,
+	               readback_frames);
+
+	return true;
+}
+
+/*!
+ * Flatten the layers in @p cs into one side-by-side NV12 frame and read it
+ * back, takes ownership of @p wait_semaphore on successful submit.
+ */
+static void
+compose_and_encode(struct ems_compositor *c, const struct compose_state *cs, VkSemaphore *wait_semaphore)
 {
 	if (c->offset_ns == 0) {
 		uint64_t now = os_monotonic_get_ns();
 		c->offset_ns = now;
-		c->gstreamer_sink->offset_ns = now;
+		c->gstreamer_src->offset_ns = now;
 	}
 	VkResult ret;
 
-	struct vk_image_readback_to_xf *wrap = NULL;
+	struct ems_readback_frame *rf = NULL;
 	struct vk_bundle *vk = &c->base.vk;
 
+	// Picks up size changes, drains the ring if needed.
+	encode_apply_pending_size(c);
+
+	ems_gstreamer_src_get_packet_latency(c->gstreamer_src, &c->packet_latency);
+
+	if (encode_is_backlogged(c)) {
+		return;
+	}
+
+	// All slots in flight, we have no choice but to wait for the oldest one.
+	os_thread_helper_lock(&c->readback.oth);
+	if (c->readback.count >= c->readback.depth) {
+		c->readback.stalls++;
+		readback_wait_for_count_locked(c, c->readback.depth - 1);
+	}
+	uint32_t index = (c->readback.head + c->readback.count) % c->readback.depth;
+	os_thread_helper_unlock(&c->readback.oth);
+
 	// Getting frame
-	if (!vk_image_readback_to_xf_pool_get_unused_frame(vk, c->pool, &wrap)) {
-		EMS_COMP_ERROR(c, "vk_image_readback_to_xf_pool_get_unused_frame: Failed!");
+	if (!ems_readback_pool_get_unused_frame(c->pool, &rf)) {
+		EMS_COMP_ERROR(c, "ems_readback_pool_get_unused_frame: Failed!");
+		c->readback.overruns++;
 		return;
 	}
 
+	// Not counting any wait for a free slot above.
+	uint64_t pack_start_ns = os_monotonic_get_ns();
+
 	// Usefull.
-	xrt_frame *frame = &wrap->base_frame;
+	xrt_frame *frame = &rf->base_frame;
+
+	struct ems_readback_slot *slot = &c->readback.slots[index];
 
-	const VkCommandBufferUsageFlags flags = 0;
-	VkCommandBuffer cmd = {};
+	// The slot isn't in flight so this is safe.
+	slot->rf = rf;
+	slot->foveation = cs->foveation;
+	memcpy(slot->ubo_ptr, &cs->ubo, sizeof(cs->ubo));
+	pack_update_descriptor_set(c, slot, cs);
 
-	// For submitting commands.
+	VkCommandBufferBeginInfo begin_info = {
+	    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+	    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+	};
+
+	// For recording and submitting commands.
 	vk_cmd_pool_lock(&c->cmd_pool);
 
-	ret = vk_cmd_pool_create_and_begin_cmd_buffer_locked(vk, &c->cmd_pool, flags, &cmd);
+	if (c->readback.cmd_per_frame) {
+		ret = vk_cmd_pool_create_and_begin_cmd_buffer_locked(vk, &c->cmd_pool, begin_info.flags, &slot->cmd);
+	} else {
+		// Implicitly resets the command buffer, the slot isn't in flight.
+		ret = vk->vkBeginCommandBuffer(slot->cmd, &begin_info);
+	}
 	if (ret != VK_SUCCESS) {
-		EMS_COMP_ERROR(c, "vk_cmd_pool_create_and_begin_cmd_buffer_locked: %s", vk_result_string(ret));
+		EMS_COMP_ERROR(c, "vkBeginCommandBuffer: %s", vk_result_string(ret));
+		vk_cmd_pool_unlock(&c->cmd_pool);
+		slot->rf = NULL;
 		xrt_frame_reference(&frame, NULL);
 		return;
 	}
 
-	// Blit images side-by-side (does scaling).
-	{
-		struct vk_cmd_blit_images_side_by_side_info info = {};
-
-		info.src[0].old_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		info.src[0].src_access_mask = VK_ACCESS_SHADER_READ_BIT;
-		info.src[0].src_stage_mask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-		info.src[0].rect = lvd->sub.rect;
-		info.src[0].fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
-		info.src[0].fm_image.base_array_layer = lvd->sub.array_index;
-		info.src[0].fm_image.image = lsc->vkic.images[lvd->sub.image_index].handle;
-
-		info.src[1].old_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		info.src[1].src_access_mask = VK_ACCESS_SHADER_READ_BIT;
-		info.src[1].src_stage_mask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-		info.src[1].rect = rvd->sub.rect;
-		info.src[1].fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
-		info.src[1].fm_image.base_array_layer = rvd->sub.array_index;
-		info.src[1].fm_image.image = rsc->vkic.images[rvd->sub.image_index].handle;
-
-		info.dst.old_layout = VK_IMAGE_LAYOUT_UNDEFINED;
-		info.dst.src_access_mask = VK_ACCESS_TRANSFER_READ_BIT;
-		info.dst.src_stage_mask = VK_PIPELINE_STAGE_TRANSFER_BIT;
-		info.dst.size = (xrt_size){READBACK_W, READBACK_H};
-		info.dst.fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
-		info.dst.fm_image.base_array_layer = 0;
-		info.dst.fm_image.image = c->bounce.image;
-
-		vk_cmd_blit_images_side_by_side_locked(vk, cmd, &info);
-	}
-
-	// Copy bounce to destination.
+	VkCommandBuffer cmd = slot->cmd;
+
+	/*
+	 * Flatten the layers side-by-side and convert to NV12 in a single
+	 * dispatch, straight into the readback buffer. Swapchain images are kept
+	 * in the shader read layout between frames so no image barriers are needed.
+	 */
 	{
-		struct vk_cmd_copy_image_info info = {};
+		struct pack_push_constants push = {
+		    .extent = {(int32_t)c->encode.width, (int32_t)c->encode.height},
+		    .depth_rows = (int32_t)c->depth.band_height,
+		};
 
-		info.src.old_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-		info.src.src_access_mask = VK_ACCESS_TRANSFER_WRITE_BIT;
-		info.src.src_stage_mask = VK_PIPELINE_STAGE_TRANSFER_BIT;
-		info.src.fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
-		info.src.fm_image.base_array_layer = 0;
-		info.src.fm_image.image = c->bounce.image;
+		gpu_timestamps_write(c, slot, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, EMS_GPU_TIMESTAMP_BEGIN);
 
-		info.dst.old_layout = wrap->layout;
-		info.dst.src_access_mask = VK_ACCESS_HOST_READ_BIT;
-		info.dst.src_stage_mask = VK_PIPELINE_STAGE_HOST_BIT;
-		info.dst.fm_image.aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
-		info.dst.fm_image.base_array_layer = 0;
-		info.dst.fm_image.image = wrap->image;
+		// The shader adds to the hashes.
+		vk->vkCmdFillBuffer(cmd, slot->hash_buffer, 0, VK_WHOLE_SIZE, 0);
 
-		info.size = (xrt_size){READBACK_W, READBACK_H};
+		gpu_timestamps_write(c, slot, VK_PIPELINE_STAGE_TRANSFER_BIT, EMS_GPU_TIMESTAMP_CLEARED);
 
-		vk_cmd_copy_image_locked(vk, cmd, &info);
-	}
+		VkMemoryBarrier clear_barrier = {
+		    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+		};
 
-	// Barrier images back, or make ready for read.
-	{
-		// Copy views into bounce.
-		for (int view = 0; view < 2; view++) {
-
-			const xrt_layer_projection_view_data *data = (view == 0) ? lvd : rvd;
-			struct comp_swapchain *sc = (view == 0) ? lsc : rsc;
-
-			VkImageLayout srcImageOldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-			VkImage srcImage = sc->vkic.images[data->sub.image_index].handle;
-
-			VkImageSubresourceRange view_subresource_range = {
-			    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-			    .baseMipLevel = 0,
-			    .levelCount = 1,
-			    .baseArrayLayer = data->sub.array_index,
-			    .layerCount = 1,
-			};
-
-			// Barrier to make source back what it was before
-			vk_cmd_image_barrier_locked(              //
-			    vk,                                   // vk_bundle
-			    cmd,                                  // cmdbuffer
-			    srcImage,                             // image
-			    VK_ACCESS_TRANSFER_READ_BIT,          // srcAccessMask
-			    VK_ACCESS_SHADER_READ_BIT,            // dstAccessMask
-			    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, // oldImageLayout
-			    srcImageOldLayout,                    // newImageLayout
-			    VK_PIPELINE_STAGE_TRANSFER_BIT,       // srcStageMask
-			    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, // dstStageMask
-			    view_subresource_range);              // subresourceRange
+		vk->vkCmdPipelineBarrier(                 //
+		    cmd,                                  // commandBuffer
+		    VK_PIPELINE_STAGE_TRANSFER_BIT,       // srcStageMask
+		    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, // dstStageMask
+		    0,                                    // dependencyFlags
+		    1,                                    // memoryBarrierCount
+		    &clear_barrier,                       // pMemoryBarriers
+		    0,                                    // bufferMemoryBarrierCount
+		    NULL,                                 // pBufferMemoryBarriers
+		    0,                                    // imageMemoryBarrierCount
+		    NULL);                                // pImageMemoryBarriers
+
+		// Counted in the pack time, so it can be compared with and without.
+		if (c->bounce.enabled) {
+			bounce_record_locked(c, cmd, cs);
 		}
 
-		VkImageSubresourceRange first_color_level_subresource_range = {
-		    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-		    .baseMipLevel = 0,
-		    .levelCount = 1,
-		    .baseArrayLayer = 0,
-		    .layerCount = 1,
+		vk->vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, c->pack.pipeline);
+
+		vk->vkCmdBindDescriptorSets(        //
+		    cmd,                            // commandBuffer
+		    VK_PIPELINE_BIND_POINT_COMPUTE, // pipelineBindPoint
+		    c->pack.pipeline_layout,        // layout
+		    0,                              // firstSet
+		    1,                              // descriptorSetCount
+		    &slot->descriptor_set,          // pDescriptorSets
+		    0,                              // dynamicOffsetCount
+		    NULL);                          // pDynamicOffsets
+
+		vk->vkCmdPushConstants(          //
+		    cmd,                         // commandBuffer
+		    c->pack.pipeline_layout,     // layout
+		    VK_SHADER_STAGE_COMPUTE_BIT, // stageFlags
+		    0,                           // offset
+		    sizeof(push),                // size
+		    &push);                      // pValues
+
+		// Each invocation does a 4x2 block, workgroups are 8x8 invocations.
+		uint32_t groups_x = (c->encode.width / 4 + 7) / 8;
+		uint32_t groups_y = ((c->encode.height + c->depth.band_height) / 2 + 7) / 8;
+
+		vk->vkCmdDispatch(cmd, groups_x, groups_y, 1);
+
+		gpu_timestamps_write(c, slot, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, EMS_GPU_TIMESTAMP_PACKED);
+
+		// Make the shader writes, picture and hashes, available to the host once the fence signals.
+		VkMemoryBarrier memory_barrier = {
+		    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+		    .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
 		};
 
-		// Barrier transfer image to host so we can safely read back.
-		vk_cmd_image_barrier_locked(              //
-		    vk,                                   // vk_bundle
-		    cmd,                                  // cmdbuffer
-		    wrap->image,                          // image
-		    VK_ACCESS_TRANSFER_WRITE_BIT,         // srcAccessMask
-		    VK_ACCESS_HOST_READ_BIT,              // dstAccessMask
-		    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, // oldImageLayout
-		    VK_IMAGE_LAYOUT_GENERAL,              // newImageLayout
-		    VK_PIPELINE_STAGE_TRANSFER_BIT,       // srcStageMask
+		vk->vkCmdPipelineBarrier(                 //
+		    cmd,                                  // commandBuffer
+		    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, // srcStageMask
 		    VK_PIPELINE_STAGE_HOST_BIT,           // dstStageMask
-		    first_color_level_subresource_range); // subresourceRange
+		    0,                                    // dependencyFlags
+		    1,                                    // memoryBarrierCount
+		    &memory_barrier,                      // pMemoryBarriers
+		    0,                                    // bufferMemoryBarrierCount
+		    NULL,                                 // pBufferMemoryBarriers
+		    0,                                    // imageMemoryBarrierCount
+		    NULL);                                // pImageMemoryBarriers
 	}
 
-	// Done submitting commands.
-
-	// Waits for command to finish.
-	ret = vk_cmd_pool_end_submit_wait_and_free_cmd_buffer_locked(vk, &c->cmd_pool, cmd);
-
-	// Unlock before checking.
-	vk_cmd_pool_unlock(&c->cmd_pool);
-
-	// Do checking here.
+	// Done recording commands.
+	ret = vk->vkEndCommandBuffer(cmd);
 	if (ret != VK_SUCCESS) {
-		EMS_COMP_ERROR(c, "vk_cmd_pool_end_submit_wait_and_free_cmd_buffer_locked: %s", vk_result_string(ret));
+		EMS_COMP_ERROR(c, "vkEndCommandBuffer: %s", vk_result_string(ret));
+		readback_slot_free_cmd_locked(c, slot);
+		vk_cmd_pool_unlock(&c->cmd_pool);
+		slot->rf = NULL;
 		xrt_frame_reference(&frame, NULL);
 		return;
 	}
 
-	// HACK
-	wrap->base_frame.timestamp = os_monotonic_get_ns();
-	wrap->base_frame.source_timestamp = wrap->base_frame.timestamp;
-	wrap->base_frame.source_sequence = c->image_sequence++;
-	wrap->base_frame.source_id = 0;
-	wrap = NULL;
+	vk->vkResetFences(vk->device, 1, &slot->fence);
 
-	if (!c->pipeline_playing) {
-		ems_gstreamer_pipeline_play(c->gstreamer_pipeline);
-		c->pipeline_playing = true;
+	// Sample the swapchains only once the app's rendering is done.
+	VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	if (c->bounce.enabled) {
+		wait_stage |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+	}
+	bool wait = *wait_semaphore != VK_NULL_HANDLE;
+
+	VkSubmitInfo submit_info = {
+	    .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+	    .waitSemaphoreCount = wait ? 1u : 0u,
+	    .pWaitSemaphores = wait_semaphore,
+	    .pWaitDstStageMask = &wait_stage,
+	    .commandBufferCount = 1,
+	    .pCommandBuffers = &cmd,
+	};
+
+	// Don't wait, the fence tells us when the frame can be pushed.
+	slot->submit_ns = os_monotonic_get_ns();
+	ret = vk_cmd_submit_locked(vk, 1, &submit_info, slot->fence);
+	if (ret != VK_SUCCESS) {
+		EMS_COMP_ERROR(c, "vk_cmd_submit_locked: %s", vk_result_string(ret));
+		readback_slot_free_cmd_locked(c, slot);
+		vk_cmd_pool_unlock(&c->cmd_pool);
+		slot->rf = NULL;
+		xrt_frame_reference(&frame, NULL);
+		return;
 	}
 
-	u_sink_debug_push_frame(&c->debug_sink, frame);
+	vk_cmd_pool_unlock(&c->cmd_pool);
 
-	xrt_sink_push_frame(c->frame_sink, frame);
+	stage_stats_add(&c->stages.pack, pack_start_ns);
 
+	if (cs->depth_near > 0.0f) {
+		c->depth.frames++;
+	}
 
-	// TODO send data channel message with pose and fov here?
+	// The frame id travels with the frame into the bitstream, zero means none.
+	int64_t frame_id = ++c->frame_sequence;
+	ems_pacing_mark_sent(&c->pacing, frame_id, c->base.slot.data.frame_id);
 
-	// Dereference this frame - by now we should have pushed it.
-	xrt_frame_reference(&frame, NULL);
+	// HACK
+	rf->base_frame.timestamp = os_monotonic_get_ns();
+	rf->base_frame.source_timestamp = rf->base_frame.timestamp;
+	rf->base_frame.source_sequence = (uint64_t)frame_id;
+	rf->base_frame.source_id = 0;
+
+	// The slot now owns our reference to the frame and the semaphore.
+	slot->wait_semaphore = *wait_semaphore;
+	*wait_semaphore = VK_NULL_HANDLE;
+
+	// Commit returns before the dispatch has sampled the app's images.
+	readback_slot_hold_images(slot, cs);
+
+	// Hand the slot over to the readback thread.
+	os_thread_helper_lock(&c->readback.oth);
+	c->readback.count++;
+	os_thread_helper_signal_locked(&c->readback.oth);
+	os_thread_helper_unlock(&c->readback.oth);
+
+	// Sent ahead of the frame, it still has to be encoded.
+	frame_data_send(c, frame_id, cs);
 }
 
 
@@ -565,20 +2667,14 @@ ems_compositor_predict_frame(struct xrt_compositor *xc,
 	EMS_COMP_TRACE(c, "PREDICT_FRAME");
 
 	uint64_t now_ns = os_monotonic_get_ns();
-	uint64_t null_desired_present_time_ns = 0;
-	uint64_t null_present_slop_ns = 0;
-	uint64_t null_min_display_period_ns = 0;
-
-	u_pc_predict(                        //
-	    c->upc,                          // upc
-	    now_ns,                          // now_ns
-	    out_frame_id,                    // out_frame_id
-	    out_wake_time_ns,                // out_wake_up_time_ns
-	    &null_desired_present_time_ns,   // out_desired_present_time_ns
-	    &null_present_slop_ns,           // out_present_slop_ns
-	    out_predicted_display_time_ns,   // out_predicted_display_time_ns
-	    out_predicted_display_period_ns, // out_predicted_display_period_ns
-	    &null_min_display_period_ns);    // out_min_display_period_ns
+
+	ems_pacing_predict(                   //
+	    &c->pacing,                       // p
+	    now_ns,                           // now_ns
+	    out_frame_id,                     // out_frame_id
+	    out_wake_time_ns,                 // out_wake_up_time_ns
+	    out_predicted_display_time_ns,    // out_predicted_display_time_ns
+	    out_predicted_display_period_ns); // out_predicted_display_period_ns
 
 	return XRT_SUCCESS;
 }
@@ -596,7 +2692,7 @@ ems_compositor_mark_frame(struct xrt_compositor *xc,
 
 	switch (point) {
 	case XRT_COMPOSITOR_FRAME_POINT_WOKE:
-		u_pc_mark_point(c->upc, U_TIMING_POINT_WAKE_UP, frame_id, when_ns);
+		// The grid follows the client, not when we wake up.
 		return XRT_SUCCESS;
 	default: assert(false);
 	}
@@ -633,58 +2729,42 @@ ems_compositor_layer_commit(struct xrt_compositor *xc, xrt_graphics_sync_handle_
 	struct ems_compositor *c = ems_compositor(xc);
 	EMS_COMP_TRACE(c, "LAYER_COMMIT");
 
-	int64_t frame_id = c->base.slot.data.frame_id;
+	uint64_t commit_start_ns = os_monotonic_get_ns();
+
+	// Let the GPU wait for the app's rendering instead of blocking this thread.
+	VkSemaphore wait_semaphore = VK_NULL_HANDLE;
+	if (xrt_graphics_sync_handle_is_valid(sync_handle)) {
+		VkResult ret = vk_create_semaphore_from_native(get_vk(c), sync_handle, &wait_semaphore);
+		if (ret == VK_SUCCESS) {
+			// The semaphore owns the handle now.
+			sync_handle = XRT_GRAPHICS_SYNC_HANDLE_INVALID;
+		} else {
+			EMS_COMP_ERROR(c, "vk_create_semaphore_from_native: %s", vk_result_string(ret));
+		}
+	}
 
 	u_graphics_sync_unref(&sync_handle);
 
-	/*
-	 * Time keeping needed to keep the pacer happy.
-	 */
-
-	// When we begin rendering.
-	{
-		uint64_t now_ns = os_monotonic_get_ns();
-		u_pc_mark_point(c->upc, U_TIMING_POINT_BEGIN, frame_id, now_ns);
-	}
-
 	// We want to render here. comp_base filled c->base.slot.layers for us.
-	for (uint32_t i = 0; i < c->base.slot.layer_count; i++) {
-		comp_layer &layer = c->base.slot.layers[i];
-
-		switch (layer.data.type) {
-		case XRT_LAYER_STEREO_PROJECTION_DEPTH: {
-			const struct xrt_layer_stereo_projection_depth_data *stereo = &layer.data.stereo_depth;
-			const struct xrt_layer_projection_view_data *lvd = &stereo->l;
-			const struct xrt_layer_projection_view_data *rvd = &stereo->r;
-
-			struct comp_swapchain *left = layer.sc_array[0];
-			struct comp_swapchain *right = layer.sc_array[1];
-
-			pack_blit_and_encode(c, lvd, rvd, left, right);
-		} break;
-		case XRT_LAYER_STEREO_PROJECTION: {
-			const struct xrt_layer_stereo_projection_data *stereo = &layer.data.stereo;
-			const struct xrt_layer_projection_view_data *lvd = &stereo->l;
-			const struct xrt_layer_projection_view_data *rvd = &stereo->r;
-
-			struct comp_swapchain *left = layer.sc_array[0];
-			struct comp_swapchain *right = layer.sc_array[1];
-
-			pack_blit_and_encode(c, lvd, rvd, left, right);
-		} break;
-		default: U_LOG_E("Unhandled layer type %d", layer.data.type); break;
-		}
+	struct compose_state cs;
+	if (compose_layers(c, &cs)) {
+		compose_and_encode(c, &cs, &wait_semaphore);
+	} else if (c->base.slot.layer_count > 0) {
+		EMS_COMP_DEBUG(c, "No layer we can compose, not encoding frame");
 	}
 
-	// When we are submitting to the GPU.
-	{
-		uint64_t now_ns = os_monotonic_get_ns();
-		u_pc_mark_point(c->upc, U_TIMING_POINT_SUBMIT, frame_id, now_ns);
+	// Not consumed if we didn't encode.
+	if (wait_semaphore != VK_NULL_HANDLE) {
+		get_vk(c)->vkDestroySemaphore(get_vk(c)->device, wait_semaphore, NULL);
 	}
 
 	// Now is a good point to garbage collect.
 	comp_swapchain_shared_garbage_collect(&c->base.cscs);
 
+	uint64_t commit_us = (os_monotonic_get_ns() - commit_start_ns) / 1000;
+	c->commit_cpu.last_us = commit_us;
+	c->commit_cpu.avg_us = c->commit_cpu.avg_us * 0.95f + (float)commit_us * 0.05f;
+
 	return XRT_SUCCESS;
 }
 
@@ -752,20 +2832,31 @@ ems_compositor_destroy(struct xrt_compositor *xc)
 
 	EMS_COMP_DEBUG(c, "EMS_COMP_COMP_DESTROY");
 
+	// The pipeline and the instance's callbacks outlive us, stop them from calling into us first.
+	ems_callbacks_remove(c->instance->callbacks, EMS_CALLBACKS_EVENT_FRAME | EMS_CALLBACKS_EVENT_GAZE, c);
+	if (c->gstreamer_pipeline != NULL) {
+		ems_gstreamer_pipeline_set_stats_callback(c->gstreamer_pipeline, NULL, NULL);
+		ems_gstreamer_pipeline_set_probe_callback(c->gstreamer_pipeline, NULL, NULL);
+	}
+
+	u_var_remove_root(c);
+
+	// Push or wait for any readbacks still in flight.
+	readback_fini(c);
+
 	// Make sure we don't have anything to destroy.
 	comp_swapchain_shared_garbage_collect(&c->base.cscs);
 	comp_swapchain_shared_destroy(&c->base.cscs, vk);
 
-	vk_image_readback_to_xf_pool_destroy(vk, &c->pool);
+	ems_readback_pool_destroy(&c->pool);
 
-	vk_cmd_pool_destroy(vk, &c->cmd_pool);
+	pack_fini(c);
 
-	if (c->bounce.image != VK_NULL_HANDLE) {
-		vk->vkDestroyImage(vk->device, c->bounce.image, NULL);
-		vk->vkFreeMemory(vk->device, c->bounce.device_memory, NULL);
-		c->bounce.image = VK_NULL_HANDLE;
-		c->bounce.device_memory = VK_NULL_HANDLE;
-	}
+	bounce_fini(c);
+
+	gpu_timestamps_fini(c);
+
+	vk_cmd_pool_destroy(vk, &c->cmd_pool);
 
 	if (vk->device != VK_NULL_HANDLE) {
 		vk->vkDestroyDevice(vk->device, NULL);
@@ -781,7 +2872,11 @@ ems_compositor_destroy(struct xrt_compositor *xc)
 
 	comp_base_fini(&c->base);
 
-	u_pc_destroy(&c->upc);
+	ems_pacing_fini(&c->pacing);
+
+	os_mutex_destroy(&c->encode.mutex);
+	os_mutex_destroy(&c->gaze.mutex);
+	os_mutex_destroy(&c->rate.mutex);
 
 	free(c);
 }
@@ -793,8 +2888,20 @@ ems_compositor_destroy(struct xrt_compositor *xc)
  *
  */
 
+void
+ems_compositor_request_encode_size(struct ems_compositor *c, uint32_t width, uint32_t height)
+{
+	align_encode_size(&width, &height);
+
+	os_mutex_lock(&c->encode.mutex);
+	c->encode.pending = true;
+	c->encode.pending_width = width;
+	c->encode.pending_height = height;
+	os_mutex_unlock(&c->encode.mutex);
+}
+
 xrt_result_t
-ems_compositor_create_system(ems_instance &emsi, struct xrt_system_compositor **out_xsysc)
+ems_compositor_create(ems_instance &emsi, struct ems_compositor **out_c)
 {
 	struct ems_compositor *c = U_TYPED_CALLOC(struct ems_compositor);
 
@@ -819,12 +2926,32 @@ ems_compositor_create_system(ems_instance &emsi, struct xrt_system_compositor **
 	c->frame.waited.id = -1;
 	c->frame.rendering.id = -1;
 	c->state = EMS_COMP_COMP_STATE_READY;
+	c->instance = &emsi;
 
 	xrt_device *xdev = emsi.xsysd_base.roles.head;
 
 	c->settings.frame_interval_ns = xdev->hmd->screens[0].nominal_frame_interval_ns;
+	c->settings.view_width = (uint32_t)std::max<int64_t>(debug_get_num_option_view_width(), 16);
+	c->settings.view_height = (uint32_t)std::max<int64_t>(debug_get_num_option_view_height(), 16);
 	c->xdev = xdev;
 
+	// Decides how the command pool is created.
+	c->readback.cmd_per_frame = debug_get_bool_option_pack_cmd_per_frame();
+
+	// Default to half resolution for each eye, side-by-side.
+	int64_t encode_width = debug_get_num_option_encode_width();
+	int64_t encode_height = debug_get_num_option_encode_height();
+	c->encode.width = encode_width > 0 ? (uint32_t)encode_width : c->settings.view_width;
+	c->encode.height = encode_height > 0 ? (uint32_t)encode_height : c->settings.view_height / 2;
+	align_encode_size(&c->encode.width, &c->encode.height);
+	c->encode.ui_width = (int32_t)c->encode.width;
+	c->encode.ui_height = (int32_t)c->encode.height;
+	c->encode.base_width = c->encode.width;
+	c->encode.base_height = c->encode.height;
+	os_mutex_init(&c->encode.mutex);
+	os_mutex_init(&c->gaze.mutex);
+	os_mutex_init(&c->rate.mutex);
+
 	EMS_COMP_INFO(c, "Starting Electric Maple Server remote compositor!");
 
 
@@ -835,64 +2962,143 @@ ems_compositor_create_system(ems_instance &emsi, struct xrt_system_compositor **
 	if (!compositor_init_pacing(c) ||         //
 	    !compositor_init_vulkan(c) ||         //
 	    !compositor_init_sys_info(c, xdev) || //
-	    !compositor_init_info(c)) {           //
+	    !compositor_init_info(c) ||           //
+	    !pack_init(c) ||                      //
+	    !readback_init(c) ||                  //
+	    !gpu_timestamps_init(c)) {            //
 		EMS_COMP_DEBUG(c, "Failed to init compositor %p", (void *)c);
 		c->base.base.base.destroy(&c->base.base.base);
 
 		return XRT_ERROR_VULKAN;
 	}
 
-	VkExtent2D readback_extent = {};
-	readback_extent.height = READBACK_H;
-	readback_extent.width = READBACK_W;
+	c->readback.dmabuf = debug_get_bool_option_readback_dmabuf();
+	c->readback.host_import = debug_get_bool_option_readback_host_import();
+	c->static_frames.enabled = debug_get_bool_option_skip_static_frames();
+	c->bounce.enabled = debug_get_bool_option_pack_bounce();
+	c->depth.enabled = debug_get_bool_option_stream_depth();
+	c->depth.band_height = encode_get_depth_band_height(c, c->encode.height);
+	compositor_init_foveation(c, debug_get_float_option_foveation());
+	c->gaze.enabled = debug_get_bool_option_foveation_gaze();
+	c->gaze.min_confidence = debug_get_float_option_foveation_gaze_confidence();
+	c->rate.enabled = debug_get_bool_option_rate_control();
+	c->rate.applied_scale = 1.0f;
+	ems_rate_control_init(&c->rate.control,                                                         //
+	                      (uint32_t)std::max<int64_t>(debug_get_num_option_bitrate_kbps(), 1),      //
+	                      (uint32_t)std::max<int64_t>(debug_get_num_option_bitrate_min_kbps(), 1),  //
+	                      (uint32_t)std::max<int64_t>(debug_get_num_option_bitrate_max_kbps(), 1)); //
+
+	uint32_t picture_height = c->encode.height + c->depth.band_height;
+	if (!readback_pool_create(c, c->encode.width, picture_height, &c->pool)) {
+		EMS_COMP_ERROR(c, "Failed to create readback pool!");
+		c->base.base.base.destroy(&c->base.base.base);
+
+		return XRT_ERROR_VULKAN;
+	}
 
-	vk_image_readback_to_xf_pool_create( //
-	    &c->base.vk,                     // vk_bundle
-	    readback_extent,                 // extent
-	    &c->pool,                        // out_pool
-	    XRT_FORMAT_R8G8B8X8,             // xrt_format
-	    VK_FORMAT_R8G8B8A8_UNORM);       // vk_format
+	const char *memory = c->readback.host_import ? "imported host" : "Vulkan host visible";
+	EMS_COMP_INFO(c, "Readback memory: %s", c->readback.dmabuf ? "DMA-BUF" : memory);
+
+	// Only for comparing, a failure just leaves it off.
+	if (c->bounce.enabled && c->queue.compute_only) {
+		EMS_COMP_WARN(c, "EMS_PACK_BOUNCE needs a graphics queue, set EMS_COMPUTE_QUEUE=0, ignoring it.");
+		c->bounce.enabled = false;
+	} else if (c->bounce.enabled && !bounce_init(c, c->encode.width, c->encode.height)) {
+		c->bounce.enabled = false;
+	} else if (c->bounce.enabled) {
+		EMS_COMP_INFO(c, "Blitting through a bounce image before packing, for comparison only.");
+	}
 
 	u_var_add_root(c, "Electric Maple Server compositor", 0);
 	u_var_add_sink_debug(c, &c->debug_sink, "Debug Sink");
+	u_var_add_ro_u32(c, &c->readback.depth, "Readback depth");
+	u_var_add_ro_u32(c, &c->readback.count, "Readbacks in flight");
+	u_var_add_ro_u64(c, &c->readback.stalls, "Readback stalls");
+	u_var_add_ro_u64(c, &c->readback.overruns, "Readback overruns");
+	u_var_add_ro_u64(c, &c->commit_cpu.last_us, "Commit CPU time (us)");
+	u_var_add_ro_f32(c, &c->commit_cpu.avg_us, "Commit CPU time avg (us)");
+	u_var_add_ro_u64(c, &c->stages.pack.last_us, "Pack CPU time (us)");
+	u_var_add_ro_u64(c, &c->stages.wait.last_us, "Readback wait (us)");
+	u_var_add_ro_u64(c, &c->stages.push.last_us, "Push time (us)");
+	u_var_add_ro_u64(c, &c->stages.gpu_clear.last_us, "GPU clear time (us)");
+	u_var_add_ro_u64(c, &c->stages.gpu_pack.last_us, "GPU pack time (us)");
+	u_var_add_ro_u64(c, &c->stages.gpu_queue.last_us, "GPU queue time (us)");
+	u_var_add_ro_u64(c, &c->packet_latency.first_us, "First packet latency (us)");
+	u_var_add_ro_u64(c, &c->packet_latency.last_us, "Last packet latency (us)");
+	u_var_add_ro_f32(c, &c->packet_latency.first_avg_us, "First packet latency avg (us)");
+	u_var_add_ro_f32(c, &c->packet_latency.last_avg_us, "Last packet latency avg (us)");
+	u_var_add_bool(c, &c->readback.dmabuf, "Readback DMA-BUF");
+	u_var_add_ro_u32(c, &c->encode.width, "Encode width");
+	u_var_add_ro_u32(c, &c->encode.height, "Encode height");
+	u_var_add_i32(c, &c->encode.ui_width, "Requested encode width");
+	u_var_add_i32(c, &c->encode.ui_height, "Requested encode height");
+	c->encode.apply_btn.cb = encode_apply_btn_cb;
+	c->encode.apply_btn.ptr = c;
+	u_var_add_button(c, &c->encode.apply_btn, "Apply encode size");
+	u_var_add_ro_i64(c, &c->pacing.last_wait_us, "Client frame wait (us)");
+	u_var_add_ro_i64(c, &c->pacing.total_correction_us, "Pacing correction (us)");
+	u_var_add_ro_i64(c, &c->pacing.latency_us, "Display latency (us)");
+	u_var_add_ro_i64(c, &c->pacing.latency_deviation_us, "Display latency deviation (us)");
+	u_var_add_ro_u64(c, &c->pacing.outliers, "Pacing outliers");
+	u_var_add_ro_u32(c, &c->backlog.max_frames, "Max encode backlog");
+	u_var_add_ro_u32(c, &c->backlog.frames, "Encode backlog");
+	u_var_add_ro_u64(c, &c->backlog.skipped_encoder, "Skipped, encoder behind");
+	u_var_add_ro_u64(c, &c->backlog.skipped_readback, "Skipped, readbacks in flight");
+	u_var_add_bool(c, &c->static_frames.enabled, "Skip unchanged frames");
+	u_var_add_ro_u64(c, &c->static_frames.skipped, "Skipped, unchanged");
+	u_var_add_ro_u32(c, &c->depth.band_height, "Depth band height");
+	u_var_add_ro_u64(c, &c->depth.frames, "Frames with depth");
+	u_var_add_ro_f32(c, &c->foveation.gain, "Foveation center gain");
+	u_var_add_ro_f32(c, &c->foveation.strength, "Foveation strength");
+	u_var_add_bool(c, &c->gaze.enabled, "Foveate on gaze");
+	u_var_add_f32(c, &c->gaze.min_confidence, "Gaze min confidence");
+	u_var_add_ro_f32(c, &c->gaze.confidence, "Gaze confidence");
+	u_var_add_ro_u64(c, &c->gaze.frames, "Frames foveated on gaze");
+	u_var_add_ro_u64(c, &c->gaze.fallbacks, "Gaze fallbacks");
+	u_var_add_bool(c, &c->rate.enabled, "Rate control");
+	u_var_add_ro_u32(c, &c->rate.applied_kbps, "Encoder bitrate (kbps)");
+	u_var_add_ro_u32(c, &c->rate.control.rung, "Resolution rung");
+	u_var_add_ro_i64(c, &c->rate.control.queue_delay_us, "Queueing delay (us)");
+	u_var_add_ro_u64(c, &c->rate.control.decreases, "Bitrate decreases");
+	u_var_add_ro_u64(c, &c->rate.control.rung_downs, "Resolution steps down");
 
 #define EMS_APPSRC_NAME "EMS_source"
 
 	ems_gstreamer_pipeline_create(&c->xfctx, EMS_APPSRC_NAME, emsi.callbacks, &c->gstreamer_pipeline);
-	gstreamer_sink_create_with_pipeline( //
-	    c->gstreamer_pipeline,           //
-	    READBACK_W,                      //
-	    READBACK_H,                      //
-	    XRT_FORMAT_R8G8B8X8,             //
-	    EMS_APPSRC_NAME,                 //
-	    &c->gstreamer_sink,              //
-	    &c->frame_sink);                 //
+	c->rate.applied_kbps = c->rate.control.target_kbps;
+	ems_gstreamer_pipeline_set_bitrate(c->gstreamer_pipeline, c->rate.applied_kbps);
+	ems_gstreamer_pipeline_set_stats_callback(c->gstreamer_pipeline, compositor_handle_network_stats, c);
+	ems_gstreamer_pipeline_set_probe_callback(c->gstreamer_pipeline, compositor_handle_probe, c);
+	ems_callbacks_add(emsi.callbacks, EMS_CALLBACKS_EVENT_FRAME, compositor_handle_frame_report, c);
+	ems_callbacks_add(emsi.callbacks, EMS_CALLBACKS_EVENT_GAZE, compositor_handle_gaze, c);
+	ems_gstreamer_src_create_with_pipeline( //
+	    c->gstreamer_pipeline,              //
+	    c->encode.width,                    //
+	    picture_height,                     //
+	    EMS_APPSRC_NAME,                    //
+	    &c->gstreamer_src,                  //
+	    &c->frame_sink);                    //
 
 
-	// Bounce image for scaling.
-	{
-		VkFormat format = VK_FORMAT_R8G8B8A8_SRGB;
-		VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-		VkExtent2D extent = {READBACK_W, READBACK_H};
-		VkResult ret;
-
-		ret = vk_create_image_simple( //
-		    &c->base.vk,              // vk_bundle
-		    extent,                   // extent
-		    format,                   // format
-		    usage,                    // usage
-		    &c->bounce.device_memory, // out_mem
-		    &c->bounce.image);        // out_image
-		if (ret != VK_SUCCESS) {
-			EMS_COMP_DEBUG(c, "vk_create_image_simple: %s", vk_result_string(ret));
-		}
-	}
-
 	EMS_COMP_DEBUG(c, "Done %p", (void *)c);
 
+	*out_c = c;
+
+	return XRT_SUCCESS;
+}
+
+xrt_result_t
+ems_compositor_create_system(ems_instance &emsi, struct xrt_system_compositor **out_xsysc)
+{
+	struct ems_compositor *c = NULL;
+	xrt_result_t xret = ems_compositor_create(emsi, &c);
+	if (xret != XRT_SUCCESS) {
+		return xret;
+	}
+
 	// Standard app pacer.
 	struct u_pacing_app_factory *upaf = NULL;
-	XRT_MAYBE_UNUSED xrt_result_t xret = u_pa_factory_create(&upaf);
+	xret = u_pa_factory_create(&upaf);
 	assert(xret == XRT_SUCCESS && upaf != NULL);
 
 	return comp_multi_create_system_compositor(&c->base.base, upaf, &c->sys_info, false, out_xsysc);
@@ -21,19 +21,22 @@
 #include "xrt/xrt_instance.h"
 
 #include "os/os_time.h"
+#include "os/os_threading.h"
 
 #include "util/u_threading.h"
 #include "util/u_logging.h"
-#include "util/u_pacing.h"
 #include "util/u_var.h"
 #include "util/u_sink.h"
 
 #include "util/comp_base.h"
 
 #include "gstreamer/gst_pipeline.h"
-#include "gstreamer/gst_sink.h"
 #include "gst/ems_gstreamer_pipeline.h"
+#include "gst/ems_gstreamer_src.h"
 
+#include "ems_readback_pool.h"
+#include "ems_pacing.h"
+#include "ems_rate_control.h"
 
 #include "ems_server_internal.h"
 
@@ -81,6 +84,134 @@ struct ems_comp_frame
 	uint64_t present_slop_ns;
 };
 
+/*!
+ * Maximum number of readbacks that can be in flight on the GPU at once.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_READBACK_MAX_DEPTH (4)
+
+/*!
+ * Maximum number of layers flattened into a frame, further layers are dropped.
+ * Must match MAX_LAYERS in shaders/pack_nv12.comp.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_MAX_LAYERS (8)
+
+/*!
+ * Maximum number of swapchain images a frame samples, both views of every
+ * layer and the two depth views.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_MAX_FRAME_IMAGES (EMS_MAX_LAYERS * 2 + 2)
+
+/*!
+ * Number of tile hashes the pack pass writes per frame, tiles beyond this
+ * share a hash. Must match HASH_BUCKETS in shaders/pack_nv12.comp.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_PACK_HASH_BUCKETS (4096)
+
+/*!
+ * The depth band below the views is cut into this many strips laid side by
+ * side, must match DEPTH_STRIPS in shaders/pack_nv12.comp.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_DEPTH_STRIPS (4)
+
+/*!
+ * GPU timestamps written per readback slot, around each stage of its
+ * command buffer.
+ *
+ * @ingroup comp_ems
+ */
+enum ems_gpu_timestamp
+{
+	//! Before anything else in the command buffer.
+	EMS_GPU_TIMESTAMP_BEGIN = 0,
+
+	//! The hashes are cleared.
+	EMS_GPU_TIMESTAMP_CLEARED = 1,
+
+	//! The pack dispatch is done.
+	EMS_GPU_TIMESTAMP_PACKED = 2,
+
+	EMS_GPU_TIMESTAMP_COUNT = 3,
+};
+
+/*!
+ * Running totals of the time spent in one stage of getting a frame out, for
+ * the debug UI and the benchmark.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_stage_stats
+{
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+
+	//! The most recent sample.
+	uint64_t last_us;
+};
+
+/*!
+ * A single in-flight readback, the GPU work for one frame and the frame it
+ * will produce once the fence has signalled.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_readback_slot
+{
+	//! Signalled when the GPU is done writing to @ref rf.
+	VkFence fence;
+
+	//! Imported app sync handle the submit waits on, destroyed once the fence has signalled.
+	VkSemaphore wait_semaphore;
+
+	/*!
+	 * Command buffer for this readback, allocated once and re-recorded every
+	 * time the slot is used. Allocated for each frame and freed once it is
+	 * retired if comparing against that.
+	 */
+	VkCommandBuffer cmd;
+
+	//! When the command buffer was submitted, to tell how long it queued on the GPU.
+	uint64_t submit_ns;
+
+	//! How the views were warped, goes to the encoder with the frame.
+	struct ems_foveation foveation;
+
+	//! Descriptor set for the pack dispatch, only updated when not in flight.
+	VkDescriptorSet descriptor_set;
+
+	//! Persistently mapped layer data for the pack dispatch, only written when not in flight.
+	VkBuffer ubo_buffer;
+	VkDeviceMemory ubo_memory;
+	void *ubo_ptr;
+
+	//! Persistently mapped tile hashes of the packed picture, written by the GPU.
+	VkBuffer hash_buffer;
+	VkDeviceMemory hash_memory;
+	uint32_t *hash_ptr;
+
+	//! The frame being read back into, we hold a reference while in flight.
+	struct ems_readback_frame *rf;
+
+	/*!
+	 * Swapchain images the pack dispatch samples, referenced and marked in
+	 * use until the fence has signalled, so the app can't wait on and render
+	 * into them while they are still being read.
+	 */
+	struct xrt_swapchain *image_swapchains[EMS_MAX_FRAME_IMAGES];
+	uint32_t image_indices[EMS_MAX_FRAME_IMAGES];
+	uint32_t image_count;
+};
+
 /*!
  * Main compositor struct tying everything in the compositor together.
  *
@@ -97,8 +228,8 @@ struct ems_compositor
 	//! The device we are displaying to.
 	struct xrt_device *xdev;
 
-	//! Pacing helper to drive us forward.
-	struct u_pacing_compositor *upc;
+	//! Pacing helper to drive us forward, locked to the client's frame loop.
+	struct ems_pacing pacing;
 
 	struct
 	{
@@ -106,6 +237,10 @@ struct ems_compositor
 
 		//! Frame interval that we are using.
 		uint64_t frame_interval_ns;
+
+		//! Recommended size of each view, fixed for the lifetime of the compositor.
+		uint32_t view_width;
+		uint32_t view_height;
 	} settings;
 
 	// Kept here for convenience.
@@ -123,23 +258,294 @@ struct ems_compositor
 	} frame;
 
 
+	//! The queue all our GPU work goes to.
+	struct
+	{
+		uint32_t family_index;
+
+		//! The family has no graphics, likely a separate hardware queue to the app's.
+		bool compute_only;
+	} queue;
+
 	struct xrt_frame_context xfctx = {};
 
 	struct vk_cmd_pool cmd_pool = {};
 
-	struct vk_image_readback_to_xf_pool *pool = nullptr;
-	int image_sequence;
+	struct ems_readback_pool *pool = nullptr;
+
+	//! Id of the last frame sent, see @ref ems_gstreamer_src.
+	int64_t frame_sequence;
 	struct u_sink_debug debug_sink;
 
+	//! CPU time spent in layer commit, shown in the debug UI.
 	struct
 	{
+		//! The last commit, in microseconds.
+		uint64_t last_us;
+
+		//! Exponential moving average, in microseconds.
+		float avg_us;
+	} commit_cpu;
+
+	/*!
+	 * Time spent after layer commit: recording and submitting the pack pass,
+	 * then on the readback thread waiting on its fence and pushing the frame.
+	 */
+	struct
+	{
+		struct ems_stage_stats pack;
+		struct ems_stage_stats wait;
+		struct ems_stage_stats push;
+
+		//! On the GPU, from @ref gpu_timestamps.
+		struct ems_stage_stats gpu_clear;
+		struct ems_stage_stats gpu_pack;
+
+		//! From submit until the GPU starts, includes waiting on the app's rendering.
+		struct ems_stage_stats gpu_queue;
+	} stages;
+
+	//! From pushing a frame to its first and last RTP packet, copied from the source for the debug UI.
+	struct ems_gstreamer_packet_latency packet_latency;
+
+	/*!
+	 * Timestamp queries, @ref EMS_GPU_TIMESTAMP_COUNT for each readback
+	 * slot. Read by the readback thread once the slot's fence has signalled.
+	 */
+	struct
+	{
+		//! Null if the queue can't write timestamps.
+		VkQueryPool pool;
+
+		//! GPU timestamps can be converted to @ref os_monotonic_get_ns time.
+		bool calibrated;
+	} gpu_timestamps;
+
+	/*!
+	 * Compute pass that flattens all layers into side-by-side views and
+	 * converts them to NV12, sampling the swapchain images and writing
+	 * straight into the readback buffers.
+	 */
+	struct
+	{
+		VkSampler sampler;
+
+		//! Depth formats often can't be filtered, only used for gathers.
+		VkSampler depth_sampler;
+
+		VkDescriptorPool descriptor_pool;
+		VkDescriptorSetLayout descriptor_set_layout;
+		VkPipelineLayout pipeline_layout;
+		VkShaderModule shader;
+		VkPipeline pipeline;
+	} pack;
+
+	/*!
+	 * Side-by-side blit of the first layer into an intermediate image in
+	 * front of the pack dispatch, the extra full-frame write the pack pass
+	 * had before it sampled the swapchains itself. Nothing reads the image
+	 * and it keeps the starting encode size, it is only there to compare GPU
+	 * times against.
+	 */
+	struct
+	{
+		bool enabled;
 		VkDeviceMemory device_memory;
 		VkImage image;
+		VkExtent2D extent;
 	} bounce;
 
+	/*!
+	 * Ring of in-flight readbacks, a worker thread waits on the fences and
+	 * pushes the frames to the encoder in submission order, so layer commit
+	 * never waits on the GPU unless the ring is full.
+	 */
+	struct
+	{
+		struct ems_readback_slot slots[EMS_READBACK_MAX_DEPTH];
+
+		//! Retires slots, its mutex protects @ref head and @ref count.
+		struct os_thread_helper oth;
+
+		//! Index of the oldest in-flight slot.
+		uint32_t head;
+
+		//! Number of slots currently in flight.
+		uint32_t count;
+
+		//! How many slots we allow in flight, at most @ref EMS_READBACK_MAX_DEPTH.
+		uint32_t depth;
+
+		//! Times we had to wait on the GPU because all slots were in flight.
+		uint64_t stalls;
+
+		//! Frames dropped because the readback image pool was exhausted.
+		uint64_t overruns;
+
+		//! Readback buffers are exported and handed to the pipeline as DMA-BUFs.
+		bool dmabuf;
+
+		//! Readback buffers are host allocations imported into Vulkan.
+		bool host_import;
+
+		//! Allocate and free the slots' command buffers every frame instead of re-recording them, to compare.
+		bool cmd_per_frame;
+	} readback;
+
+	/*!
+	 * Size of the encoded side-by-side picture, can be changed at runtime,
+	 * the change is applied at the start of the next frame.
+	 */
+	struct
+	{
+		//! Current size, only touched from the commit path.
+		uint32_t width;
+		uint32_t height;
+
+		//! Protects the pending request and the base size.
+		struct os_mutex mutex;
+		bool pending;
+		uint32_t pending_width;
+		uint32_t pending_height;
+
+		//! Size asked for by the options or the debug UI, rate control scales it down.
+		uint32_t base_width;
+		uint32_t base_height;
+
+		//! Edited in the debug UI, applied with @ref apply_btn.
+		int32_t ui_width;
+		int32_t ui_height;
+		struct u_var_button apply_btn;
+	} encode;
+
+	/*!
+	 * The encoder bitrate follows what the network to the client takes, and
+	 * the encode size is stepped down when the bitrate is too low for it.
+	 * Started from the probe of a new client, then driven by the transport
+	 * stats, see @ref ems_rate_control.
+	 */
+	struct
+	{
+		//! Follow the network at all, otherwise the bitrate stays at its start value.
+		bool enabled;
+
+		//! Protects the rest, stats and probe results arrive on different threads.
+		struct os_mutex mutex;
+
+		struct ems_rate_control control;
+
+		//! Last bitrate given to the encoder, and the scale of the encode size.
+		uint32_t applied_kbps;
+		float applied_scale;
+	} rate;
+
+	/*!
+	 * Depth of the first projection layer, if the app submits it, goes to the
+	 * client in a band below the views of the same picture, so it can do
+	 * positional reprojection. The depth is at a quarter of the resolution of
+	 * the views, stored as inverse distance in the luma samples.
+	 */
+	struct
+	{
+		//! Fixed for the lifetime of the compositor, the client has to expect the band.
+		bool enabled;
+
+		//! Rows of the band below the views, zero when disabled.
+		uint32_t band_height;
+
+		//! Frames that carried depth.
+		uint64_t frames;
+	} depth;
+
+	/*!
+	 * The views can be warped to keep full density around the lens centers
+	 * and compress the periphery, so a smaller picture looks as sharp where
+	 * it matters. The client undoes the warp, see @ref ems_foveation.
+	 */
+	struct
+	{
+		//! How many times the pixels of an unwarped picture the centers get per axis, 1 is off.
+		float gain;
+
+		//! Warp strength giving that gain.
+		float strength;
+	} foveation;
+
+	/*!
+	 * Where the user looks, from clients with eye tracking. The foveated
+	 * centers follow it, extrapolated to when the frame is displayed, and go
+	 * back to the lens centers when the eyes are not tracked well enough.
+	 */
+	struct
+	{
+		//! Follow the gaze at all, can be toggled at runtime.
+		bool enabled;
+
+		//! Below this confidence the lens centers are used.
+		float min_confidence;
+
+		//! Protects everything below, gaze arrives on the data channel thread.
+		struct os_mutex mutex;
+
+		//! Last gaze as tangents in view space, x right and y up, and their smoothed change per second.
+		float tangents[2];
+		float velocity[2];
+		float confidence;
+
+		//! Client clock: when the eyes were sampled. Server clock: when that sample arrived.
+		int64_t sample_ns;
+		uint64_t received_ns;
+
+		//! Debug UI: frames foveated on the gaze, and on the lens centers while gaze was coming in.
+		uint64_t frames;
+		uint64_t fallbacks;
+	} gaze;
+
+	/*!
+	 * Frames are skipped before packing and readback when the encoder falls
+	 * behind, by the time it got to them they would be stale.
+	 */
+	struct
+	{
+		//! Frames allowed between us and the encoder output before we skip.
+		uint32_t max_frames;
+
+		//! Last measured, readbacks in flight plus frames queued for or in the encoder.
+		uint32_t frames;
+
+		//! Skipped with the encoder queue and encoder full on their own.
+		uint64_t skipped_encoder;
+
+		//! Skipped with readbacks in flight adding the last straw.
+		uint64_t skipped_readback;
+	} backlog;
+
+	/*!
+	 * Frames identical to the last one pushed are not encoded, menus and
+	 * loading screens often submit the same images every frame. Only touched
+	 * on the readback thread, besides the debug UI.
+	 */
+	struct
+	{
+		//! Toggled in the debug UI.
+		bool enabled;
+
+		//! Tile hashes of the last frame pushed.
+		uint32_t last_hashes[EMS_PACK_HASH_BUCKETS];
+
+		//! When the last frame was pushed.
+		uint64_t last_push_ns;
+
+		//! Frames not pushed because they were unchanged.
+		uint64_t skipped;
+	} static_frames;
+
+	//! A bit per layer type that can't be flattened, each is only warned about once.
+	uint32_t warned_layer_types;
+
 	bool pipeline_playing = false;
 	struct gstreamer_pipeline *gstreamer_pipeline;
-	struct gstreamer_sink *gstreamer_sink;
+	struct ems_gstreamer_src *gstreamer_src;
 	struct xrt_frame_sink *frame_sink;
 
 	uint64_t offset_ns;
@@ -165,6 +571,17 @@ ems_compositor(struct xrt_compositor *xc)
 	return (struct ems_compositor *)xc;
 }
 
+/*!
+ * Request a new size for the encoded side-by-side picture, thread safe. The
+ * readback buffers and stream caps are re-created before the
+ * next frame is packed, the size is rounded down to what the encoder needs.
+ *
+ * @public @memberof ems_compositor
+ * @ingroup comp_ems
+ */
+void
+ems_compositor_request_encode_size(struct ems_compositor *c, uint32_t width, uint32_t height);
+
 /*!
  * Spew level logging.
  *
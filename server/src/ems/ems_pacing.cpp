@@ -0,0 +1,236 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Frame pacing phase-locked to the client's frame loop.
+ * @ingroup comp_ems
+ */
+
+#include "ems_pacing.h"
+
+#include "util/u_misc.h"
+#include "util/u_time.h"
+
+#include <algorithm>
+
+
+/*!
+ * Share of the measured error corrected per report. Reports for frames that
+ * were in flight before a correction still show the old error, so this is
+ * kept low to not overshoot.
+ */
+#define CORRECTION_GAIN (0.125)
+
+//! The grid moves at most this share of a frame interval per frame.
+#define MAX_STEP_DIVISOR (8)
+
+/*!
+ * The latency estimate follows the classic smoothed round trip time filter,
+ * these are the shifts for the gain of the mean and of the mean deviation.
+ */
+#define LATENCY_GAIN_SHIFT (3)
+#define DEVIATION_GAIN_SHIFT (2)
+
+//! Samples taken before outlier rejection kicks in, the deviation needs to settle first.
+#define LATENCY_WARM_UP_SAMPLES (8)
+
+//! Samples further than this many deviations, plus a floor, from the mean are rejected.
+#define LATENCY_OUTLIER_DEVIATIONS (4)
+#define LATENCY_OUTLIER_FLOOR_NS (2 * U_TIME_1MS_IN_NS)
+
+//! Latencies beyond this are not plausible, a stalled client or a bogus report.
+#define LATENCY_MAX_NS (U_TIME_1S_IN_NS)
+
+
+/*
+ *
+ * Helper functions.
+ *
+ */
+
+static void
+latency_add_sample(struct ems_pacing *p, int64_t sample_ns)
+{
+	if (sample_ns < 0 || sample_ns > (int64_t)LATENCY_MAX_NS) {
+		p->outliers++;
+		return;
+	}
+
+	if (p->latency.samples == 0) {
+		p->latency.smoothed_ns = sample_ns;
+		p->latency.deviation_ns = sample_ns / 2;
+	} else {
+		int64_t diff_ns = sample_ns - p->latency.smoothed_ns;
+		int64_t abs_diff_ns = diff_ns < 0 ? -diff_ns : diff_ns;
+
+		// A single late report, say a retransmit, should not drag the app's display time.
+		int64_t limit_ns =
+		    LATENCY_OUTLIER_DEVIATIONS * p->latency.deviation_ns + (int64_t)LATENCY_OUTLIER_FLOOR_NS;
+		if (p->latency.samples >= LATENCY_WARM_UP_SAMPLES && abs_diff_ns > limit_ns) {
+			p->outliers++;
+			return;
+		}
+
+		p->latency.smoothed_ns += diff_ns / (1 << LATENCY_GAIN_SHIFT);
+		p->latency.deviation_ns += (abs_diff_ns - p->latency.deviation_ns) / (1 << DEVIATION_GAIN_SHIFT);
+	}
+
+	p->latency.samples++;
+
+	p->latency_us = p->latency.smoothed_ns / 1000;
+	p->latency_deviation_us = p->latency.deviation_ns / 1000;
+}
+
+static void
+pace_from_wait(struct ems_pacing *p, int64_t decode_complete_ns, int64_t begin_frame_ns)
+{
+	int64_t interval_ns = (int64_t)p->frame_interval_ns;
+	int64_t wait_ns = begin_frame_ns - decode_complete_ns;
+
+	// Missing times or a client that stalled, nothing to learn from those.
+	if (decode_complete_ns <= 0 || begin_frame_ns <= 0 || wait_ns < 0 || wait_ns > 2 * interval_ns) {
+		p->outliers++;
+		return;
+	}
+
+	p->last_wait_us = wait_ns / 1000;
+
+	/*
+	 * Arriving later by the error brings the wait down to the margin. A
+	 * wait of almost a frame is as good as a small one for the next
+	 * iteration of the client's loop, so take the shorter way round.
+	 */
+	int64_t error_ns = (wait_ns - (int64_t)p->margin_ns) % interval_ns;
+	if (error_ns > interval_ns / 2) {
+		error_ns -= interval_ns;
+	} else if (error_ns <= -interval_ns / 2) {
+		error_ns += interval_ns;
+	}
+
+	p->pending_correction_ns += (int64_t)((double)error_ns * CORRECTION_GAIN);
+	p->pending_correction_ns = std::clamp(p->pending_correction_ns, -interval_ns, interval_ns);
+}
+
+static void
+measure_latency(struct ems_pacing *p, const struct ems_pacing_frame_report *report)
+{
+	uint32_t index = (uint32_t)(report->sequence_id % EMS_PACING_HISTORY);
+	if (report->sequence_id <= 0 || p->sent.sequence_ids[index] != report->sequence_id) {
+		// Too old, or never sent through us.
+		return;
+	}
+
+	if (report->begin_frame_ns <= 0 || report->display_ns < report->begin_frame_ns) {
+		p->outliers++;
+		return;
+	}
+
+	// When the client displays the frame, translated to our clock.
+	int64_t display_ns = (int64_t)report->received_ns + (report->display_ns - report->begin_frame_ns);
+
+	latency_add_sample(p, display_ns - (int64_t)p->sent.present_ns[index]);
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+void
+ems_pacing_init(struct ems_pacing *p, uint64_t frame_interval_ns, uint64_t margin_ns, uint64_t now_ns)
+{
+	os_mutex_init(&p->mutex);
+
+	p->frame_interval_ns = frame_interval_ns;
+	p->margin_ns = margin_ns;
+	p->frame_id = 0;
+	p->last_present_ns = now_ns;
+	p->pending_correction_ns = 0;
+	p->last_wait_us = 0;
+	p->total_correction_us = 0;
+	p->latency_us = 0;
+	p->latency_deviation_us = 0;
+	p->outliers = 0;
+
+	U_ZERO(&p->predicted);
+	U_ZERO(&p->sent);
+	U_ZERO(&p->latency);
+}
+
+void
+ems_pacing_predict(struct ems_pacing *p,
+                   uint64_t now_ns,
+                   int64_t *out_frame_id,
+                   uint64_t *out_wake_up_time_ns,
+                   uint64_t *out_predicted_display_time_ns,
+                   uint64_t *out_predicted_display_period_ns)
+{
+	os_mutex_lock(&p->mutex);
+
+	int64_t interval_ns = (int64_t)p->frame_interval_ns;
+	int64_t max_step_ns = interval_ns / MAX_STEP_DIVISOR;
+
+	// Move the grid a bit at a time, the app shouldn't see big jumps.
+	int64_t step_ns = std::clamp(p->pending_correction_ns, -max_step_ns, max_step_ns);
+	p->pending_correction_ns -= step_ns;
+	p->total_correction_us += step_ns / 1000;
+
+	uint64_t present_ns = p->last_present_ns + (uint64_t)(interval_ns + step_ns);
+
+	// The app needs a frame interval to render, skip grid points it can't make.
+	while (present_ns < now_ns + p->frame_interval_ns) {
+		present_ns += p->frame_interval_ns;
+	}
+
+	p->last_present_ns = present_ns;
+
+	int64_t frame_id = ++p->frame_id;
+	uint32_t index = (uint32_t)(frame_id % EMS_PACING_HISTORY);
+	p->predicted.frame_ids[index] = frame_id;
+	p->predicted.present_ns[index] = present_ns;
+
+	*out_frame_id = frame_id;
+	*out_wake_up_time_ns = present_ns - p->frame_interval_ns;
+	*out_predicted_display_time_ns = present_ns + (uint64_t)p->latency.smoothed_ns;
+	*out_predicted_display_period_ns = p->frame_interval_ns;
+
+	os_mutex_unlock(&p->mutex);
+}
+
+void
+ems_pacing_mark_sent(struct ems_pacing *p, int64_t sequence_id, int64_t frame_id)
+{
+	os_mutex_lock(&p->mutex);
+
+	uint32_t frame_index = (uint32_t)(frame_id % EMS_PACING_HISTORY);
+	uint32_t index = (uint32_t)(sequence_id % EMS_PACING_HISTORY);
+
+	// Frames not predicted by us, or long ago, can't be measured.
+	if (frame_id > 0 && sequence_id > 0 && p->predicted.frame_ids[frame_index] == frame_id) {
+		p->sent.sequence_ids[index] = sequence_id;
+		p->sent.present_ns[index] = p->predicted.present_ns[frame_index];
+	}
+
+	os_mutex_unlock(&p->mutex);
+}
+
+void
+ems_pacing_feedback(struct ems_pacing *p, const struct ems_pacing_frame_report *report)
+{
+	os_mutex_lock(&p->mutex);
+
+	pace_from_wait(p, report->decode_complete_ns, report->begin_frame_ns);
+	measure_latency(p, report);
+
+	os_mutex_unlock(&p->mutex);
+}
+
+void
+ems_pacing_fini(struct ems_pacing *p)
+{
+	os_mutex_destroy(&p->mutex);
+}
@@ -0,0 +1,167 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Frame pacing phase-locked to the client's frame loop.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include "xrt/xrt_compiler.h"
+#include "os/os_threading.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * Number of predicted and sent frames remembered until the client reports
+ * on them.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_PACING_HISTORY (32)
+
+/*!
+ * What the client tells us about a frame it displayed.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_pacing_frame_report
+{
+	//! The id the frame was sent with, see @ref ems_pacing_mark_sent.
+	int64_t sequence_id;
+
+	//! Client clock: decode done, frame loop picked it up, and predicted display.
+	int64_t decode_complete_ns;
+	int64_t begin_frame_ns;
+	int64_t display_ns;
+
+	//! Server clock: when the report arrived.
+	uint64_t received_ns;
+};
+
+/*!
+ * Paces the compositor on a grid of frame intervals like a display would,
+ * but instead of following a vblank the grid is nudged by the client's frame
+ * feedback. Decoded frames wait on the client until its next frame loop
+ * iteration picks them up, the grid is moved so that wait is just a small
+ * margin, which removes up to a full frame interval of queueing latency.
+ *
+ * It also measures the latency from a grid point to the frame reaching the
+ * headset's display, so the app can be given a display time that is the
+ * moment the photons actually appear. The report about a frame arrives when
+ * the client has begun displaying it, adding how much later the client
+ * expects to display it gives that moment in our clock. This includes the
+ * uplink of the report, so the estimate errs on the late side by a few
+ * milliseconds at most.
+ *
+ * Only durations measured on the client go into the loop, so the client and
+ * server clocks do not need to be related.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_pacing
+{
+	//! Protects everything below, feedback arrives on the data channel thread.
+	struct os_mutex mutex;
+
+	uint64_t frame_interval_ns;
+
+	//! How long decoded frames should wait for the client, to absorb jitter.
+	uint64_t margin_ns;
+
+	//! Id of the last predicted frame.
+	int64_t frame_id;
+
+	//! When the last predicted frame is to be done, the current grid point.
+	uint64_t last_present_ns;
+
+	//! Correction not yet applied to the grid, positive moves it later.
+	int64_t pending_correction_ns;
+
+	//! Grid point of each predicted frame, indexed by frame id.
+	struct
+	{
+		int64_t frame_ids[EMS_PACING_HISTORY];
+		uint64_t present_ns[EMS_PACING_HISTORY];
+	} predicted;
+
+	//! Grid point of each sent frame, indexed by sequence id.
+	struct
+	{
+		int64_t sequence_ids[EMS_PACING_HISTORY];
+		uint64_t present_ns[EMS_PACING_HISTORY];
+	} sent;
+
+	//! Grid point to display latency, smoothed and its mean deviation.
+	struct
+	{
+		uint32_t samples;
+		int64_t smoothed_ns;
+		int64_t deviation_ns;
+	} latency;
+
+	//! Debug UI: the last wait on the client and the total correction applied.
+	int64_t last_wait_us;
+	int64_t total_correction_us;
+
+	//! Debug UI: the latency added to predicted display times.
+	int64_t latency_us;
+	int64_t latency_deviation_us;
+
+	//! Debug UI: feedback thrown away as not plausible.
+	uint64_t outliers;
+};
+
+/*!
+ * @public @memberof ems_pacing
+ */
+void
+ems_pacing_init(struct ems_pacing *p, uint64_t frame_interval_ns, uint64_t margin_ns, uint64_t now_ns);
+
+/*!
+ * Predict the next frame, the app is woken one frame interval before the
+ * frame is to be done. The predicted display time adds the measured latency
+ * to the client's display.
+ *
+ * @public @memberof ems_pacing
+ */
+void
+ems_pacing_predict(struct ems_pacing *p,
+                   uint64_t now_ns,
+                   int64_t *out_frame_id,
+                   uint64_t *out_wake_up_time_ns,
+                   uint64_t *out_predicted_display_time_ns,
+                   uint64_t *out_predicted_display_period_ns);
+
+/*!
+ * The app's frame @p frame_id goes to the client as @p sequence_id.
+ *
+ * @public @memberof ems_pacing
+ */
+void
+ems_pacing_mark_sent(struct ems_pacing *p, int64_t sequence_id, int64_t frame_id);
+
+/*!
+ * Feed back a frame report from the client.
+ *
+ * @public @memberof ems_pacing
+ */
+void
+ems_pacing_feedback(struct ems_pacing *p, const struct ems_pacing_frame_report *report);
+
+/*!
+ * @public @memberof ems_pacing
+ */
+void
+ems_pacing_fini(struct ems_pacing *p);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,230 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Bitrate and resolution control from the transport's feedback.
+ * @ingroup comp_ems
+ */
+
+#include "ems_rate_control.h"
+
+#include "util/u_misc.h"
+#include "util/u_time.h"
+
+#include <algorithm>
+#include <math.h>
+
+
+//! Queueing delay above which the path is overused, Wi-Fi jitters by a good part of this.
+#define OVERUSE_DELAY_MS (30.0)
+
+//! Queueing delay below which the queues are about empty again.
+#define UNDERUSE_DELAY_MS (10.0)
+
+//! Growth per second while the path keeps up, as in Google congestion control.
+#define INCREASE_PER_S (1.08)
+
+//! On overuse the bitrate drops to this share of what got through.
+#define DECREASE_FACTOR (0.85)
+
+//! The bitrate does not grow beyond what is sent by more than this share and headroom.
+#define SENT_CAP_FACTOR (1.5)
+#define SENT_CAP_HEADROOM_KBPS (1000.0)
+
+//! Loss above this brings the bitrate down by half the loss, below the low mark it may grow.
+#define LOSS_HIGH (0.1)
+#define LOSS_LOW (0.02)
+
+//! Decreases are at least this far apart, the last one has to show in the feedback first.
+#define MIN_DECREASE_INTERVAL_NS (500 * (uint64_t)U_TIME_1MS_IN_NS)
+
+//! How fast the lowest round trip time follows it up, to forget route changes.
+#define MIN_RTT_RISE_MS_PER_S (1.0)
+
+//! Gain of the smoothing of the sent rate and round trip time.
+#define SMOOTHING_GAIN (0.25)
+
+/*!
+ * Bits per pixel the encoder gets at a rung: below the low mark the picture
+ * is blocky and better smaller, above the high mark the rung above it looks
+ * fine. The marks are further apart than a rung changes the pixel count, so
+ * a step does not cause the opposite step.
+ */
+#define BPP_LOW (0.03)
+#define BPP_HIGH (0.08)
+
+//! How long the bits per pixel have to stay past a mark to change the rung.
+#define RUNG_DOWN_HOLD_NS ((uint64_t)U_TIME_1S_IN_NS)
+#define RUNG_UP_HOLD_NS (3 * (uint64_t)U_TIME_1S_IN_NS)
+
+//! Share of the probed bandwidth to start at, the probe sees the narrowest link but not what else uses it.
+#define PROBE_SHARE (0.7)
+
+//! Scale of the picture along each axis at each rung.
+static const float rung_scales[EMS_RATE_CONTROL_RUNGS] = {1.0f, 0.75f, 0.5f};
+
+
+/*
+ *
+ * Helper functions.
+ *
+ */
+
+static double
+bits_per_pixel(double kbps, uint64_t full_pixel_rate, uint32_t rung)
+{
+	double scale = rung_scales[rung];
+	double pixel_rate = (double)full_pixel_rate * scale * scale;
+
+	return pixel_rate > 0.0 ? kbps * 1000.0 / pixel_rate : 0.0;
+}
+
+static void
+measure(struct ems_rate_control *rc, const struct ems_rate_control_stats *stats, double dt_s)
+{
+	double sent_kbps = (double)(stats->bytes_sent - rc->last_bytes_sent) * 8.0 / 1000.0 / dt_s;
+	rc->sent_kbps += (sent_kbps - rc->sent_kbps) * SMOOTHING_GAIN;
+
+	if (stats->rtt_ns == 0) {
+		return;
+	}
+
+	double rtt_ms = (double)stats->rtt_ns / (double)U_TIME_1MS_IN_NS;
+	if (rc->min_rtt_ms <= 0.0) {
+		rc->rtt_ms = rtt_ms;
+		rc->min_rtt_ms = rtt_ms;
+	}
+
+	double previous_rtt_ms = rc->rtt_ms;
+	rc->rtt_ms += (rtt_ms - rc->rtt_ms) * SMOOTHING_GAIN;
+	rc->min_rtt_ms = std::min(rc->min_rtt_ms + MIN_RTT_RISE_MS_PER_S * dt_s, rtt_ms);
+
+	double queue_delay_ms = rc->rtt_ms - rc->min_rtt_ms;
+	rc->queue_delay_us = (int64_t)(queue_delay_ms * 1000.0);
+
+	// Only a delay that is still growing is overuse, a draining queue is on its way down.
+	if (queue_delay_ms > OVERUSE_DELAY_MS && rc->rtt_ms >= previous_rtt_ms) {
+		rc->usage = EMS_RATE_CONTROL_USAGE_OVER;
+	} else if (queue_delay_ms < UNDERUSE_DELAY_MS) {
+		rc->usage = EMS_RATE_CONTROL_USAGE_NORMAL;
+	} else if (rc->usage == EMS_RATE_CONTROL_USAGE_OVER) {
+		rc->usage = EMS_RATE_CONTROL_USAGE_UNDER;
+	}
+}
+
+static void
+adjust_bitrate(struct ems_rate_control *rc, const struct ems_rate_control_stats *stats, double dt_s)
+{
+	double target = rc->target_kbps;
+	bool may_decrease = stats->timestamp_ns - rc->last_decrease_ns >= MIN_DECREASE_INTERVAL_NS;
+
+	if (rc->usage == EMS_RATE_CONTROL_USAGE_OVER && may_decrease) {
+		target = std::min(target, DECREASE_FACTOR * rc->sent_kbps);
+		rc->last_decrease_ns = stats->timestamp_ns;
+		rc->decreases++;
+	} else if (stats->fraction_lost > LOSS_HIGH && may_decrease) {
+		target *= 1.0 - 0.5 * stats->fraction_lost;
+		rc->last_decrease_ns = stats->timestamp_ns;
+		rc->decreases++;
+	} else if (rc->usage == EMS_RATE_CONTROL_USAGE_NORMAL && stats->fraction_lost < LOSS_LOW) {
+		// Static frames are skipped, do not grow far beyond what such content needs.
+		double cap = SENT_CAP_FACTOR * rc->sent_kbps + SENT_CAP_HEADROOM_KBPS;
+		target = std::max(target, std::min(target * pow(INCREASE_PER_S, dt_s), cap));
+	}
+
+	rc->target_kbps = (uint32_t)std::clamp(target, (double)rc->min_kbps, (double)rc->max_kbps);
+}
+
+static void
+adjust_rung(struct ems_rate_control *rc, uint64_t now_ns, uint64_t full_pixel_rate)
+{
+	double bpp = bits_per_pixel(rc->target_kbps, full_pixel_rate, rc->rung);
+	bool low = rc->rung + 1 < EMS_RATE_CONTROL_RUNGS && bpp < BPP_LOW;
+	bool high = rc->rung > 0 && bits_per_pixel(rc->target_kbps, full_pixel_rate, rc->rung - 1) > BPP_HIGH;
+
+	rc->low_since_ns = low ? (rc->low_since_ns != 0 ? rc->low_since_ns : now_ns) : 0;
+	rc->high_since_ns = high ? (rc->high_since_ns != 0 ? rc->high_since_ns : now_ns) : 0;
+
+	if (low && now_ns - rc->low_since_ns >= RUNG_DOWN_HOLD_NS) {
+		rc->rung++;
+		rc->rung_downs++;
+		rc->low_since_ns = 0;
+	} else if (high && now_ns - rc->high_since_ns >= RUNG_UP_HOLD_NS) {
+		rc->rung--;
+		rc->high_since_ns = 0;
+	}
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+void
+ems_rate_control_init(struct ems_rate_control *rc, uint32_t start_kbps, uint32_t min_kbps, uint32_t max_kbps)
+{
+	U_ZERO(rc);
+
+	rc->min_kbps = min_kbps;
+	rc->max_kbps = std::max(max_kbps, min_kbps);
+	rc->target_kbps = std::clamp(start_kbps, rc->min_kbps, rc->max_kbps);
+	rc->sent_kbps = rc->target_kbps;
+}
+
+void
+ems_rate_control_update(struct ems_rate_control *rc,
+                        const struct ems_rate_control_stats *stats,
+                        uint64_t full_pixel_rate)
+{
+	// A new stream starts counting from zero again.
+	bool restarted = rc->has_last && stats->bytes_sent < rc->last_bytes_sent;
+
+	if (rc->has_last && !restarted && stats->timestamp_ns > rc->last_ns) {
+		double dt_s = time_ns_to_s(stats->timestamp_ns - rc->last_ns);
+
+		measure(rc, stats, dt_s);
+		adjust_bitrate(rc, stats, dt_s);
+		adjust_rung(rc, stats->timestamp_ns, full_pixel_rate);
+	}
+
+	rc->has_last = true;
+	rc->last_ns = stats->timestamp_ns;
+	rc->last_bytes_sent = stats->bytes_sent;
+}
+
+void
+ems_rate_control_start_from_probe(struct ems_rate_control *rc,
+                                  uint32_t bandwidth_kbps,
+                                  uint64_t rtt_ns,
+                                  uint64_t full_pixel_rate)
+{
+	double target = std::clamp(PROBE_SHARE * bandwidth_kbps, (double)rc->min_kbps, (double)rc->max_kbps);
+
+	rc->target_kbps = (uint32_t)target;
+	rc->sent_kbps = target;
+	rc->usage = EMS_RATE_CONTROL_USAGE_NORMAL;
+	rc->has_last = false;
+	rc->last_decrease_ns = 0;
+	rc->low_since_ns = 0;
+	rc->high_since_ns = 0;
+
+	if (rtt_ns != 0) {
+		rc->rtt_ms = (double)rtt_ns / (double)U_TIME_1MS_IN_NS;
+		rc->min_rtt_ms = rc->rtt_ms;
+	}
+
+	rc->rung = 0;
+	while (rc->rung + 1 < EMS_RATE_CONTROL_RUNGS && bits_per_pixel(target, full_pixel_rate, rc->rung) < BPP_LOW) {
+		rc->rung++;
+	}
+}
+
+float
+ems_rate_control_get_scale(const struct ems_rate_control *rc)
+{
+	return rung_scales[rc->rung];
+}
@@ -0,0 +1,163 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Bitrate and resolution control from the transport's feedback.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include "xrt/xrt_compiler.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * Number of rungs of the resolution ladder, the first is the full size.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_RATE_CONTROL_RUNGS (3)
+
+/*!
+ * What the transport tells us, taken from the RTCP receiver reports of the
+ * client and what we sent.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_rate_control_stats
+{
+	//! Server clock: when the stats were taken.
+	uint64_t timestamp_ns;
+
+	//! Bytes sent so far, counts up.
+	uint64_t bytes_sent;
+
+	//! Round trip time from the last receiver report, zero if there was none yet.
+	uint64_t rtt_ns;
+
+	//! Share of packets the last receiver report says were lost, 0 to 1.
+	double fraction_lost;
+};
+
+/*!
+ * How the delay on the path is developing.
+ *
+ * @ingroup comp_ems
+ */
+enum ems_rate_control_usage
+{
+	EMS_RATE_CONTROL_USAGE_NORMAL,
+	//! Queues are building up, we send more than the path takes.
+	EMS_RATE_CONTROL_USAGE_OVER,
+	//! Queues are draining, hold still until they are empty.
+	EMS_RATE_CONTROL_USAGE_UNDER,
+};
+
+/*!
+ * Picks the encoder bitrate like the delay based part of Google congestion
+ * control: the bitrate grows by a few percent per second while the delay
+ * stays flat, and drops to below what actually got through when queues
+ * build up. Packet loss brings it down too, Wi-Fi drops packets before its
+ * queues show.
+ *
+ * Receiver reports only give the round trip time, so the queueing delay is
+ * how far it is above the lowest one seen, which slowly follows it up to
+ * forget route changes.
+ *
+ * When the bitrate is too low for the picture size the picture is stepped
+ * down a rung of the resolution ladder, and back up once the bitrate has
+ * been high enough for the bigger size for a while.
+ *
+ * Not thread safe, the stats arrive on one thread.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_rate_control
+{
+	uint32_t min_kbps;
+	uint32_t max_kbps;
+
+	//! What the encoder should be set to.
+	uint32_t target_kbps;
+
+	//! Rung of the resolution ladder, 0 is the full size.
+	uint32_t rung;
+
+	//! Stats of the last update, for the rates.
+	bool has_last;
+	uint64_t last_ns;
+	uint64_t last_bytes_sent;
+
+	//! Smoothed rate the bytes actually went out at.
+	double sent_kbps;
+
+	//! Smoothed round trip time, and the lowest taken as the path without queues.
+	double rtt_ms;
+	double min_rtt_ms;
+
+	enum ems_rate_control_usage usage;
+
+	//! When the bitrate was last brought down, once per round trip is enough.
+	uint64_t last_decrease_ns;
+
+	//! Since when the bitrate is too low for this rung, or high enough for the one above, zero if not.
+	uint64_t low_since_ns;
+	uint64_t high_since_ns;
+
+	//! Debug UI: queueing delay, and how often the bitrate and rung were brought down.
+	int64_t queue_delay_us;
+	uint64_t decreases;
+	uint64_t rung_downs;
+};
+
+/*!
+ * @public @memberof ems_rate_control
+ */
+void
+ems_rate_control_init(struct ems_rate_control *rc, uint32_t start_kbps, uint32_t min_kbps, uint32_t max_kbps);
+
+/*!
+ * Feed in new @p stats, updates the target bitrate and the rung. The bits
+ * per pixel that decide the rung are for @p full_pixel_rate pixels per
+ * second at the full size.
+ *
+ * @public @memberof ems_rate_control
+ */
+void
+ems_rate_control_update(struct ems_rate_control *rc,
+                        const struct ems_rate_control_stats *stats,
+                        uint64_t full_pixel_rate);
+
+/*!
+ * Start over from a measurement of the path taken before streaming: the
+ * bitrate is set to a share of @p bandwidth_kbps, leaving room for what the
+ * measurement got wrong, and the rung to the biggest picture that gets
+ * enough bits per pixel at it. A @p rtt_ns of zero leaves the round trip
+ * time to the stats.
+ *
+ * @public @memberof ems_rate_control
+ */
+void
+ems_rate_control_start_from_probe(struct ems_rate_control *rc,
+                                  uint32_t bandwidth_kbps,
+                                  uint64_t rtt_ns,
+                                  uint64_t full_pixel_rate);
+
+/*!
+ * How much the picture is scaled along each axis at the current rung.
+ *
+ * @public @memberof ems_rate_control
+ */
+float
+ems_rate_control_get_scale(const struct ems_rate_control *rc);
+
+
+#ifdef __cplusplus
+}
+#endif
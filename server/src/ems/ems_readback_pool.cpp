@@ -0,0 +1,491 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Pool of host visible buffers that the compositor writes encoder ready frames into.
+ * @ingroup comp_ems
+ */
+
+#include "ems_readback_pool.h"
+
+#include "xrt/xrt_handles.h"
+
+#include "os/os_threading.h"
+
+#include "util/u_misc.h"
+#include "util/u_logging.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+
+/*!
+ * @ingroup comp_ems
+ */
+struct ems_readback_pool
+{
+	struct vk_bundle *vk;
+
+	//! Protects the frames and @ref destroyed, frames are released from GStreamer threads.
+	struct os_mutex mutex;
+
+	struct ems_readback_frame frames[EMS_READBACK_POOL_SIZE];
+
+	uint32_t width;
+	uint32_t height;
+
+	enum ems_readback_memory memory;
+
+	//! Allocations imported with @ref EMS_READBACK_MEMORY_HOST are aligned to this.
+	VkDeviceSize host_alignment;
+
+	PFN_vkGetMemoryHostPointerPropertiesEXT vkGetMemoryHostPointerPropertiesEXT;
+
+	//! Destroy has been called, free ourselves once the last frame is released.
+	bool destroyed;
+};
+
+
+/*
+ *
+ * Helpers.
+ *
+ */
+
+static bool
+any_in_use_locked(struct ems_readback_pool *pool)
+{
+	for (uint32_t i = 0; i < EMS_READBACK_POOL_SIZE; i++) {
+		if (pool->frames[i].in_use) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void
+free_frame(struct vk_bundle *vk, struct ems_readback_frame *rf)
+{
+	if (rf->dmabuf_fd >= 0) {
+		close(rf->dmabuf_fd);
+		rf->dmabuf_fd = -1;
+	}
+
+	// Data is only set once mapped, init_frame might have failed before that.
+	if (rf->base_frame.data != NULL && rf->host_ptr == NULL) {
+		vk->vkUnmapMemory(vk->device, rf->memory);
+	}
+
+	if (rf->buffer != VK_NULL_HANDLE) {
+		vk->vkDestroyBuffer(vk->device, rf->buffer, NULL);
+		rf->buffer = VK_NULL_HANDLE;
+	}
+
+	if (rf->memory != VK_NULL_HANDLE) {
+		vk->vkFreeMemory(vk->device, rf->memory, NULL);
+		rf->memory = VK_NULL_HANDLE;
+	}
+
+	// Only once Vulkan no longer references it.
+	free(rf->host_ptr);
+	rf->host_ptr = NULL;
+
+	rf->base_frame.data = NULL;
+}
+
+static void
+free_pool(struct ems_readback_pool *pool)
+{
+	for (uint32_t i = 0; i < EMS_READBACK_POOL_SIZE; i++) {
+		free_frame(pool->vk, &pool->frames[i]);
+	}
+
+	os_mutex_destroy(&pool->mutex);
+
+	free(pool);
+}
+
+static bool
+import_host_memory(struct ems_readback_pool *pool, struct ems_readback_frame *rf, VkMemoryRequirements requirements)
+{
+	struct vk_bundle *vk = pool->vk;
+	VkResult ret;
+
+	// Both the pointer and the size of an import must be aligned.
+	VkDeviceSize alignment = std::max(pool->host_alignment, requirements.alignment);
+	VkDeviceSize size = (requirements.size + alignment - 1) / alignment * alignment;
+
+	rf->host_ptr = aligned_alloc(alignment, size);
+	if (rf->host_ptr == NULL) {
+		U_LOG_E("aligned_alloc: Failed to allocate %" PRIu64 " bytes", (uint64_t)size);
+		return false;
+	}
+
+	VkMemoryHostPointerPropertiesEXT host_props = {
+	    .sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT,
+	};
+
+	ret = pool->vkGetMemoryHostPointerPropertiesEXT(            //
+	    vk->device,                                             // device
+	    VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, // handleType
+	    rf->host_ptr,                                           // pHostPointer
+	    &host_props);                                           // pMemoryHostPointerProperties
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkGetMemoryHostPointerPropertiesEXT: %s", vk_result_string(ret));
+		return false;
+	}
+
+	// Needs to be coherent, imported memory isn't mapped so can't be invalidated.
+	uint32_t memory_type_index = 0;
+	if (!vk_get_memory_type(vk, requirements.memoryTypeBits & host_props.memoryTypeBits,
+	                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	                        &memory_type_index)) {
+		U_LOG_E("vk_get_memory_type: No coherent memory type for imported host memory!");
+		return false;
+	}
+
+	VkImportMemoryHostPointerInfoEXT import_info = {
+	    .sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT,
+	    .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+	    .pHostPointer = rf->host_ptr,
+	};
+
+	VkMemoryAllocateInfo alloc_info = {
+	    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+	    .pNext = &import_info,
+	    .allocationSize = size,
+	    .memoryTypeIndex = memory_type_index,
+	};
+
+	ret = vk->vkAllocateMemory(vk->device, &alloc_info, NULL, &rf->memory);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkAllocateMemory: %s", vk_result_string(ret));
+		return false;
+	}
+
+	ret = vk->vkBindBufferMemory(vk->device, rf->buffer, rf->memory, 0);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkBindBufferMemory: %s", vk_result_string(ret));
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+create_buffer(struct ems_readback_pool *pool, struct ems_readback_frame *rf, VkDeviceSize size)
+{
+	struct vk_bundle *vk = pool->vk;
+	VkResult ret;
+
+	VkExternalMemoryHandleTypeFlags handle_types = 0;
+#if defined(XRT_GRAPHICS_BUFFER_HANDLE_IS_FD)
+	if (pool->memory == EMS_READBACK_MEMORY_DMABUF) {
+		handle_types = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+	}
+#endif
+	if (pool->memory == EMS_READBACK_MEMORY_HOST) {
+		handle_types = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+	}
+
+	VkExternalMemoryBufferCreateInfo external_info = {
+	    .sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO,
+	    .handleTypes = handle_types,
+	};
+
+	VkBufferCreateInfo buffer_info = {
+	    .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+	    .pNext = handle_types != 0 ? &external_info : NULL,
+	    .size = size,
+	    .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+	    .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+	};
+
+	ret = vk->vkCreateBuffer(vk->device, &buffer_info, NULL, &rf->buffer);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkCreateBuffer: %s", vk_result_string(ret));
+		return false;
+	}
+
+	VkMemoryRequirements requirements;
+	vk->vkGetBufferMemoryRequirements(vk->device, rf->buffer, &requirements);
+
+	if (pool->memory == EMS_READBACK_MEMORY_HOST) {
+		return import_host_memory(pool, rf, requirements);
+	}
+
+	// Cached memory is much faster for the CPU to read from, not all GPUs have it.
+	VkMemoryPropertyFlags cached = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+	VkMemoryPropertyFlags coherent = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+	uint32_t memory_type_index = 0;
+	if (!vk_get_memory_type(vk, requirements.memoryTypeBits, cached, &memory_type_index) &&
+	    !vk_get_memory_type(vk, requirements.memoryTypeBits, coherent, &memory_type_index)) {
+		U_LOG_E("vk_get_memory_type: No host visible memory for readback buffer!");
+		return false;
+	}
+
+	VkExportMemoryAllocateInfo export_info = {
+	    .sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO,
+	    .handleTypes = handle_types,
+	};
+
+	VkMemoryAllocateInfo alloc_info = {
+	    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+	    .pNext = handle_types != 0 ? &export_info : NULL,
+	    .allocationSize = requirements.size,
+	    .memoryTypeIndex = memory_type_index,
+	};
+
+	ret = vk->vkAllocateMemory(vk->device, &alloc_info, NULL, &rf->memory);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkAllocateMemory: %s", vk_result_string(ret));
+		return false;
+	}
+
+	ret = vk->vkBindBufferMemory(vk->device, rf->buffer, rf->memory, 0);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkBindBufferMemory: %s", vk_result_string(ret));
+		return false;
+	}
+
+#if defined(XRT_GRAPHICS_BUFFER_HANDLE_IS_FD)
+	if (handle_types != 0) {
+		VkMemoryGetFdInfoKHR fd_info = {
+		    .sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR,
+		    .memory = rf->memory,
+		    .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+		};
+
+		ret = vk->vkGetMemoryFdKHR(vk->device, &fd_info, &rf->dmabuf_fd);
+		if (ret != VK_SUCCESS) {
+			U_LOG_E("vkGetMemoryFdKHR: %s", vk_result_string(ret));
+			rf->dmabuf_fd = -1;
+			return false;
+		}
+	}
+#endif
+
+	return true;
+}
+
+static bool
+init_frame(struct ems_readback_pool *pool, struct ems_readback_frame *rf)
+{
+	struct vk_bundle *vk = pool->vk;
+	VkResult ret;
+
+	rf->pool = pool;
+	rf->dmabuf_fd = -1;
+
+	// Luma plane followed by the interleaved chroma plane.
+	VkDeviceSize size = (VkDeviceSize)pool->width * pool->height * 3 / 2;
+
+	if (!create_buffer(pool, rf, size)) {
+		return false;
+	}
+
+	void *ptr = rf->host_ptr;
+	if (ptr == NULL) {
+		ret = vk->vkMapMemory(vk->device, rf->memory, 0, VK_WHOLE_SIZE, 0, &ptr);
+		if (ret != VK_SUCCESS) {
+			U_LOG_E("vkMapMemory: %s", vk_result_string(ret));
+			return false;
+		}
+	}
+
+	rf->base_frame.width = pool->width;
+	rf->base_frame.height = pool->height * 3 / 2;
+	rf->base_frame.stride = pool->width;
+	rf->base_frame.size = size;
+	rf->base_frame.format = XRT_FORMAT_L8;
+	rf->base_frame.data = (uint8_t *)ptr;
+
+	return true;
+}
+
+static void
+frame_destroy(struct xrt_frame *xf)
+{
+	struct ems_readback_frame *rf = container_of(xf, struct ems_readback_frame, base_frame);
+	struct ems_readback_pool *pool = rf->pool;
+
+	os_mutex_lock(&pool->mutex);
+
+	rf->in_use = false;
+	bool last = pool->destroyed && !any_in_use_locked(pool);
+
+	os_mutex_unlock(&pool->mutex);
+
+	if (last) {
+		free_pool(pool);
+	}
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+bool
+ems_readback_pool_create(struct vk_bundle *vk,
+                         uint32_t width,
+                         uint32_t height,
+                         enum ems_readback_memory memory,
+                         struct ems_readback_pool **out_pool)
+{
+	assert(width % 4 == 0);
+	assert(height % 2 == 0);
+
+#if defined(XRT_GRAPHICS_BUFFER_HANDLE_IS_FD)
+	if (memory == EMS_READBACK_MEMORY_DMABUF && !vk->has_EXT_external_memory_dma_buf) {
+		U_LOG_W("VK_EXT_external_memory_dma_buf not supported, can not export readback buffers");
+		return false;
+	}
+#else
+	if (memory == EMS_READBACK_MEMORY_DMABUF) {
+		U_LOG_W("DMA-BUF export is not supported on this platform");
+		return false;
+	}
+#endif
+
+	VkDeviceSize host_alignment = 0;
+	PFN_vkGetMemoryHostPointerPropertiesEXT get_host_pointer_props = NULL;
+	if (memory == EMS_READBACK_MEMORY_HOST) {
+		if (!vk->has_EXT_external_memory_host) {
+			U_LOG_W("VK_EXT_external_memory_host not supported, can not import readback buffers");
+			return false;
+		}
+
+		get_host_pointer_props = (PFN_vkGetMemoryHostPointerPropertiesEXT)vk->vkGetDeviceProcAddr(
+		    vk->device, "vkGetMemoryHostPointerPropertiesEXT");
+		if (get_host_pointer_props == NULL) {
+			U_LOG_E("Failed to load vkGetMemoryHostPointerPropertiesEXT");
+			return false;
+		}
+
+		VkPhysicalDeviceExternalMemoryHostPropertiesEXT host_props = {
+		    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT,
+		};
+		VkPhysicalDeviceProperties2 props = {
+		    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+		    .pNext = &host_props,
+		};
+		vk->vkGetPhysicalDeviceProperties2(vk->physical_device, &props);
+
+		host_alignment = host_props.minImportedHostPointerAlignment;
+	}
+
+	struct ems_readback_pool *pool = U_TYPED_CALLOC(struct ems_readback_pool);
+	pool->vk = vk;
+	pool->width = width;
+	pool->height = height;
+	pool->memory = memory;
+	pool->host_alignment = host_alignment;
+	pool->vkGetMemoryHostPointerPropertiesEXT = get_host_pointer_props;
+
+	// So that freeing a partially created pool doesn't close fd 0.
+	for (uint32_t i = 0; i < EMS_READBACK_POOL_SIZE; i++) {
+		pool->frames[i].dmabuf_fd = -1;
+	}
+
+	int ret = os_mutex_init(&pool->mutex);
+	if (ret != 0) {
+		U_LOG_E("os_mutex_init: %i", ret);
+		free(pool);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < EMS_READBACK_POOL_SIZE; i++) {
+		if (!init_frame(pool, &pool->frames[i])) {
+			free_pool(pool);
+			return false;
+		}
+	}
+
+	*out_pool = pool;
+
+	return true;
+}
+
+bool
+ems_readback_pool_get_unused_frame(struct ems_readback_pool *pool, struct ems_readback_frame **out_frame)
+{
+	struct ems_readback_frame *rf = NULL;
+
+	os_mutex_lock(&pool->mutex);
+
+	for (uint32_t i = 0; i < EMS_READBACK_POOL_SIZE; i++) {
+		if (!pool->frames[i].in_use) {
+			rf = &pool->frames[i];
+			rf->in_use = true;
+			break;
+		}
+	}
+
+	os_mutex_unlock(&pool->mutex);
+
+	if (rf == NULL) {
+		return false;
+	}
+
+	rf->base_frame.reference.count = 1;
+	rf->base_frame.destroy = frame_destroy;
+
+	*out_frame = rf;
+
+	return true;
+}
+
+VkResult
+ems_readback_pool_invalidate_frame(struct ems_readback_pool *pool, struct ems_readback_frame *rf)
+{
+	struct vk_bundle *vk = pool->vk;
+
+	// Imported host memory is always coherent and never mapped.
+	if (rf->host_ptr != NULL) {
+		return VK_SUCCESS;
+	}
+
+	// Harmless if the memory turned out to be coherent.
+	VkMappedMemoryRange range = {
+	    .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+	    .memory = rf->memory,
+	    .offset = 0,
+	    .size = VK_WHOLE_SIZE,
+	};
+
+	return vk->vkInvalidateMappedMemoryRanges(vk->device, 1, &range);
+}
+
+void
+ems_readback_pool_destroy(struct ems_readback_pool **pool_ptr)
+{
+	struct ems_readback_pool *pool = *pool_ptr;
+	if (pool == NULL) {
+		return;
+	}
+
+	os_mutex_lock(&pool->mutex);
+
+	pool->destroyed = true;
+	bool in_use = any_in_use_locked(pool);
+
+	os_mutex_unlock(&pool->mutex);
+
+	// The last frame to be released will free the pool.
+	if (!in_use) {
+		free_pool(pool);
+	}
+
+	*pool_ptr = NULL;
+}
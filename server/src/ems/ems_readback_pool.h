@@ -0,0 +1,130 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Pool of host visible buffers that the compositor writes encoder ready frames into.
+ * @ingroup comp_ems
+ */
+
+#pragma once
+
+#include "xrt/xrt_frame.h"
+#include "vk/vk_helpers.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * Number of frames in a pool, this covers the frames in flight on the GPU
+ * plus the ones held by the GStreamer pipeline.
+ *
+ * @ingroup comp_ems
+ */
+#define EMS_READBACK_POOL_SIZE (8)
+
+struct ems_readback_pool;
+
+/*!
+ * Where the memory of the frames in a pool comes from.
+ *
+ * @ingroup comp_ems
+ */
+enum ems_readback_memory
+{
+	//! Host visible memory allocated by Vulkan, preferring cached memory.
+	EMS_READBACK_MEMORY_DEVICE,
+
+	//! Like @ref EMS_READBACK_MEMORY_DEVICE but also exported as a DMA-BUF.
+	EMS_READBACK_MEMORY_DMABUF,
+
+	/*!
+	 * Plain host allocations imported with VK_EXT_external_memory_host, the
+	 * GPU writes straight into ordinary cached system memory that CPU
+	 * encoders read from at full speed.
+	 */
+	EMS_READBACK_MEMORY_HOST,
+};
+
+/*!
+ * A frame backed by a host visible @p VkBuffer, the GPU writes a NV12 picture
+ * into it which is then handed as is to the encoder.
+ *
+ * The xrt_frame is described as @ref XRT_FORMAT_L8 with 1.5 times the
+ * picture height, that is the luma plane followed by the interleaved chroma
+ * plane, both with a stride of the picture width. This makes debug sinks show
+ * something sensible.
+ *
+ * @ingroup comp_ems
+ */
+struct ems_readback_frame
+{
+	struct xrt_frame base_frame;
+
+	//! Pool that owns this frame.
+	struct ems_readback_pool *pool;
+
+	VkBuffer buffer;
+	VkDeviceMemory memory;
+
+	//! DMA-BUF file descriptor of @ref memory owned by the pool, -1 if not exported.
+	int dmabuf_fd;
+
+	//! Host allocation imported as @ref memory, NULL if allocated by Vulkan.
+	void *host_ptr;
+
+	//! Is this frame handed out, protected by the pool mutex.
+	bool in_use;
+};
+
+/*!
+ * Create a pool of frames for a NV12 picture of @p width x @p height, both
+ * must be even and @p width a multiple of four.
+ *
+ * Creation fails if the device can not provide the requested @p memory, the
+ * caller is expected to fall back to @ref EMS_READBACK_MEMORY_DEVICE.
+ *
+ * @public @memberof ems_readback_pool
+ */
+bool
+ems_readback_pool_create(struct vk_bundle *vk,
+                         uint32_t width,
+                         uint32_t height,
+                         enum ems_readback_memory memory,
+                         struct ems_readback_pool **out_pool);
+
+/*!
+ * Get a frame that is not in use, the returned frame has a reference count of
+ * one and is returned to the pool when that reaches zero.
+ *
+ * @public @memberof ems_readback_pool
+ */
+bool
+ems_readback_pool_get_unused_frame(struct ems_readback_pool *pool, struct ems_readback_frame **out_frame);
+
+/*!
+ * Make the GPU writes to the frame visible to the host, call once the GPU
+ * work writing to it has completed.
+ *
+ * @public @memberof ems_readback_pool
+ */
+VkResult
+ems_readback_pool_invalidate_frame(struct ems_readback_pool *pool, struct ems_readback_frame *rf);
+
+/*!
+ * Destroy the pool and clear the pointer. Frames still referenced, for
+ * instance by the GStreamer pipeline, are freed when they are released, the
+ * @ref vk_bundle must outlive them.
+ *
+ * @public @memberof ems_readback_pool
+ */
+void
+ems_readback_pool_destroy(struct ems_readback_pool **pool_ptr);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -98,6 +98,16 @@ struct ems_instance
 
 // compositor interface functions
 
+struct ems_compositor;
+
+/*!
+ * Creates a bare @ref ems_compositor, without the multi compositor on top,
+ * so a single client can drive it directly. Used by the benchmark.
+ *
+ * @ingroup comp_ems
+ */
+xrt_result_t
+ems_compositor_create(ems_instance &emsi, struct ems_compositor **out_c);
 
 /*!
  * Creates a @ref ems_compositor.
@@ -0,0 +1,215 @@
+// Copyright 2023, Pluto VR, Inc.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  H.264 encoder elements the pipeline can use, probed at startup.
+ * @ingroup aux_util
+ */
+
+#include "ems_gstreamer_encoder.h"
+
+#include "xrt/xrt_compiler.h"
+#include "util/u_logging.h"
+
+#include <gst/gst.h>
+
+#include <string.h>
+
+
+/*
+ *
+ * Encoder table.
+ *
+ */
+
+// clang-format off
+static const struct ems_gstreamer_encoder encoders[] = {
+	{
+		// NVENC, the low latency preset has no B-frames, zerolatency stops it from holding frames back.
+		// The slice count is not a property of the element.
+		.name = "nvenc",
+		.factory = "nvh264enc",
+		.properties = "preset=low-latency-hp zerolatency=true bframes=0 rc-lookahead=0 rc-mode=cbr",
+		.profile = "constrained-baseline",
+		.input_format = NULL,
+		.bitrate_property = "bitrate",
+		.bitrate_unit = 1000,
+		.intra_refresh_properties = NULL,
+		.intra_refresh_period_property = NULL,
+		.slices_property = NULL,
+		.hardware = true,
+		.rank = {0, 0, 1},
+	},
+	{
+		// VA-API low power mode, fixed function on Intel, lower latency than the shader based one.
+		.name = "va-lp",
+		.factory = "vah264lpenc",
+		.properties = "b-frames=0 ref-frames=1 target-usage=7 rate-control=cbr",
+		.profile = "constrained-baseline",
+		.input_format = NULL,
+		.bitrate_property = "bitrate",
+		.bitrate_unit = 1000,
+		.intra_refresh_properties = NULL,
+		.intra_refresh_period_property = NULL,
+		.slices_property = "num-slices",
+		.hardware = true,
+		.rank = {1, 1, 3},
+	},
+	{
+		.name = "va",
+		.factory = "vah264enc",
+		.properties = "b-frames=0 ref-frames=1 target-usage=7 rate-control=cbr",
+		.profile = "constrained-baseline",
+		.input_format = NULL,
+		.bitrate_property = "bitrate",
+		.bitrate_unit = 1000,
+		.intra_refresh_properties = NULL,
+		.intra_refresh_period_property = NULL,
+		.slices_property = "num-slices",
+		.hardware = true,
+		.rank = {2, 2, 2},
+	},
+	{
+		// The older gstreamer-vaapi plugin, for systems without the va plugin.
+		.name = "vaapi",
+		.factory = "vaapih264enc",
+		.properties = "max-bframes=0 quality-level=7 rate-control=cbr",
+		.profile = "constrained-baseline",
+		.input_format = NULL,
+		.bitrate_property = "bitrate",
+		.bitrate_unit = 1000,
+		.intra_refresh_properties = NULL,
+		.intra_refresh_period_property = NULL,
+		.slices_property = "num-slices",
+		.hardware = true,
+		.rank = {3, 3, 4},
+	},
+	{
+		// Zerolatency already means no B-frames, no lookahead and sliced threads, spelled out to be sure.
+		// With sliced threads every thread encodes one slice of the frame.
+		// Intra refresh needs a small VBV to even out the frame sizes, 50 ms is a few frames.
+		.name = "x264",
+		.factory = "x264enc",
+		.properties = "tune=zerolatency bframes=0 rc-lookahead=0 sliced-threads=true",
+		.profile = "baseline",
+		.input_format = NULL,
+		.bitrate_property = "bitrate",
+		.bitrate_unit = 1000,
+		.intra_refresh_properties = "intra-refresh=true vbv-buf-capacity=50",
+		.intra_refresh_period_property = "key-int-max",
+		.slices_property = "threads",
+		.hardware = false,
+		.rank = {4, 5, 0},
+	},
+	{
+		// Never has B-frames, multi-thread=0 picks the thread count and encodes slices on them.
+		// Only takes I420, the conversion costs a copy of every frame on the CPU.
+		.name = "openh264",
+		.factory = "openh264enc",
+		.properties = "complexity=low multi-thread=0 slice-mode=auto",
+		.profile = "baseline",
+		.input_format = "I420",
+		.bitrate_property = "bitrate",
+		.bitrate_unit = 1,
+		.intra_refresh_properties = NULL,
+		.intra_refresh_period_property = NULL,
+		.slices_property = NULL,
+		.hardware = false,
+		.rank = {5, 4, 5},
+	},
+};
+// clang-format on
+
+static const char *policy_names[EMS_GSTREAMER_ENCODER_POLICY_COUNT] = {
+	"latency",
+	"cpu",
+	"quality",
+};
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+bool
+ems_gstreamer_encoder_policy_from_string(const char *str, enum ems_gstreamer_encoder_policy *out_policy)
+{
+	if (str == NULL) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < EMS_GSTREAMER_ENCODER_POLICY_COUNT; i++) {
+		if (strcmp(str, policy_names[i]) == 0) {
+			*out_policy = (enum ems_gstreamer_encoder_policy)i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool
+ems_gstreamer_encoder_is_available(const struct ems_gstreamer_encoder *enc)
+{
+	GstElementFactory *factory = gst_element_factory_find(enc->factory);
+	if (factory == NULL) {
+		return false;
+	}
+
+	// Loads the plugin, which fails if its libraries are missing.
+	GstElement *element = gst_element_factory_create(factory, NULL);
+	gst_object_unref(factory);
+
+	if (element == NULL) {
+		return false;
+	}
+
+	gst_object_unref(element);
+
+	return true;
+}
+
+const struct ems_gstreamer_encoder *
+ems_gstreamer_encoder_select(const char *name, enum ems_gstreamer_encoder_policy policy)
+{
+	const struct ems_gstreamer_encoder *named = NULL;
+	const struct ems_gstreamer_encoder *best = NULL;
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(encoders); i++) {
+		const struct ems_gstreamer_encoder *enc = &encoders[i];
+		bool available = ems_gstreamer_encoder_is_available(enc);
+
+		U_LOG_I("Encoder '%s' (%s, %s): %s", enc->name, enc->factory, enc->hardware ? "hardware" : "software",
+		        available ? "available" : "not available");
+
+		if (!available) {
+			continue;
+		}
+		if (name != NULL && strcmp(name, enc->name) == 0) {
+			named = enc;
+		}
+		if (best == NULL || enc->rank[policy] < best->rank[policy]) {
+			best = enc;
+		}
+	}
+
+	if (name != NULL && named == NULL) {
+		U_LOG_W("Encoder '%s' is not available, picking by policy", name);
+	}
+
+	const struct ems_gstreamer_encoder *enc = named != NULL ? named : best;
+	if (enc == NULL) {
+		U_LOG_E("None of the known H.264 encoders is available");
+		return NULL;
+	}
+
+	if (named != NULL) {
+		U_LOG_I("Using encoder '%s' (%s) as asked for", enc->name, enc->factory);
+	} else {
+		U_LOG_I("Using encoder '%s' (%s), best for %s", enc->name, enc->factory, policy_names[policy]);
+	}
+
+	return enc;
+}
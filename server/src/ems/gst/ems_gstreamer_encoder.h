@@ -0,0 +1,116 @@
+// Copyright 2023, Pluto VR, Inc.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  H.264 encoder elements the pipeline can use, probed at startup.
+ * @ingroup aux_util
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * What to prefer when more than one encoder is available.
+ */
+enum ems_gstreamer_encoder_policy
+{
+	//! Least time from a frame going in to it coming out, hardware first.
+	EMS_GSTREAMER_ENCODER_POLICY_LATENCY,
+	//! Least CPU time, hardware first and the cheaper software encoder after.
+	EMS_GSTREAMER_ENCODER_POLICY_CPU,
+	//! Best picture for the bitrate, x264 first.
+	EMS_GSTREAMER_ENCODER_POLICY_QUALITY,
+
+	EMS_GSTREAMER_ENCODER_POLICY_COUNT,
+};
+
+/*!
+ * An encoder element and how to set it up for streaming: no B-frames, no
+ * lookahead and threading that does not hold frames back, so every frame
+ * pushed in comes out again before the next one.
+ *
+ * The output has to be byte-stream H.264, the client decodes that and the
+ * frame id SEI is written for it.
+ */
+struct ems_gstreamer_encoder
+{
+	//! Short name to select it by, see @ref ems_gstreamer_encoder_select.
+	const char *name;
+
+	//! GStreamer element factory.
+	const char *factory;
+
+	//! Element properties in gst-launch syntax.
+	const char *properties;
+
+	//! H.264 profile asked for in the caps after the encoder.
+	const char *profile;
+
+	/*!
+	 * Raw format the encoder takes if it is not the NV12 the source pushes,
+	 * the pipeline converts to it on the CPU. NULL for NV12.
+	 */
+	const char *input_format;
+
+	//! Property taking the target bitrate, can be changed while playing.
+	const char *bitrate_property;
+
+	//! Bits per second per unit of @ref bitrate_property.
+	uint32_t bitrate_unit;
+
+	/*!
+	 * Properties that replace the periodic IDR frames by a column of intra
+	 * blocks sweeping across the picture, so every frame is about the same
+	 * size. NULL if the encoder can't.
+	 */
+	const char *intra_refresh_properties;
+
+	//! Property taking the frames one sweep of the intra refresh takes.
+	const char *intra_refresh_period_property;
+
+	//! Property taking the number of slices per frame, NULL if the encoder picks them itself.
+	const char *slices_property;
+
+	//! Runs on a GPU or fixed function hardware instead of the CPU.
+	bool hardware;
+
+	//! Order of preference for each @ref ems_gstreamer_encoder_policy, lowest first.
+	uint8_t rank[EMS_GSTREAMER_ENCODER_POLICY_COUNT];
+};
+
+/*!
+ * Parse "latency", "cpu" or "quality", returns false for anything else.
+ */
+bool
+ems_gstreamer_encoder_policy_from_string(const char *str, enum ems_gstreamer_encoder_policy *out_policy);
+
+/*!
+ * Is the element factory of @p enc installed and does it make elements, the
+ * hardware encoders are only registered when there is a device for them.
+ *
+ * @pre gst_init has been called.
+ */
+bool
+ems_gstreamer_encoder_is_available(const struct ems_gstreamer_encoder *enc);
+
+/*!
+ * Pick the encoder to use: the one called @p name if it is given and
+ * available, otherwise the available one @p policy prefers. Logs what is
+ * available and what was picked. Returns NULL if no known encoder is.
+ *
+ * @pre gst_init has been called.
+ */
+const struct ems_gstreamer_encoder *
+ems_gstreamer_encoder_select(const char *name, enum ems_gstreamer_encoder_policy policy);
+
+
+#ifdef __cplusplus
+}
+#endif
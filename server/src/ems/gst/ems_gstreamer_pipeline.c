@@ -15,14 +15,19 @@
  */
 
 #include "ems_gstreamer_pipeline.h"
+#include "ems_gstreamer_encoder.h"
+#include "ems_gstreamer_probe.h"
 
 #include "ems_callbacks.h"
 
+#include "os/os_time.h"
 #include "os/os_threading.h"
 #include "util/u_misc.h"
 #include "util/u_debug.h"
+#include "util/u_time.h"
 
 #include "pb_decode.h"
+#include "pb_encode.h"
 #include "electricmaple.pb.h"
 
 // Monado includes
@@ -38,13 +43,37 @@
 #define GST_USE_UNSTABLE_API
 #include <gst/webrtc/datachannel.h>
 #include <gst/webrtc/rtcsessiondescription.h>
+#include <gst/webrtc/webrtc.h>
 #undef GST_USE_UNSTABLE_API
 
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #define WEBRTC_TEE_NAME "webrtctee"
 
+// Raw frames allowed to wait for the encoder, the oldest is dropped beyond that.
+#define ENCODE_QUEUE_MAX_BUFFERS (2)
+
+// How often the transport stats of the connected client are polled.
+#define STATS_INTERVAL_MS (250)
+
+// Gap between the probe trains, so the data channel's congestion window has room for each.
+#define PROBE_TRAIN_INTERVAL_MS (20)
+
+// How long to wait for probe replies after the last train, before estimating without them.
+#define PROBE_TIMEOUT_NS (500 * (uint64_t)U_TIME_1MS_IN_NS)
+
+// Used if no known encoder is available, so the pipeline fails with a clear error.
+#define FALLBACK_ENCODER_FACTORY "x264enc"
+
+DEBUG_GET_ONCE_OPTION(encoder, "EMS_ENCODER", "auto")
+DEBUG_GET_ONCE_OPTION(encoder_policy, "EMS_ENCODER_POLICY", "latency")
+DEBUG_GET_ONCE_BOOL_OPTION(probe, "EMS_PROBE", true)
+DEBUG_GET_ONCE_BOOL_OPTION(intra_refresh, "EMS_INTRA_REFRESH", true)
+DEBUG_GET_ONCE_NUM_OPTION(intra_refresh_period, "EMS_INTRA_REFRESH_PERIOD", 60)
+DEBUG_GET_ONCE_NUM_OPTION(slices, "EMS_SLICES", 4)
+
 #ifdef __aarch64__
 #define DEFAULT_VIDEOSINK " queue max-size-bytes=0 ! kmssink bus-id=a0070000.v_mix"
 #else
@@ -62,11 +91,37 @@ struct ems_gstreamer_pipeline
 
 
 	// struct GstElement *pipeline;
+
+	//! The webrtcbin of the connected client, only touched on the main loop.
 	GstElement *webrtc;
 
+	//! The encoder in the pipeline, NULL if none of the known ones was available.
+	const struct ems_gstreamer_encoder *encoder;
+
+	//! Slices the encoder was told to cut frames into, zero if it picks.
+	uint32_t slices;
+
+	//! Protects @ref stats_func, it is called from a thread of the webrtc element.
+	struct os_mutex stats_mutex;
+	guint stats_src_id;
+	ems_gstreamer_pipeline_stats_func_t stats_func;
+	void *stats_userdata;
+
 	GObject *data_channel;
 	guint timeout_src_id;
 
+	//! Protects @ref data_channel_open, messages are sent from the compositor.
+	struct os_mutex data_channel_mutex;
+	bool data_channel_open;
+
+	//! Measures the path when the data channel opens, replies arrive on the data channel thread.
+	struct os_mutex probe_mutex;
+	struct ems_gstreamer_probe probe;
+	guint probe_src_id;
+	uint64_t probe_deadline_ns;
+	ems_gstreamer_pipeline_probe_func_t probe_func;
+	void *probe_userdata;
+
 
 	struct ems_callbacks *callbacks;
 };
@@ -202,11 +257,115 @@ datachannel_send_message(GstWebRTCDataChannel *datachannel)
 	return G_SOURCE_CONTINUE;
 }
 
+/*!
+ * Encode and send @p msg, zero padded to @p min_size bytes: the zero right
+ * after the message ends it for a null terminated decode.
+ */
+static bool
+send_down_message(struct ems_gstreamer_pipeline *egp, const em_proto_DownMessage *msg, size_t min_size)
+{
+	// Room for the padding of probes.
+	uint8_t buf[em_proto_DownMessage_size + EMS_GSTREAMER_PROBE_SIZE];
+	assert(min_size <= sizeof(buf));
+
+	pb_ostream_t os = pb_ostream_from_buffer(buf, em_proto_DownMessage_size);
+	if (!pb_encode(&os, &em_proto_DownMessage_msg, msg)) {
+		U_LOG_E("Failed to encode down message: %s", PB_GET_ERROR(&os));
+		return false;
+	}
+
+	size_t size = os.bytes_written;
+	if (size < min_size) {
+		memset(buf + size, 0, min_size - size);
+		size = min_size;
+	}
+
+	// Keep the channel alive while sending, it is closed from the main loop.
+	GObject *data_channel = NULL;
+	os_mutex_lock(&egp->data_channel_mutex);
+	if (egp->data_channel_open && egp->data_channel != NULL) {
+		data_channel = g_object_ref(egp->data_channel);
+	}
+	os_mutex_unlock(&egp->data_channel_mutex);
+
+	if (data_channel == NULL) {
+		return false;
+	}
+
+	GBytes *bytes = g_bytes_new(buf, size);
+	gst_webrtc_data_channel_send_data(GST_WEBRTC_DATA_CHANNEL(data_channel), bytes);
+	g_bytes_unref(bytes);
+
+	g_object_unref(data_channel);
+
+	return true;
+}
+
+/*!
+ * Sends the probe trains one per call, then waits for the replies and hands
+ * the estimate on. Runs on the main loop.
+ */
+static gboolean
+probe_tick(gpointer user_data)
+{
+	struct ems_gstreamer_pipeline *egp = user_data;
+
+	os_mutex_lock(&egp->probe_mutex);
+
+	if (egp->probe.trains_sent < EMS_GSTREAMER_PROBE_TRAINS) {
+		for (uint32_t i = 0; i < EMS_GSTREAMER_PROBE_TRAIN_LENGTH; i++) {
+			em_proto_DownMessage msg = em_proto_DownMessage_init_default;
+			msg.has_probe = true;
+			ems_gstreamer_probe_make(&egp->probe, i, os_monotonic_get_ns(), &msg.probe);
+			send_down_message(egp, &msg, EMS_GSTREAMER_PROBE_SIZE);
+		}
+		ems_gstreamer_probe_end_train(&egp->probe);
+
+		egp->probe_deadline_ns = os_monotonic_get_ns() + PROBE_TIMEOUT_NS;
+		os_mutex_unlock(&egp->probe_mutex);
+
+		return G_SOURCE_CONTINUE;
+	}
+
+	if (!ems_gstreamer_probe_is_complete(&egp->probe) && os_monotonic_get_ns() < egp->probe_deadline_ns) {
+		os_mutex_unlock(&egp->probe_mutex);
+		return G_SOURCE_CONTINUE;
+	}
+
+	struct ems_gstreamer_probe_result result;
+	ems_gstreamer_probe_estimate(&egp->probe, &result);
+	egp->probe_src_id = 0;
+
+	U_LOG_I("Probe: %u of %u replies, round trip %.1f ms, bandwidth %u kbps", result.replies,
+	        EMS_GSTREAMER_PROBE_COUNT, time_ns_to_ms_f((int64_t)result.rtt_ns), result.bandwidth_kbps);
+
+	// Under the lock, so unsetting the function waits for it to return.
+	if (egp->probe_func != NULL) {
+		egp->probe_func(&result, egp->probe_userdata);
+	}
+
+	os_mutex_unlock(&egp->probe_mutex);
+
+	return G_SOURCE_REMOVE;
+}
+
 static void
 data_channel_open_cb(GstWebRTCDataChannel *datachannel, struct ems_gstreamer_pipeline *egp)
 {
 	U_LOG_I("data channel opened");
 
+	os_mutex_lock(&egp->data_channel_mutex);
+	egp->data_channel_open = true;
+	os_mutex_unlock(&egp->data_channel_mutex);
+
+	if (debug_get_bool_option_probe()) {
+		os_mutex_lock(&egp->probe_mutex);
+		ems_gstreamer_probe_reset(&egp->probe);
+		g_clear_handle_id(&egp->probe_src_id, g_source_remove);
+		egp->probe_src_id = g_timeout_add(PROBE_TRAIN_INTERVAL_MS, probe_tick, egp);
+		os_mutex_unlock(&egp->probe_mutex);
+	}
+
 	egp->timeout_src_id = g_timeout_add_seconds(3, G_SOURCE_FUNC(datachannel_send_message), datachannel);
 }
 
@@ -216,7 +375,15 @@ data_channel_close_cb(GstWebRTCDataChannel *datachannel, struct ems_gstreamer_pi
 	U_LOG_I("data channel closed");
 
 	g_clear_handle_id(&egp->timeout_src_id, g_source_remove);
+
+	os_mutex_lock(&egp->probe_mutex);
+	g_clear_handle_id(&egp->probe_src_id, g_source_remove);
+	os_mutex_unlock(&egp->probe_mutex);
+
+	os_mutex_lock(&egp->data_channel_mutex);
+	egp->data_channel_open = false;
 	g_clear_object(&egp->data_channel);
+	os_mutex_unlock(&egp->data_channel_mutex);
 }
 
 static void
@@ -234,7 +401,21 @@ data_channel_message_data_cb(GstWebRTCDataChannel *datachannel, GBytes *data, st
 		U_LOG_E("Error! %s", PB_GET_ERROR(&our_istream));
 		return;
 	}
-	ems_callbacks_call(egp->callbacks, EMS_CALLBACKS_EVENT_TRACKING, &message);
+	if (message.has_tracking) {
+		ems_callbacks_call(egp->callbacks, EMS_CALLBACKS_EVENT_TRACKING, &message);
+	}
+	if (message.has_frame) {
+		ems_callbacks_call(egp->callbacks, EMS_CALLBACKS_EVENT_FRAME, &message);
+	}
+	if (message.has_gaze) {
+		ems_callbacks_call(egp->callbacks, EMS_CALLBACKS_EVENT_GAZE, &message);
+	}
+	if (message.has_probe_reply) {
+		uint64_t now_ns = os_monotonic_get_ns();
+		os_mutex_lock(&egp->probe_mutex);
+		ems_gstreamer_probe_add_reply(&egp->probe, &message.probe_reply, now_ns);
+		os_mutex_unlock(&egp->probe_mutex);
+	}
 }
 
 static void
@@ -261,6 +442,9 @@ webrtc_client_connected_cb(EmsSignalingServer *server, EmsClientId client_id, st
 	g_object_set_data(G_OBJECT(webrtcbin), "client_id", client_id);
 	gst_bin_add(pipeline, webrtcbin);
 
+	// Stats are taken from the last client to connect.
+	gst_object_replace((GstObject **)&egp->webrtc, GST_OBJECT(webrtcbin));
+
 	ret = gst_element_set_state(webrtcbin, GST_STATE_READY);
 	g_assert(ret != GST_STATE_CHANGE_FAILURE);
 
@@ -392,6 +576,10 @@ webrtc_client_disconnected_cb(EmsSignalingServer *server, EmsClientId client_id,
 
 	webrtcbin = get_webrtcbin_for_client(pipeline, client_id);
 
+	if (webrtcbin == egp->webrtc) {
+		gst_clear_object(&egp->webrtc);
+	}
+
 	if (webrtcbin) {
 		GstPad *sinkpad;
 
@@ -466,17 +654,75 @@ src_event_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
 }
 
 static gboolean
-print_stats(gpointer user_data)
+stats_field_cb(GQuark field_id, const GValue *value, gpointer user_data)
+{
+	struct ems_gstreamer_pipeline_stats *stats = user_data;
+
+	if (!GST_VALUE_HOLDS_STRUCTURE(value)) {
+		return TRUE;
+	}
+
+	const GstStructure *s = gst_value_get_structure(value);
+	GstWebRTCStatsType type;
+	if (!gst_structure_get(s, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type, NULL)) {
+		return TRUE;
+	}
+
+	if (type == GST_WEBRTC_STATS_OUTBOUND_RTP) {
+		guint64 bytes_sent = 0;
+		if (gst_structure_get_uint64(s, "bytes-sent", &bytes_sent)) {
+			stats->bytes_sent += bytes_sent;
+		}
+	} else if (type == GST_WEBRTC_STATS_REMOTE_INBOUND_RTP) {
+		gdouble rtt_s = 0.0;
+		if (gst_structure_get_double(s, "round-trip-time", &rtt_s) && rtt_s > 0.0) {
+			stats->rtt_ns = (uint64_t)(rtt_s * 1e9);
+		}
+		gdouble fraction_lost = 0.0;
+		if (gst_structure_get_double(s, "fraction-lost", &fraction_lost)) {
+			stats->fraction_lost = fraction_lost;
+		}
+	}
+
+	return TRUE;
+}
+
+static void
+on_stats(GstPromise *promise, struct ems_gstreamer_pipeline *egp)
+{
+	struct ems_gstreamer_pipeline_stats stats = {
+	    .timestamp_ns = os_monotonic_get_ns(),
+	};
+
+	if (gst_promise_wait(promise) == GST_PROMISE_RESULT_REPLIED) {
+		gst_structure_foreach(gst_promise_get_reply(promise), stats_field_cb, &stats);
+
+		// Might have been unset since the stats were asked for.
+		os_mutex_lock(&egp->stats_mutex);
+		if (egp->stats_func != NULL) {
+			egp->stats_func(&stats, egp->stats_userdata);
+		}
+		os_mutex_unlock(&egp->stats_mutex);
+	}
+
+	gst_promise_unref(promise);
+}
+
+static gboolean
+poll_stats(gpointer user_data)
 {
-	GstElement *src = user_data;
-	GstStructure *s;
-	char *str;
+	struct ems_gstreamer_pipeline *egp = user_data;
+
+	os_mutex_lock(&egp->stats_mutex);
+	bool have_func = egp->stats_func != NULL;
+	os_mutex_unlock(&egp->stats_mutex);
 
-	g_object_get(src, "stats", &s, NULL);
-	str = gst_structure_to_string(s);
-	// g_debug ("%s", str);
-	g_free(str);
-	gst_structure_free(s);
+	if (egp->webrtc == NULL || !have_func) {
+		return G_SOURCE_CONTINUE;
+	}
+
+	GstPromise *promise = gst_promise_new_with_change_func((GstPromiseChangeFunc)on_stats, egp, NULL);
+	g_signal_emit_by_name(egp->webrtc, "get-stats", NULL, promise);
 
 	return G_SOURCE_CONTINUE;
 }
@@ -508,12 +754,21 @@ static void
 destroy(struct xrt_frame_node *node)
 {
 	struct gstreamer_pipeline *gp = container_of(node, struct gstreamer_pipeline, node);
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
 
 	/*
 	 * All of the nodes has been broken apart and none of our functions will
 	 * be called, it's now safe to destroy and free ourselves.
 	 */
 
+	g_clear_handle_id(&egp->stats_src_id, g_source_remove);
+	g_clear_handle_id(&egp->probe_src_id, g_source_remove);
+	gst_clear_object(&egp->webrtc);
+
+	os_mutex_destroy(&egp->stats_mutex);
+	os_mutex_destroy(&egp->probe_mutex);
+	os_mutex_destroy(&egp->data_channel_mutex);
+
 	free(gp);
 }
 
@@ -577,6 +832,78 @@ ems_gstreamer_pipeline_stop(struct gstreamer_pipeline *gp)
 
 
 
+bool
+ems_gstreamer_pipeline_send_down_message(struct gstreamer_pipeline *gp, const em_proto_DownMessage *msg)
+{
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
+
+	return send_down_message(egp, msg, 0);
+}
+
+void
+ems_gstreamer_pipeline_set_stats_callback(struct gstreamer_pipeline *gp,
+                                          ems_gstreamer_pipeline_stats_func_t func,
+                                          void *userdata)
+{
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
+
+	os_mutex_lock(&egp->stats_mutex);
+	egp->stats_userdata = userdata;
+	egp->stats_func = func;
+	os_mutex_unlock(&egp->stats_mutex);
+
+	// Nobody left to poll for.
+	if (func == NULL) {
+		g_clear_handle_id(&egp->stats_src_id, g_source_remove);
+	}
+}
+
+void
+ems_gstreamer_pipeline_set_probe_callback(struct gstreamer_pipeline *gp,
+                                          ems_gstreamer_pipeline_probe_func_t func,
+                                          void *userdata)
+{
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
+
+	os_mutex_lock(&egp->probe_mutex);
+	egp->probe_userdata = userdata;
+	egp->probe_func = func;
+
+	// A probe running now would be for nobody.
+	if (func == NULL) {
+		g_clear_handle_id(&egp->probe_src_id, g_source_remove);
+	}
+	os_mutex_unlock(&egp->probe_mutex);
+}
+
+void
+ems_gstreamer_pipeline_set_bitrate(struct gstreamer_pipeline *gp, uint32_t kbps)
+{
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
+
+	if (egp->encoder == NULL) {
+		return;
+	}
+
+	GstElement *encoder = gst_bin_get_by_name(GST_BIN(gp->pipeline), EMS_GSTREAMER_ENCODER_NAME);
+	if (encoder == NULL) {
+		return;
+	}
+
+	guint value = (guint)((uint64_t)kbps * 1000 / egp->encoder->bitrate_unit);
+	g_object_set(encoder, egp->encoder->bitrate_property, value, NULL);
+
+	gst_object_unref(encoder);
+}
+
+uint32_t
+ems_gstreamer_pipeline_get_slices(struct gstreamer_pipeline *gp)
+{
+	struct ems_gstreamer_pipeline *egp = (struct ems_gstreamer_pipeline *)gp;
+
+	return egp->slices;
+}
+
 void
 ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
                               const char *appsrc_name,
@@ -591,20 +918,77 @@ ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
 
 	signaling_server = ems_signaling_server_new();
 
+	// Needed to probe the encoders.
+	gst_init(NULL, NULL);
+
+	const char *policy_str = debug_get_option_encoder_policy();
+	enum ems_gstreamer_encoder_policy policy = EMS_GSTREAMER_ENCODER_POLICY_LATENCY;
+	if (!ems_gstreamer_encoder_policy_from_string(policy_str, &policy)) {
+		U_LOG_W("Unknown encoder policy '%s', using latency", policy_str);
+	}
+
+	const char *encoder_name = debug_get_option_encoder();
+	if (strcmp(encoder_name, "auto") == 0) {
+		encoder_name = NULL;
+	}
+
+	const struct ems_gstreamer_encoder *encoder = ems_gstreamer_encoder_select(encoder_name, policy);
+
+	gchar *refresh_str = g_strdup("");
+	if (encoder != NULL && debug_get_bool_option_intra_refresh()) {
+		if (encoder->intra_refresh_properties != NULL) {
+			// Clients joining later start decoding at the next recovery point instead of an IDR frame.
+			uint32_t period = (uint32_t)MAX(debug_get_num_option_intra_refresh_period(), 2);
+			g_free(refresh_str);
+			refresh_str = g_strdup_printf("%s %s=%u", encoder->intra_refresh_properties,
+			                              encoder->intra_refresh_period_property, period);
+			U_LOG_I("Intra refresh over %u frames instead of IDR frames", period);
+		} else {
+			U_LOG_W("Encoder '%s' has no intra refresh, keeping IDR frames", encoder->name);
+		}
+	}
+
+	gchar *slices_str = g_strdup("");
+	uint32_t slices_set = 0;
+	int64_t slices = debug_get_num_option_slices();
+	if (encoder != NULL && slices > 1) {
+		if (encoder->slices_property != NULL) {
+			g_free(slices_str);
+			slices_set = (uint32_t)slices;
+			slices_str = g_strdup_printf("%s=%u", encoder->slices_property, slices_set);
+			U_LOG_I("Encoding %u slices per frame", slices_set);
+		} else {
+			U_LOG_I("Encoder '%s' picks its own slices", encoder->name);
+		}
+	}
+
+	gchar *convert_str = g_strdup("");
+	if (encoder != NULL && encoder->input_format != NULL) {
+		g_free(convert_str);
+		convert_str = g_strdup_printf("videoconvert ! video/x-raw,format=%s ! ", encoder->input_format);
+		U_LOG_I("Encoder '%s' takes %s, converting on the CPU", encoder->name, encoder->input_format);
+	}
+
+	// Split into NAL units after parsing, so each slice is payloaded and sent on its own.
 	pipeline_str = g_strdup_printf(
-	    "appsrc name=%s ! "                //
-	    "queue ! "                         //
-	    "videoconvert ! "                  //
-	    "video/x-raw,format=NV12 ! "       //
-	    "queue !"                          //
-	    "x264enc tune=zerolatency ! "      //
-	    "video/x-h264,profile=baseline ! " //
-	    "queue !"                          //
-	    "h264parse ! "                     //
-	    "rtph264pay config-interval=1 ! "  //
-	    "application/x-rtp,payload=96 ! "  //
+	    "appsrc name=%s ! "                                                                      //
+	    "queue name=%s leaky=downstream max-size-buffers=%d max-size-bytes=0 max-size-time=0 ! " //
+	    "%s"                                                                                     //
+	    "%s name=%s %s %s %s ! "                                                                 //
+	    "video/x-h264,profile=%s,stream-format=byte-stream ! "                                   //
+	    "queue !"                                                                                //
+	    "h264parse ! "                                                                           //
+	    "video/x-h264,alignment=nal ! "                                                          //
+	    "rtph264pay name=%s config-interval=1 ! "                                                //
+	    "application/x-rtp,payload=96 ! "                                                        //
 	    "tee name=%s allow-not-linked=true",
-	    appsrc_name, WEBRTC_TEE_NAME);
+	    appsrc_name, EMS_GSTREAMER_ENCODE_QUEUE_NAME, ENCODE_QUEUE_MAX_BUFFERS, convert_str,
+	    encoder != NULL ? encoder->factory : FALLBACK_ENCODER_FACTORY, EMS_GSTREAMER_ENCODER_NAME,
+	    encoder != NULL ? encoder->properties : "", refresh_str, slices_str,
+	    encoder != NULL ? encoder->profile : "baseline", EMS_GSTREAMER_PAYLOADER_NAME, WEBRTC_TEE_NAME);
+	g_free(refresh_str);
+	g_free(slices_str);
+	g_free(convert_str);
 
 	// no webrtc bin yet until later!
 
@@ -615,9 +999,11 @@ ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
 	egp->base.node.destroy = destroy;
 	egp->base.xfctx = xfctx;
 	egp->callbacks = callbacks_collection;
-
-
-	gst_init(NULL, NULL);
+	egp->encoder = encoder;
+	egp->slices = slices_set;
+	os_mutex_init(&egp->data_channel_mutex);
+	os_mutex_init(&egp->probe_mutex);
+	os_mutex_init(&egp->stats_mutex);
 
 	pipeline = gst_parse_launch(pipeline_str, &error);
 	g_assert_no_error(error);
@@ -631,6 +1017,8 @@ ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
 	g_signal_connect(signaling_server, "sdp-answer", G_CALLBACK(webrtc_sdp_answer_cb), egp);
 	g_signal_connect(signaling_server, "candidate", G_CALLBACK(webrtc_candidate_cb), egp);
 
+	egp->stats_src_id = g_timeout_add(STATS_INTERVAL_MS, poll_stats, egp);
+
 	// loop = g_main_loop_new (NULL, FALSE);
 	// g_unix_signal_add (SIGINT, sigint_handler, loop);
 
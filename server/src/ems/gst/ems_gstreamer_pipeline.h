@@ -17,16 +17,101 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+
+//! Name of the encoder element in the pipeline, its output is byte-stream H.264.
+#define EMS_GSTREAMER_ENCODER_NAME "encoder"
+
+//! Name of the leaky queue holding raw frames in front of the encoder.
+#define EMS_GSTREAMER_ENCODE_QUEUE_NAME "encodequeue"
+
+//! Name of the RTP payloader, its packets are what leaves for the clients.
+#define EMS_GSTREAMER_PAYLOADER_NAME "payloader"
+
 struct gstreamer_pipeline;
 
 struct ems_callbacks;
 
+typedef struct _em_proto_DownMessage em_proto_DownMessage;
+
+/*!
+ * Transport stats of the stream to the client, polled a few times a second.
+ */
+struct ems_gstreamer_pipeline_stats
+{
+	//! When the stats were taken, monotonic clock.
+	uint64_t timestamp_ns;
+
+	//! RTP bytes sent so far.
+	uint64_t bytes_sent;
+
+	//! Round trip time from the client's last receiver report, zero if there was none yet.
+	uint64_t rtt_ns;
+
+	//! Share of packets lost according to that receiver report, 0 to 1.
+	double fraction_lost;
+};
+
+/*!
+ * Called with new stats, on a thread of the webrtc element.
+ */
+typedef void (*ems_gstreamer_pipeline_stats_func_t)(const struct ems_gstreamer_pipeline_stats *stats, void *userdata);
+
+struct ems_gstreamer_probe_result;
+
+/*!
+ * Called with what the probe found when a client's data channel opened, on
+ * the main loop.
+ */
+typedef void (*ems_gstreamer_pipeline_probe_func_t)(const struct ems_gstreamer_probe_result *result, void *userdata);
+
 void
 ems_gstreamer_pipeline_play(struct gstreamer_pipeline *gp);
 
 void
 ems_gstreamer_pipeline_stop(struct gstreamer_pipeline *gp);
 
+/*!
+ * Send @p msg to the client over the data channel, returns false if it could
+ * not be encoded or no client is connected. Safe to call from any thread.
+ */
+bool
+ems_gstreamer_pipeline_send_down_message(struct gstreamer_pipeline *gp, const em_proto_DownMessage *msg);
+
+/*!
+ * Set the function called with transport stats while a client is connected,
+ * call before playing the pipeline. Setting NULL stops the polling, once it
+ * returns the old function isn't running and won't be called again.
+ */
+void
+ems_gstreamer_pipeline_set_stats_callback(struct gstreamer_pipeline *gp,
+                                          ems_gstreamer_pipeline_stats_func_t func,
+                                          void *userdata);
+
+/*!
+ * Set the function called when a client has been probed, see
+ * @ref ems_gstreamer_probe. Call before playing the pipeline. Setting NULL
+ * cancels a running probe, once it returns the old function isn't running
+ * and won't be called again.
+ */
+void
+ems_gstreamer_pipeline_set_probe_callback(struct gstreamer_pipeline *gp,
+                                          ems_gstreamer_pipeline_probe_func_t func,
+                                          void *userdata);
+
+/*!
+ * Set the encoder's target bitrate, takes effect while playing. Safe to call
+ * from any thread.
+ */
+void
+ems_gstreamer_pipeline_set_bitrate(struct gstreamer_pipeline *gp, uint32_t kbps);
+
+/*!
+ * Slices each frame is encoded in as set on the encoder, zero if the encoder
+ * picks them itself, see EMS_SLICES.
+ */
+uint32_t
+ems_gstreamer_pipeline_get_slices(struct gstreamer_pipeline *gp);
+
 void
 ems_gstreamer_pipeline_create(struct xrt_frame_context *xfctx,
                               const char *appsrc_name,
@@ -0,0 +1,171 @@
+// Copyright 2023, Pluto VR, Inc.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Measures the path to a newly connected client, before streaming to it.
+ * @ingroup aux_util
+ */
+
+#include "ems_gstreamer_probe.h"
+
+#include "util/u_misc.h"
+
+#include "electricmaple.pb.h"
+
+#include <stdlib.h>
+
+
+/*
+ *
+ * Helper functions.
+ *
+ */
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+/*!
+ * Rate the train got through at, from the first probe of it that arrived to
+ * the last: the bytes after the first one took that long. Returns false if
+ * too few came back or the client's clock did not tell them apart.
+ */
+static bool
+train_rate_kbps(const struct ems_gstreamer_probe *probe, uint32_t train, double *out_kbps)
+{
+	int first = -1;
+	int last = -1;
+	uint64_t bytes = 0;
+
+	for (uint32_t i = 0; i < EMS_GSTREAMER_PROBE_TRAIN_LENGTH; i++) {
+		int seq = (int)(train * EMS_GSTREAMER_PROBE_TRAIN_LENGTH + i);
+		if (!probe->replied[seq]) {
+			continue;
+		}
+		if (first < 0) {
+			first = seq;
+		} else {
+			bytes += probe->size[seq];
+		}
+		last = seq;
+	}
+
+	if (first < 0 || last == first) {
+		return false;
+	}
+
+	int64_t spread_ns = probe->receive_ns[last] - probe->receive_ns[first];
+	if (spread_ns <= 0) {
+		return false;
+	}
+
+	// Bits per nanosecond are Gbit/s.
+	*out_kbps = (double)bytes * 8.0 / (double)spread_ns * 1e6;
+
+	return true;
+}
+
+
+/*
+ *
+ * 'Exported' functions.
+ *
+ */
+
+void
+ems_gstreamer_probe_reset(struct ems_gstreamer_probe *probe)
+{
+	U_ZERO(probe);
+}
+
+void
+ems_gstreamer_probe_make(struct ems_gstreamer_probe *probe,
+                         uint32_t index,
+                         uint64_t now_ns,
+                         em_proto_ProbeMessage *msg)
+{
+	uint32_t seq = probe->trains_sent * EMS_GSTREAMER_PROBE_TRAIN_LENGTH + index;
+
+	probe->send_ns[seq] = now_ns;
+
+	msg->sequence = (int32_t)seq;
+	msg->train = (int32_t)probe->trains_sent;
+	msg->send_time = (int64_t)now_ns;
+}
+
+void
+ems_gstreamer_probe_end_train(struct ems_gstreamer_probe *probe)
+{
+	probe->trains_sent++;
+}
+
+bool
+ems_gstreamer_probe_add_reply(struct ems_gstreamer_probe *probe,
+                              const em_proto_ProbeReplyMessage *reply,
+                              uint64_t now_ns)
+{
+	if (reply->sequence < 0 || reply->sequence >= EMS_GSTREAMER_PROBE_COUNT) {
+		return false;
+	}
+
+	uint32_t seq = (uint32_t)reply->sequence;
+
+	// Replies from an earlier client echo other send times.
+	if (probe->send_ns[seq] == 0 || (uint64_t)reply->send_time != probe->send_ns[seq] || probe->replied[seq]) {
+		return false;
+	}
+
+	probe->reply_ns[seq] = now_ns;
+	probe->receive_ns[seq] = reply->receive_time;
+	probe->size[seq] = (uint32_t)reply->size;
+	probe->replied[seq] = true;
+	probe->replies++;
+
+	return true;
+}
+
+bool
+ems_gstreamer_probe_is_complete(const struct ems_gstreamer_probe *probe)
+{
+	return probe->trains_sent == EMS_GSTREAMER_PROBE_TRAINS && probe->replies == EMS_GSTREAMER_PROBE_COUNT;
+}
+
+void
+ems_gstreamer_probe_estimate(const struct ems_gstreamer_probe *probe, struct ems_gstreamer_probe_result *out_result)
+{
+	U_ZERO(out_result);
+
+	out_result->replies = probe->replies;
+
+	// Later probes of a train queue behind the earlier ones, the fastest is the path itself.
+	for (uint32_t seq = 0; seq < EMS_GSTREAMER_PROBE_COUNT; seq++) {
+		if (!probe->replied[seq]) {
+			continue;
+		}
+		uint64_t rtt_ns = probe->reply_ns[seq] - probe->send_ns[seq];
+		if (out_result->rtt_ns == 0 || rtt_ns < out_result->rtt_ns) {
+			out_result->rtt_ns = rtt_ns;
+		}
+	}
+
+	// A single train can be spread by a scheduling hiccup on either side, the median is not.
+	double rates[EMS_GSTREAMER_PROBE_TRAINS];
+	uint32_t rate_count = 0;
+	for (uint32_t train = 0; train < probe->trains_sent; train++) {
+		if (train_rate_kbps(probe, train, &rates[rate_count])) {
+			rate_count++;
+		}
+	}
+
+	if (rate_count == 0) {
+		return;
+	}
+
+	qsort(rates, rate_count, sizeof(rates[0]), compare_doubles);
+	out_result->bandwidth_kbps = (uint32_t)rates[rate_count / 2];
+}
@@ -0,0 +1,125 @@
+// Copyright 2023, Pluto VR, Inc.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Measures the path to a newly connected client, before streaming to it.
+ * @ingroup aux_util
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _em_proto_ProbeMessage em_proto_ProbeMessage;
+typedef struct _em_proto_ProbeReplyMessage em_proto_ProbeReplyMessage;
+
+//! Number of trains sent, and of probes sent back to back in each.
+#define EMS_GSTREAMER_PROBE_TRAINS (5)
+#define EMS_GSTREAMER_PROBE_TRAIN_LENGTH (4)
+#define EMS_GSTREAMER_PROBE_COUNT (EMS_GSTREAMER_PROBE_TRAINS * EMS_GSTREAMER_PROBE_TRAIN_LENGTH)
+
+//! Bytes of a probe with its padding, fits in one SCTP packet so two are never bundled.
+#define EMS_GSTREAMER_PROBE_SIZE (1100)
+
+/*!
+ * What the probe found out about the path.
+ */
+struct ems_gstreamer_probe_result
+{
+	//! Lowest round trip time of the probes, zero if none came back.
+	uint64_t rtt_ns;
+
+	//! Bandwidth of the narrowest link, zero if no train could be measured.
+	uint32_t bandwidth_kbps;
+
+	//! How many of the probes came back.
+	uint32_t replies;
+};
+
+/*!
+ * Trains of probes sent back to back, the client tells when each one
+ * arrived: the bottleneck of the path spreads a train out to the time it
+ * takes to get it through. The median over the trains is taken as the
+ * bandwidth, and the fastest round trip as the round trip time.
+ *
+ * Not thread safe.
+ */
+struct ems_gstreamer_probe
+{
+	//! Trains sent so far.
+	uint32_t trains_sent;
+
+	//! Per probe, by sequence.
+	uint64_t send_ns[EMS_GSTREAMER_PROBE_COUNT];
+	uint64_t reply_ns[EMS_GSTREAMER_PROBE_COUNT];
+	int64_t receive_ns[EMS_GSTREAMER_PROBE_COUNT];
+	uint32_t size[EMS_GSTREAMER_PROBE_COUNT];
+	bool replied[EMS_GSTREAMER_PROBE_COUNT];
+
+	uint32_t replies;
+};
+
+/*!
+ * Start over, for a new client.
+ *
+ * @public @memberof ems_gstreamer_probe
+ */
+void
+ems_gstreamer_probe_reset(struct ems_gstreamer_probe *probe);
+
+/*!
+ * Fill in @p msg for the @p index probe of the next train, and remember it
+ * as sent at @p now_ns. Call for each probe of the train, then end it with
+ * @ref ems_gstreamer_probe_end_train.
+ *
+ * @public @memberof ems_gstreamer_probe
+ */
+void
+ems_gstreamer_probe_make(struct ems_gstreamer_probe *probe,
+                         uint32_t index,
+                         uint64_t now_ns,
+                         em_proto_ProbeMessage *msg);
+
+/*!
+ * @public @memberof ems_gstreamer_probe
+ */
+void
+ems_gstreamer_probe_end_train(struct ems_gstreamer_probe *probe);
+
+/*!
+ * A reply from the client arrived at @p now_ns, returns false if it is not
+ * for a probe we sent.
+ *
+ * @public @memberof ems_gstreamer_probe
+ */
+bool
+ems_gstreamer_probe_add_reply(struct ems_gstreamer_probe *probe,
+                              const em_proto_ProbeReplyMessage *reply,
+                              uint64_t now_ns);
+
+/*!
+ * Have all trains been sent and all replies come back.
+ *
+ * @public @memberof ems_gstreamer_probe
+ */
+bool
+ems_gstreamer_probe_is_complete(const struct ems_gstreamer_probe *probe);
+
+/*!
+ * Estimate from the replies so far, probes that did not come back are left out.
+ *
+ * @public @memberof ems_gstreamer_probe
+ */
+void
+ems_gstreamer_probe_estimate(const struct ems_gstreamer_probe *probe, struct ems_gstreamer_probe_result *out_result);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,634 @@
+// Copyright 2019-2023, Collabora, Ltd.
+// Copyright 2023, Pluto VR, Inc.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Frame sink feeding encoder ready NV12 frames into the appsrc of a pipeline.
+ *
+ * Based on Monado's gstreamer_sink, which has no NV12 support.
+ *
+ * @ingroup aux_util
+ */
+
+#include "ems_gstreamer_src.h"
+#include "ems_gstreamer_pipeline.h"
+
+#include "os/os_time.h"
+
+#include "util/u_misc.h"
+#include "util/u_debug.h"
+#include "util/u_logging.h"
+#include "util/u_time.h"
+
+// Monado includes
+#include "gstreamer/gst_internal.h"
+#include "gstreamer/gst_pipeline.h"
+
+#include <gst/gst.h>
+#include <gst/allocators/allocators.h>
+#include <gst/video/video-event.h>
+
+#include <assert.h>
+#include <string.h>
+
+
+/*!
+ * Identifies our user_data_unregistered SEI message carrying the frame id,
+ * f8ca2978-b040-4059-9964-78d7ec17d1ec, must match the client.
+ */
+static const uint8_t frame_id_uuid[16] = {
+    0xf8, 0xca, 0x29, 0x78, 0xb0, 0x40, 0x40, 0x59, 0x99, 0x64, 0x78, 0xd7, 0xec, 0x17, 0xd1, 0xec,
+};
+
+// Strengths then the centers, as big endian IEEE floats.
+#define FOVEATION_SIZE (6 * 4)
+
+// Payload type and size, the uuid, the big endian frame id and optionally the foveation.
+#define FRAME_ID_SEI_RBSP_SIZE (2 + 16 + 8 + FOVEATION_SIZE)
+
+// Start code, NAL header, escaped payload and the trailing bits.
+#define FRAME_ID_SEI_MAX_SIZE (4 + 1 + FRAME_ID_SEI_RBSP_SIZE * 3 / 2 + 1)
+
+// How often the packet latency is logged, if it is.
+#define PACKET_LATENCY_LOG_INTERVAL_NS (5 * (uint64_t)U_TIME_1S_IN_NS)
+
+DEBUG_GET_ONCE_BOOL_OPTION(log_packet_latency, "EMS_LOG_PACKET_LATENCY", false)
+
+
+/*
+ *
+ * Helpers.
+ *
+ */
+
+static GstCaps *
+make_caps(uint32_t width, uint32_t height)
+{
+	return gst_caps_new_simple(                //
+	    "video/x-raw",                         //
+	    "format", G_TYPE_STRING, "NV12",       //
+	    "width", G_TYPE_INT, (int)width,       //
+	    "height", G_TYPE_INT, (int)height,     //
+	    "framerate", GST_TYPE_FRACTION, 0, 1,  //
+	    "colorimetry", G_TYPE_STRING, "bt709", //
+	    NULL);
+}
+
+static bool
+is_foveated(const struct ems_foveation *foveation)
+{
+	return foveation->strength[0] != 0.0f || foveation->strength[1] != 0.0f;
+}
+
+static void
+write_be_float(uint8_t *out, float value)
+{
+	uint32_t bits = 0;
+	memcpy(&bits, &value, sizeof(bits));
+
+	for (int i = 0; i < 4; i++) {
+		out[i] = (uint8_t)(bits >> (24 - 8 * i));
+	}
+}
+
+/*!
+ * Writes a complete SEI NAL unit with start code into @p out, returns its size.
+ * The foveation is only written if there is any, older clients read just the id.
+ */
+static size_t
+make_frame_id_sei(int64_t id, const struct ems_foveation *foveation, uint8_t out[FRAME_ID_SEI_MAX_SIZE])
+{
+	uint8_t rbsp[FRAME_ID_SEI_RBSP_SIZE];
+	size_t rbsp_size = 2 + 16 + 8;
+
+	rbsp[0] = 5; // user_data_unregistered
+	memcpy(&rbsp[2], frame_id_uuid, sizeof(frame_id_uuid));
+	for (int i = 0; i < 8; i++) {
+		rbsp[18 + i] = (uint8_t)((uint64_t)id >> (56 - 8 * i));
+	}
+
+	if (is_foveated(foveation)) {
+		const float values[6] = {
+		    foveation->strength[0],   foveation->strength[1],   //
+		    foveation->centers[0][0], foveation->centers[0][1], //
+		    foveation->centers[1][0], foveation->centers[1][1], //
+		};
+
+		for (int i = 0; i < 6; i++) {
+			write_be_float(&rbsp[rbsp_size + 4 * i], values[i]);
+		}
+		rbsp_size += FOVEATION_SIZE;
+	}
+
+	rbsp[1] = (uint8_t)(rbsp_size - 2);
+
+	size_t n = 0;
+	out[n++] = 0;
+	out[n++] = 0;
+	out[n++] = 0;
+	out[n++] = 1;
+	out[n++] = 6; // nal_ref_idc 0, nal_unit_type SEI
+
+	// Emulation prevention, two zero bytes may not be followed by 0 to 3.
+	int zeros = 0;
+	for (size_t i = 0; i < rbsp_size; i++) {
+		if (zeros == 2 && rbsp[i] <= 3) {
+			out[n++] = 3;
+			zeros = 0;
+		}
+		out[n++] = rbsp[i];
+		zeros = rbsp[i] == 0 ? zeros + 1 : 0;
+	}
+
+	out[n++] = 0x80; // rbsp_trailing_bits
+
+	return n;
+}
+
+/*!
+ * Size of the access unit delimiter starting @p buffer, if any, the SEI must
+ * come after it.
+ */
+static gsize
+get_aud_size(GstBuffer *buffer)
+{
+	uint8_t head[6];
+	if (gst_buffer_extract(buffer, 0, head, sizeof(head)) != sizeof(head)) {
+		return 0;
+	}
+
+	if (head[0] == 0 && head[1] == 0 && head[2] == 0 && head[3] == 1 && (head[4] & 0x1f) == 9) {
+		return 6;
+	}
+	if (head[0] == 0 && head[1] == 0 && head[2] == 1 && (head[3] & 0x1f) == 9) {
+		return 5;
+	}
+
+	return 0;
+}
+
+static void
+remember_id(struct ems_gstreamer_src *gs, uint64_t pts, int64_t id)
+{
+	os_mutex_lock(&gs->pending.mutex);
+	gs->pending.pts[gs->pending.next] = pts;
+	gs->pending.ids[gs->pending.next] = id;
+	gs->pending.foveations[gs->pending.next] = gs->foveation;
+	gs->pending.next = (gs->pending.next + 1) % EMS_GSTREAMER_SRC_MAX_PENDING_IDS;
+	os_mutex_unlock(&gs->pending.mutex);
+}
+
+static bool
+take_id(struct ems_gstreamer_src *gs, uint64_t pts, int64_t *out_id, struct ems_foveation *out_foveation)
+{
+	bool found = false;
+
+	os_mutex_lock(&gs->pending.mutex);
+	for (uint32_t i = 0; i < EMS_GSTREAMER_SRC_MAX_PENDING_IDS; i++) {
+		if (gs->pending.ids[i] != 0 && gs->pending.pts[i] == pts) {
+			*out_id = gs->pending.ids[i];
+			*out_foveation = gs->pending.foveations[i];
+			gs->pending.ids[i] = 0;
+			found = true;
+			break;
+		}
+	}
+	os_mutex_unlock(&gs->pending.mutex);
+
+	return found;
+}
+
+static void
+remember_push(struct ems_gstreamer_src *gs, uint64_t pts)
+{
+	os_mutex_lock(&gs->packets.mutex);
+	gs->packets.pts[gs->packets.next] = pts;
+	gs->packets.push_ns[gs->packets.next] = os_monotonic_get_ns();
+	gs->packets.first_ns[gs->packets.next] = 0;
+	gs->packets.next = (gs->packets.next + 1) % EMS_GSTREAMER_SRC_MAX_PENDING_IDS;
+	os_mutex_unlock(&gs->packets.mutex);
+}
+
+static void
+log_packet_latency_locked(struct ems_gstreamer_src *gs, uint64_t first_us, uint64_t last_us, uint64_t now_ns)
+{
+	if (gs->packets.log_start_ns == 0) {
+		gs->packets.log_start_ns = now_ns;
+	}
+
+	gs->packets.log_frames++;
+	gs->packets.log_first_total_us += first_us;
+	gs->packets.log_last_total_us += last_us;
+	gs->packets.log_first_max_us = MAX(gs->packets.log_first_max_us, first_us);
+	gs->packets.log_last_max_us = MAX(gs->packets.log_last_max_us, last_us);
+
+	if (now_ns - gs->packets.log_start_ns < PACKET_LATENCY_LOG_INTERVAL_NS) {
+		return;
+	}
+
+	double frames = (double)gs->packets.log_frames;
+	U_LOG_I("Packet latency over %u frames: first avg %.2f ms max %.2f ms, last avg %.2f ms max %.2f ms",
+	        gs->packets.log_frames, (double)gs->packets.log_first_total_us / frames / 1000.0,
+	        (double)gs->packets.log_first_max_us / 1000.0, (double)gs->packets.log_last_total_us / frames / 1000.0,
+	        (double)gs->packets.log_last_max_us / 1000.0);
+
+	gs->packets.log_start_ns = now_ns;
+	gs->packets.log_frames = 0;
+	gs->packets.log_first_total_us = 0;
+	gs->packets.log_last_total_us = 0;
+	gs->packets.log_first_max_us = 0;
+	gs->packets.log_last_max_us = 0;
+}
+
+/*!
+ * A packet of the frame with timestamp @p pts left the payloader at @p now_ns,
+ * the one with the marker bit is the last of the frame.
+ */
+static void
+packet_sent(struct ems_gstreamer_src *gs, uint64_t pts, bool marker, uint64_t now_ns)
+{
+	os_mutex_lock(&gs->packets.mutex);
+
+	for (uint32_t i = 0; i < EMS_GSTREAMER_SRC_MAX_PENDING_IDS; i++) {
+		if (gs->packets.push_ns[i] == 0 || gs->packets.pts[i] != pts) {
+			continue;
+		}
+
+		if (gs->packets.first_ns[i] == 0) {
+			gs->packets.first_ns[i] = now_ns;
+		}
+		if (!marker) {
+			break;
+		}
+
+		struct ems_gstreamer_packet_latency *l = &gs->packets.latency;
+		l->first_us = (gs->packets.first_ns[i] - gs->packets.push_ns[i]) / 1000;
+		l->last_us = (now_ns - gs->packets.push_ns[i]) / 1000;
+		if (l->frames == 0) {
+			l->first_avg_us = (float)l->first_us;
+			l->last_avg_us = (float)l->last_us;
+		} else {
+			l->first_avg_us = l->first_avg_us * 0.95f + (float)l->first_us * 0.05f;
+			l->last_avg_us = l->last_avg_us * 0.95f + (float)l->last_us * 0.05f;
+		}
+		l->first_total_us += l->first_us;
+		l->last_total_us += l->last_us;
+		l->first_max_us = MAX(l->first_max_us, l->first_us);
+		l->last_max_us = MAX(l->last_max_us, l->last_us);
+		l->frames++;
+
+		if (debug_get_bool_option_log_packet_latency()) {
+			log_packet_latency_locked(gs, l->first_us, l->last_us, now_ns);
+		}
+
+		gs->packets.push_ns[i] = 0;
+		break;
+	}
+
+	os_mutex_unlock(&gs->packets.mutex);
+}
+
+static void
+push_buffer(struct ems_gstreamer_src *gs, GstBuffer *buffer, struct xrt_frame *xf)
+{
+	GstFlowReturn ret;
+
+	GST_BUFFER_PTS(buffer) = xf->timestamp - gs->offset_ns;
+	GST_BUFFER_DTS(buffer) = xf->timestamp - gs->offset_ns;
+
+	// Zero is not a valid id, those frames are simply not tagged.
+	if (xf->source_sequence != 0) {
+		remember_id(gs, GST_BUFFER_PTS(buffer), (int64_t)xf->source_sequence);
+	}
+	remember_push(gs, GST_BUFFER_PTS(buffer));
+
+	// The signal does not take ownership of the buffer.
+	g_signal_emit_by_name(gs->appsrc, "push-buffer", buffer, &ret);
+	gst_buffer_unref(buffer);
+
+	if (ret != GST_FLOW_OK) {
+		U_LOG_E("Got GST error '%i'", ret);
+	}
+}
+
+
+/*
+ *
+ * Internal sink functions.
+ *
+ */
+
+static void
+wrapped_buffer_destroy(gpointer data)
+{
+	struct xrt_frame *xf = (struct xrt_frame *)data;
+
+	xrt_frame_reference(&xf, NULL);
+}
+
+static void
+dmabuf_memory_finalized(gpointer data, GstMiniObject *obj)
+{
+	wrapped_buffer_destroy(data);
+}
+
+static void
+push_frame(struct xrt_frame_sink *xfs, struct xrt_frame *xf)
+{
+	struct ems_gstreamer_src *gs = container_of(xfs, struct ems_gstreamer_src, base);
+
+	if (gs->appsrc == NULL) {
+		U_LOG_E("Not pushing frame, no appsrc");
+		return;
+	}
+
+	// Keep the frame alive for as long as the buffer is.
+	struct xrt_frame *ref = NULL;
+	xrt_frame_reference(&ref, xf);
+
+	GstBuffer *buffer = gst_buffer_new_wrapped_full( //
+	    GST_MEMORY_FLAG_READONLY,                    // flags
+	    (gpointer)xf->data,                          // data
+	    xf->size,                                    // maxsize
+	    0,                                           // offset
+	    xf->size,                                    // size
+	    ref,                                         // user_data
+	    wrapped_buffer_destroy);                     // notify
+
+	push_buffer(gs, buffer, xf);
+}
+
+
+/*
+ *
+ * Encoder probe.
+ *
+ */
+
+static GstPadProbeReturn
+encoder_sink_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_gstreamer_src *gs = (struct ems_gstreamer_src *)user_data;
+
+	xrt_atomic_s32_inc_return(&gs->encoding);
+
+	return GST_PAD_PROBE_OK;
+}
+
+/*!
+ * Inserts the frame id SEI into every access unit coming out of the encoder,
+ * sharing the memory of the encoded picture.
+ */
+static GstPadProbeReturn
+encoder_src_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_gstreamer_src *gs = (struct ems_gstreamer_src *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+	xrt_atomic_s32_dec_return(&gs->encoding);
+
+	int64_t id = 0;
+	struct ems_foveation foveation;
+	if (!take_id(gs, GST_BUFFER_PTS(buffer), &id, &foveation)) {
+		return GST_PAD_PROBE_OK;
+	}
+
+	uint8_t sei[FRAME_ID_SEI_MAX_SIZE];
+	size_t sei_size = make_frame_id_sei(id, &foveation, sei);
+	gsize prefix = get_aud_size(buffer);
+
+	GstBuffer *sei_buffer = gst_buffer_new_allocate(NULL, sei_size, NULL);
+	gst_buffer_fill(sei_buffer, 0, sei, sei_size);
+
+	GstBuffer *out = gst_buffer_new();
+	gst_buffer_copy_into(out, buffer, GST_BUFFER_COPY_METADATA, 0, -1);
+	if (prefix > 0) {
+		gst_buffer_copy_into(out, buffer, GST_BUFFER_COPY_MEMORY, 0, prefix);
+	}
+	out = gst_buffer_append(out, sei_buffer);
+	gst_buffer_copy_into(out, buffer, GST_BUFFER_COPY_MEMORY, prefix, -1);
+
+	gst_buffer_unref(buffer);
+	GST_PAD_PROBE_INFO_DATA(info) = out;
+
+	return GST_PAD_PROBE_OK;
+}
+
+
+/*!
+ * Times the packets of each frame leaving the payloader, it pushes a list
+ * for the fragments of a NAL unit that does not fit in one packet.
+ */
+static GstPadProbeReturn
+payloader_src_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct ems_gstreamer_src *gs = (struct ems_gstreamer_src *)user_data;
+	uint64_t now_ns = os_monotonic_get_ns();
+
+	if ((info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) != 0) {
+		GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+		guint length = gst_buffer_list_length(list);
+		for (guint i = 0; i < length; i++) {
+			GstBuffer *buffer = gst_buffer_list_get(list, i);
+			packet_sent(gs, GST_BUFFER_PTS(buffer), GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_MARKER),
+			            now_ns);
+		}
+	} else {
+		GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+		packet_sent(gs, GST_BUFFER_PTS(buffer), GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_MARKER), now_ns);
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+
+/*
+ *
+ * Internal node functions.
+ *
+ */
+
+static void
+break_apart(struct xrt_frame_node *node)
+{
+	struct ems_gstreamer_src *gs = container_of(node, struct ems_gstreamer_src, node);
+	GstFlowReturn ret;
+
+	if (gs->appsrc != NULL) {
+		g_signal_emit_by_name(gs->appsrc, "end-of-stream", &ret);
+	}
+}
+
+static void
+destroy(struct xrt_frame_node *node)
+{
+	struct ems_gstreamer_src *gs = container_of(node, struct ems_gstreamer_src, node);
+
+	gst_clear_object(&gs->appsrc);
+	gst_clear_object(&gs->dmabuf_allocator);
+	gst_clear_object(&gs->encode_queue);
+	gst_clear_object(&gs->encoder_src_pad);
+	os_mutex_destroy(&gs->pending.mutex);
+	os_mutex_destroy(&gs->packets.mutex);
+
+	free(gs);
+}
+
+
+/*
+ *
+ * Exported functions.
+ *
+ */
+
+void
+ems_gstreamer_src_create_with_pipeline(struct gstreamer_pipeline *gp,
+                                       uint32_t width,
+                                       uint32_t height,
+                                       const char *appsrc_name,
+                                       struct ems_gstreamer_src **out_gs,
+                                       struct xrt_frame_sink **out_xfs)
+{
+	GstElement *appsrc = gst_bin_get_by_name(GST_BIN(gp->pipeline), appsrc_name);
+	assert(appsrc != NULL);
+
+	GstCaps *caps = make_caps(width, height);
+
+	g_object_set(G_OBJECT(appsrc),          //
+	             "caps", caps,              //
+	             "stream-type", 0,          // GST_APP_STREAM_TYPE_STREAM
+	             "format", GST_FORMAT_TIME, //
+	             "is-live", TRUE,           //
+	             NULL);
+
+	gst_caps_unref(caps);
+
+	struct ems_gstreamer_src *gs = U_TYPED_CALLOC(struct ems_gstreamer_src);
+	gs->base.push_frame = push_frame;
+	gs->node.break_apart = break_apart;
+	gs->node.destroy = destroy;
+	gs->gp = gp;
+	gs->appsrc = appsrc;
+	gs->dmabuf_allocator = gst_dmabuf_allocator_new();
+	os_mutex_init(&gs->pending.mutex);
+	os_mutex_init(&gs->packets.mutex);
+
+	GstElement *encoder = gst_bin_get_by_name(GST_BIN(gp->pipeline), EMS_GSTREAMER_ENCODER_NAME);
+	if (encoder != NULL) {
+		GstPad *pad = gst_element_get_static_pad(encoder, "src");
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, encoder_src_probe_cb, gs, NULL);
+		gs->encoder_src_pad = pad;
+
+		pad = gst_element_get_static_pad(encoder, "sink");
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, encoder_sink_probe_cb, gs, NULL);
+		gst_object_unref(pad);
+
+		gst_object_unref(encoder);
+	} else {
+		U_LOG_W("No encoder named '%s', frames will not carry their id", EMS_GSTREAMER_ENCODER_NAME);
+	}
+
+	GstElement *payloader = gst_bin_get_by_name(GST_BIN(gp->pipeline), EMS_GSTREAMER_PAYLOADER_NAME);
+	if (payloader != NULL) {
+		GstPad *pad = gst_element_get_static_pad(payloader, "src");
+		GstPadProbeType type = GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST;
+		gst_pad_add_probe(pad, type, payloader_src_probe_cb, gs, NULL);
+		gst_object_unref(pad);
+		gst_object_unref(payloader);
+	} else {
+		U_LOG_W("No payloader named '%s', packet latency will not be measured", EMS_GSTREAMER_PAYLOADER_NAME);
+	}
+
+	gs->encode_queue = gst_bin_get_by_name(GST_BIN(gp->pipeline), EMS_GSTREAMER_ENCODE_QUEUE_NAME);
+	if (gs->encode_queue == NULL) {
+		U_LOG_W("No queue named '%s', encoder backlog will be underestimated", EMS_GSTREAMER_ENCODE_QUEUE_NAME);
+	}
+
+	xrt_frame_context_add(gp->xfctx, &gs->node);
+
+	*out_gs = gs;
+	*out_xfs = &gs->base;
+}
+
+void
+ems_gstreamer_src_set_size(struct ems_gstreamer_src *gs, uint32_t width, uint32_t height)
+{
+	GstCaps *caps = make_caps(width, height);
+
+	// The appsrc sends the new caps downstream ahead of the next buffer.
+	g_object_set(G_OBJECT(gs->appsrc), "caps", caps, NULL);
+
+	gst_caps_unref(caps);
+}
+
+void
+ems_gstreamer_src_push_dmabuf(struct ems_gstreamer_src *gs, struct xrt_frame *xf, int fd)
+{
+	if (gs->appsrc == NULL) {
+		U_LOG_E("Not pushing frame, no appsrc");
+		return;
+	}
+
+	// The pool owns the fd, it is closed when the frame memory is freed.
+	GstMemory *mem = gst_dmabuf_allocator_alloc_with_flags( //
+	    gs->dmabuf_allocator,                               // allocator
+	    fd,                                                 // fd
+	    xf->size,                                           // size
+	    GST_FD_MEMORY_FLAG_DONT_CLOSE);                     // flags
+	if (mem == NULL) {
+		U_LOG_E("Failed to wrap DMA-BUF fd %i", fd);
+		return;
+	}
+
+	// Keep the frame alive for as long as the memory is.
+	struct xrt_frame *ref = NULL;
+	xrt_frame_reference(&ref, xf);
+	gst_mini_object_weak_ref(GST_MINI_OBJECT(mem), dmabuf_memory_finalized, ref);
+
+	GST_MINI_OBJECT_FLAG_SET(mem, GST_MEMORY_FLAG_READONLY);
+
+	GstBuffer *buffer = gst_buffer_new();
+	gst_buffer_append_memory(buffer, mem);
+
+	push_buffer(gs, buffer, xf);
+}
+
+void
+ems_gstreamer_src_set_foveation(struct ems_gstreamer_src *gs, const struct ems_foveation *foveation)
+{
+	gs->foveation = *foveation;
+}
+
+uint32_t
+ems_gstreamer_src_get_backlog(struct ems_gstreamer_src *gs)
+{
+	guint queued = 0;
+	if (gs->encode_queue != NULL) {
+		g_object_get(G_OBJECT(gs->encode_queue), "current-level-buffers", &queued, NULL);
+	}
+
+	// The encoders are set up without lookahead, every frame in comes out again.
+	int32_t encoding = gs->encoding;
+
+	return (uint32_t)queued + (uint32_t)MAX(encoding, 0);
+}
+
+void
+ems_gstreamer_src_get_packet_latency(struct ems_gstreamer_src *gs, struct ems_gstreamer_packet_latency *out_latency)
+{
+	os_mutex_lock(&gs->packets.mutex);
+	*out_latency = gs->packets.latency;
+	os_mutex_unlock(&gs->packets.mutex);
+}
+
+void
+ems_gstreamer_src_request_key_frame(struct ems_gstreamer_src *gs)
+{
+	if (gs->encoder_src_pad == NULL) {
+		return;
+	}
+
+	// What a downstream element asking for one sends, with all the headers so it decodes standalone.
+	GstEvent *event = gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0);
+	gst_pad_send_event(gs->encoder_src_pad, event);
+}
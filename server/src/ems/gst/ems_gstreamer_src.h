@@ -0,0 +1,223 @@
+// Copyright 2023, Pluto VR, Inc.
+// SPDX-License-Identifier: BSL-1.0
+/*!
+ * @file
+ * @brief  Frame sink feeding encoder ready NV12 frames into the appsrc of a pipeline.
+ * @ingroup aux_util
+ */
+
+#pragma once
+
+#include "xrt/xrt_frame.h"
+#include "os/os_threading.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct gstreamer_pipeline;
+
+/*!
+ * Number of frames whose id is remembered until the encoder outputs them, the
+ * encoder queue plus the frames inside the encoder must fit.
+ */
+#define EMS_GSTREAMER_SRC_MAX_PENDING_IDS (16)
+
+/*!
+ * How the views of a frame were warped to spend more of the picture on the
+ * point of full density, sent with the frame so the client can undo it.
+ *
+ * Each axis is warped on either side of the center separately: a pixel at a
+ * fraction t of the way from the center to the edge of the picture shows the
+ * view at a fraction sinh(a t) / sinh(a) of the way to the edge of the view,
+ * a being the strength. The center is at the same place in both and gets
+ * sinh(a) / a times the pixels of an unwarped picture of the same size.
+ */
+struct ems_foveation
+{
+	//! Warp strength along x and y, zero is no warp.
+	float strength[2];
+
+	//! Point of full density of the left and right view, normalized to [0, 1].
+	float centers[2][2];
+};
+
+/*!
+ * How long the frames take from being pushed to their RTP packets leaving the
+ * payloader, with a sliced encoder the first packet goes out before the whole
+ * frame is packetized.
+ */
+struct ems_gstreamer_packet_latency
+{
+	//! Frames measured so far.
+	uint64_t frames;
+
+	//! Of the last frame, to its first and last packet, in microseconds.
+	uint64_t first_us;
+	uint64_t last_us;
+
+	//! Exponential moving averages, in microseconds.
+	float first_avg_us;
+	float last_avg_us;
+
+	//! Over all frames measured, for the mean and worst case, in microseconds.
+	uint64_t first_total_us;
+	uint64_t last_total_us;
+	uint64_t first_max_us;
+	uint64_t last_max_us;
+};
+
+/*!
+ * An @ref xrt_frame_sink that pushes frames into the appsrc of a pipeline,
+ * the frames are wrapped without copying and are released once the pipeline
+ * is done with them.
+ *
+ * Frames are NV12 pictures, the luma plane followed by the interleaved chroma
+ * plane both with a stride of the picture width, the format of the frame
+ * itself is ignored.
+ *
+ * The @p source_sequence of each frame is its frame id, it is written into
+ * the encoded access unit as a SEI NAL unit so the client can match the
+ * decoded picture with the frame data sent over the data channel.
+ */
+struct ems_gstreamer_src
+{
+	struct xrt_frame_sink base;
+	struct xrt_frame_node node;
+
+	struct gstreamer_pipeline *gp;
+
+	//! Subtracted from the frame timestamps, set on the first frame.
+	uint64_t offset_ns;
+
+	struct _GstElement *appsrc;
+
+	//! Wraps DMA-BUF file descriptors into memory, see @ref ems_gstreamer_src_push_dmabuf.
+	struct _GstAllocator *dmabuf_allocator;
+
+	//! The leaky queue in front of the encoder, for its fill level, may be NULL.
+	struct _GstElement *encode_queue;
+
+	//! Source pad of the encoder, key frames are requested on it, may be NULL.
+	struct _GstPad *encoder_src_pad;
+
+	//! Frames that went into the encoder and haven't come out yet.
+	xrt_atomic_s32_t encoding;
+
+	/*!
+	 * Ids of the frames pushed but not yet out of the encoder, keyed by
+	 * buffer timestamp which the encoder keeps.
+	 */
+	struct
+	{
+		struct os_mutex mutex;
+		uint64_t pts[EMS_GSTREAMER_SRC_MAX_PENDING_IDS];
+		int64_t ids[EMS_GSTREAMER_SRC_MAX_PENDING_IDS];
+		struct ems_foveation foveations[EMS_GSTREAMER_SRC_MAX_PENDING_IDS];
+		uint32_t next;
+	} pending;
+
+	/*!
+	 * Frames pushed whose last packet hasn't left the payloader yet, keyed
+	 * by buffer timestamp which the payloader keeps, for @ref latency.
+	 */
+	struct
+	{
+		struct os_mutex mutex;
+		uint64_t pts[EMS_GSTREAMER_SRC_MAX_PENDING_IDS];
+		uint64_t push_ns[EMS_GSTREAMER_SRC_MAX_PENDING_IDS];
+		uint64_t first_ns[EMS_GSTREAMER_SRC_MAX_PENDING_IDS];
+		uint32_t next;
+
+		struct ems_gstreamer_packet_latency latency;
+
+		//! Since the last log line, if logging.
+		uint64_t log_start_ns;
+		uint32_t log_frames;
+		uint64_t log_first_total_us;
+		uint64_t log_last_total_us;
+		uint64_t log_first_max_us;
+		uint64_t log_last_max_us;
+	} packets;
+
+	//! Foveation of the frames pushed from now on, only touched by the pushing thread.
+	struct ems_foveation foveation;
+};
+
+/*!
+ * Create a source that feeds the appsrc named @p appsrc_name in the pipeline,
+ * @p width and @p height are the size of the NV12 picture.
+ *
+ * @public @memberof ems_gstreamer_src
+ */
+void
+ems_gstreamer_src_create_with_pipeline(struct gstreamer_pipeline *gp,
+                                       uint32_t width,
+                                       uint32_t height,
+                                       const char *appsrc_name,
+                                       struct ems_gstreamer_src **out_gs,
+                                       struct xrt_frame_sink **out_xfs);
+
+/*!
+ * Change the size of the NV12 picture, frames pushed after this call must be
+ * of the new size. Downstream elements renegotiate without restarting.
+ *
+ * @public @memberof ems_gstreamer_src
+ */
+void
+ems_gstreamer_src_set_size(struct ems_gstreamer_src *gs, uint32_t width, uint32_t height);
+
+/*!
+ * Push a frame whose memory is the DMA-BUF @p fd instead of wrapping its data
+ * pointer, so elements that can import DMA-BUFs avoid touching it with the
+ * CPU. The file descriptor is not closed, it must stay valid for as long as
+ * @p xf is alive, and a reference to @p xf is held until the pipeline is done
+ * with the memory.
+ *
+ * @public @memberof ems_gstreamer_src
+ */
+void
+ems_gstreamer_src_push_dmabuf(struct ems_gstreamer_src *gs, struct xrt_frame *xf, int fd);
+
+/*!
+ * Set the foveation of the frames pushed after this call, it goes with their
+ * id into the bitstream. Zero strength is no foveation. Must be called from
+ * the thread pushing frames.
+ *
+ * @public @memberof ems_gstreamer_src
+ */
+void
+ems_gstreamer_src_set_foveation(struct ems_gstreamer_src *gs, const struct ems_foveation *foveation);
+
+/*!
+ * How many frames are waiting for the encoder or being encoded, a frame
+ * pushed now comes out of the encoder after all of them. Thread safe.
+ *
+ * @public @memberof ems_gstreamer_src
+ */
+uint32_t
+ems_gstreamer_src_get_backlog(struct ems_gstreamer_src *gs);
+
+/*!
+ * Ask the encoder to make the next frame it encodes a key frame, one that
+ * decodes on its own. Thread safe.
+ *
+ * @public @memberof ems_gstreamer_src
+ */
+void
+ems_gstreamer_src_request_key_frame(struct ems_gstreamer_src *gs);
+
+/*!
+ * Latency from pushing frames to their RTP packets going out, all zero if the
+ * pipeline has no payloader to measure at. Thread safe.
+ *
+ * @public @memberof ems_gstreamer_src
+ */
+void
+ems_gstreamer_src_get_packet_latency(struct ems_gstreamer_src *gs, struct ems_gstreamer_packet_latency *out_latency);
+
+
+#ifdef __cplusplus
+}
+#endif
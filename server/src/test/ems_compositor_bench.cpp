@@ -0,0 +1,545 @@
+// Copyright 2023, Pluto VR, Inc.
+//
+// SPDX-License-Identifier: BSL-1.0
+
+/*!
+ * @file
+ * @brief  Headless benchmark of the remote rendering compositor.
+ *
+ * Creates the compositor without an OpenXR app or a headset, gives it
+ * swapchains holding synthetic content and commits stereo projection layers at
+ * a fixed rate, then prints what each stage cost as JSON on stdout. Point
+ * VK_ICD_FILENAMES at lavapipe to run it on a machine without a GPU.
+ *
+ * @ingroup comp_ems
+ */
+
+#include "xrt/xrt_instance.h"
+#include "xrt/xrt_compositor.h"
+
+#include "os/os_time.h"
+#include "os/os_threading.h"
+
+#include "util/u_misc.h"
+#include "util/u_logging.h"
+#include "util/comp_swapchain.h"
+
+#include "vk/vk_helpers.h"
+#include "vk/vk_cmd_pool.h"
+
+#include "ems_compositor.h"
+#include "ems_server_internal.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+
+#define DEFAULT_FRAMES (600)
+#define DEFAULT_RATE_HZ (72)
+
+// Differently shifted patterns per image, so consecutive frames differ.
+#define PATTERN_TILE (64)
+
+// How often and how many times to look whether the last frames left the payloader.
+#define PACKET_POLL_MS (20)
+#define PACKET_POLL_MAX (50)
+
+
+struct bench_args
+{
+	uint32_t frames;
+	uint32_t rate_hz;
+};
+
+struct bench_eye
+{
+	struct xrt_swapchain *xsc;
+	uint32_t width;
+	uint32_t height;
+};
+
+
+/*
+ *
+ * Swapchain functions.
+ *
+ */
+
+static void
+fill_pattern(uint8_t *pixels, uint32_t width, uint32_t height, uint32_t shift)
+{
+	// Gradients for the encoder to chew on plus a checkerboard that moves.
+	for (uint32_t y = 0; y < height; y++) {
+		for (uint32_t x = 0; x < width; x++) {
+			uint8_t *p = &pixels[(y * width + x) * 4];
+			bool check = (((x + shift) / PATTERN_TILE) + (y / PATTERN_TILE)) % 2 != 0;
+
+			p[0] = (uint8_t)(x * 255 / width);
+			p[1] = (uint8_t)(y * 255 / height);
+			p[2] = check ? 200 : 40;
+			p[3] = 255;
+		}
+	}
+}
+
+/*!
+ * Upload a pattern into every image of the swapchain, leaving them in the
+ * layout the compositor samples them in.
+ */
+static bool
+fill_swapchain(struct ems_compositor *c, struct comp_swapchain *sc, uint32_t width, uint32_t height, uint32_t eye)
+{
+	struct vk_bundle *vk = &c->base.vk;
+	VkDeviceSize size = (VkDeviceSize)width * height * 4;
+	VkBuffer buffer = VK_NULL_HANDLE;
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	void *ptr = NULL;
+	bool ok = false;
+
+	VkMemoryPropertyFlags props = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	if (!vk_buffer_init(vk, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, props, &buffer, &memory)) {
+		U_LOG_E("vk_buffer_init: Failed to create staging buffer!");
+		return false;
+	}
+
+	VkResult ret = vk->vkMapMemory(vk->device, memory, 0, VK_WHOLE_SIZE, 0, &ptr);
+	if (ret != VK_SUCCESS) {
+		U_LOG_E("vkMapMemory: %s", vk_result_string(ret));
+		goto out;
+	}
+
+	for (uint32_t i = 0; i < sc->vkic.image_count; i++) {
+		fill_pattern((uint8_t *)ptr, width, height, (i * 2 + eye) * PATTERN_TILE / 4);
+
+		VkCommandBuffer cmd = VK_NULL_HANDLE;
+		VkImage image = sc->vkic.images[i].handle;
+
+		vk_cmd_pool_lock(&c->cmd_pool);
+
+		ret = vk_cmd_pool_create_and_begin_cmd_buffer_locked(vk, &c->cmd_pool, 0, &cmd);
+		if (ret != VK_SUCCESS) {
+			U_LOG_E("vk_cmd_pool_create_and_begin_cmd_buffer_locked: %s", vk_result_string(ret));
+			vk_cmd_pool_unlock(&c->cmd_pool);
+			goto out;
+		}
+
+		VkImageMemoryBarrier barrier = {
+		    .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		    .srcAccessMask = VK_ACCESS_SHADER_READ_BIT,
+		    .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		    .oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+		    .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		    .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		    .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		    .image = image,
+		    .subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1},
+		};
+
+		vk->vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0,
+		                         NULL, 0, NULL, 1, &barrier);
+
+		VkBufferImageCopy region = {
+		    .imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1},
+		    .imageExtent = {width, height, 1},
+		};
+
+		vk->vkCmdCopyBufferToImage(cmd, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+		vk->vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+		                         0, NULL, 0, NULL, 1, &barrier);
+
+		// Waits for the copy, the staging buffer is reused for the next image.
+		ret = vk_cmd_pool_submit_cmd_buffer_locked(vk, &c->cmd_pool, cmd);
+		vk_cmd_pool_unlock(&c->cmd_pool);
+		if (ret != VK_SUCCESS) {
+			U_LOG_E("vk_cmd_pool_submit_cmd_buffer_locked: %s", vk_result_string(ret));
+			goto out;
+		}
+	}
+
+	ok = true;
+
+out:
+	if (ptr != NULL) {
+		vk->vkUnmapMemory(vk->device, memory);
+	}
+	vk->vkDestroyBuffer(vk->device, buffer, NULL);
+	vk->vkFreeMemory(vk->device, memory, NULL);
+
+	return ok;
+}
+
+static bool
+create_eye(struct ems_compositor *c, uint32_t eye, struct bench_eye *out_eye)
+{
+	struct xrt_swapchain_create_info info = {};
+	info.bits = (enum xrt_swapchain_usage_bits)(XRT_SWAPCHAIN_USAGE_COLOR | XRT_SWAPCHAIN_USAGE_SAMPLED |
+	                                            XRT_SWAPCHAIN_USAGE_TRANSFER_DST);
+	info.format = VK_FORMAT_R8G8B8A8_SRGB;
+	info.sample_count = 1;
+	info.width = c->settings.view_width;
+	info.height = c->settings.view_height;
+	info.face_count = 1;
+	info.array_size = 1;
+	info.mip_count = 1;
+
+	struct xrt_swapchain *xsc = NULL;
+	xrt_result_t xret = xrt_comp_create_swapchain(&c->base.base.base, &info, &xsc);
+	if (xret != XRT_SUCCESS) {
+		U_LOG_E("xrt_comp_create_swapchain: %i", xret);
+		return false;
+	}
+
+	if (!fill_swapchain(c, (struct comp_swapchain *)xsc, info.width, info.height, eye)) {
+		xrt_swapchain_reference(&xsc, NULL);
+		return false;
+	}
+
+	out_eye->xsc = xsc;
+	out_eye->width = info.width;
+	out_eye->height = info.height;
+
+	return true;
+}
+
+static uint32_t
+cycle_image(struct xrt_swapchain *xsc)
+{
+	uint32_t index = 0;
+
+	xrt_swapchain_acquire_image(xsc, &index);
+	xrt_swapchain_wait_image(xsc, XRT_INFINITE_DURATION, index);
+	xrt_swapchain_release_image(xsc, index);
+
+	return index;
+}
+
+
+/*
+ *
+ * Frame functions.
+ *
+ */
+
+static void
+set_view(struct xrt_layer_projection_view_data *view, const struct bench_eye *eye, uint32_t index, float x)
+{
+	view->sub.image_index = index;
+	view->sub.array_index = 0;
+	view->sub.rect.offset.w = 0;
+	view->sub.rect.offset.h = 0;
+	view->sub.rect.extent.w = (int)eye->width;
+	view->sub.rect.extent.h = (int)eye->height;
+	view->fov.angle_left = -0.785f;
+	view->fov.angle_right = 0.785f;
+	view->fov.angle_up = 0.785f;
+	view->fov.angle_down = -0.785f;
+	view->pose = (xrt_pose)XRT_POSE_IDENTITY;
+	view->pose.position.x = x;
+}
+
+/*!
+ * Runs one frame the way the multi compositor would for a single app, returns
+ * the CPU time spent in layer commit.
+ */
+static uint64_t
+run_frame(struct ems_compositor *c, struct bench_eye eyes[2])
+{
+	struct xrt_compositor *xc = &c->base.base.base;
+
+	int64_t frame_id = -1;
+	uint64_t wake_up_time_ns = 0;
+	uint64_t predicted_gpu_time_ns = 0;
+	uint64_t predicted_display_time_ns = 0;
+	uint64_t predicted_display_period_ns = 0;
+
+	xrt_comp_predict_frame(            //
+	    xc,                            // xc
+	    &frame_id,                     // out_frame_id
+	    &wake_up_time_ns,              // out_wake_time_ns
+	    &predicted_gpu_time_ns,        // out_predicted_gpu_time_ns
+	    &predicted_display_time_ns,    // out_predicted_display_time_ns
+	    &predicted_display_period_ns); // out_predicted_display_period_ns
+
+	xrt_comp_begin_frame(xc, frame_id);
+
+	struct xrt_layer_frame_data frame_data = {};
+	frame_data.frame_id = frame_id;
+	frame_data.display_time_ns = predicted_display_time_ns;
+	frame_data.env_blend_mode = XRT_BLEND_MODE_OPAQUE;
+
+	struct xrt_layer_data data = {};
+	data.type = XRT_LAYER_STEREO_PROJECTION;
+	data.name = XRT_INPUT_GENERIC_HEAD_POSE;
+	data.timestamp = predicted_display_time_ns;
+	set_view(&data.stereo.l, &eyes[0], cycle_image(eyes[0].xsc), -0.032f);
+	set_view(&data.stereo.r, &eyes[1], cycle_image(eyes[1].xsc), 0.032f);
+
+	xrt_comp_layer_begin(xc, &frame_data);
+	xrt_comp_layer_stereo_projection(xc, c->xdev, eyes[0].xsc, eyes[1].xsc, &data);
+
+	uint64_t commit_start_ns = os_monotonic_get_ns();
+	xrt_comp_layer_commit(xc, XRT_GRAPHICS_SYNC_HANDLE_INVALID);
+
+	return (os_monotonic_get_ns() - commit_start_ns) / 1000;
+}
+
+//! The readback thread pushes asynchronously, wait for it before reading the stats.
+static void
+wait_for_readbacks(struct ems_compositor *c)
+{
+	while (true) {
+		os_thread_helper_lock(&c->readback.oth);
+		uint32_t count = c->readback.count;
+		os_thread_helper_unlock(&c->readback.oth);
+
+		if (count == 0) {
+			return;
+		}
+
+		os_nanosleep(U_TIME_1MS_IN_NS);
+	}
+}
+
+//! The last frames are still being encoded, wait for their packets to be timed.
+static void
+wait_for_packets(struct ems_compositor *c)
+{
+	struct ems_gstreamer_packet_latency last;
+	ems_gstreamer_src_get_packet_latency(c->gstreamer_src, &last);
+
+	// Frames the leaky queue dropped never come out, so don't wait forever.
+	for (uint32_t i = 0; i < PACKET_POLL_MAX; i++) {
+		os_nanosleep(PACKET_POLL_MS * U_TIME_1MS_IN_NS);
+
+		struct ems_gstreamer_packet_latency latency;
+		ems_gstreamer_src_get_packet_latency(c->gstreamer_src, &latency);
+		if (ems_gstreamer_src_get_backlog(c->gstreamer_src) == 0 && latency.frames == last.frames) {
+			return;
+		}
+
+		last = latency;
+	}
+}
+
+
+/*
+ *
+ * Output functions.
+ *
+ */
+
+static void
+print_stage(const char *name, const struct ems_stage_stats *s, bool last)
+{
+	double mean_us = s->count > 0 ? (double)s->total_us / (double)s->count : 0.0;
+
+	printf("    \"%s\": {\"count\": %" PRIu64 ", \"mean_us\": %.1f, \"max_us\": %" PRIu64 "}%s\n", name, s->count,
+	       mean_us, s->max_us, last ? "" : ",");
+}
+
+static void
+print_packet_latency(const char *name, uint64_t frames, uint64_t total_us, uint64_t max_us, bool last)
+{
+	double mean_us = frames > 0 ? (double)total_us / (double)frames : 0.0;
+
+	printf("    \"%s\": {\"mean_us\": %.1f, \"max_us\": %" PRIu64 "}%s\n", name, mean_us, max_us,
+	       last ? "" : ",");
+}
+
+static void
+print_results(struct ems_compositor *c, const struct bench_args *args, std::vector<uint64_t> &commit_us, double seconds)
+{
+	std::sort(commit_us.begin(), commit_us.end());
+
+	uint64_t total_us = 0;
+	for (uint64_t us : commit_us) {
+		total_us += us;
+	}
+
+	size_t n = commit_us.size();
+	double mean_us = n > 0 ? (double)total_us / (double)n : 0.0;
+	uint64_t p50_us = n > 0 ? commit_us[n / 2] : 0;
+	uint64_t p99_us = n > 0 ? commit_us[std::min(n - 1, n * 99 / 100)] : 0;
+	uint64_t max_us = n > 0 ? commit_us[n - 1] : 0;
+
+	printf("{\n");
+	printf("  \"frames\": %u,\n", args->frames);
+	printf("  \"rate_hz\": %u,\n", args->rate_hz);
+	printf("  \"seconds\": %.3f,\n", seconds);
+	printf("  \"commit_fps\": %.2f,\n", (double)n / seconds);
+	printf("  \"pushed_fps\": %.2f,\n", (double)c->stages.push.count / seconds);
+	printf("  \"view\": {\"width\": %u, \"height\": %u},\n", c->settings.view_width, c->settings.view_height);
+	printf("  \"encode\": {\"width\": %u, \"height\": %u, \"slices\": %u},\n", c->encode.width, c->encode.height,
+	       ems_gstreamer_pipeline_get_slices(c->gstreamer_pipeline));
+	printf("  \"readback_depth\": %u,\n", c->readback.depth);
+	printf("  \"queue\": {\"family\": %u, \"compute_only\": %s},\n", c->queue.family_index,
+	       c->queue.compute_only ? "true" : "false");
+	printf("  \"pack_bounce\": %s,\n", c->bounce.enabled ? "true" : "false");
+	printf("  \"pack_cmd_per_frame\": %s,\n", c->readback.cmd_per_frame ? "true" : "false");
+	printf("  \"commit_us\": {\"mean\": %.1f, \"p50\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"max\": %" PRIu64 "},\n",
+	       mean_us, p50_us, p99_us, max_us);
+	printf("  \"stages\": {\n");
+	print_stage("pack", &c->stages.pack, false);
+	print_stage("wait", &c->stages.wait, false);
+	print_stage("push", &c->stages.push, false);
+	print_stage("gpu_clear", &c->stages.gpu_clear, false);
+	print_stage("gpu_pack", &c->stages.gpu_pack, false);
+	print_stage("gpu_queue", &c->stages.gpu_queue, true);
+	printf("  },\n");
+
+	// From pushing into the pipeline to the frame's first and last RTP packet.
+	struct ems_gstreamer_packet_latency l;
+	ems_gstreamer_src_get_packet_latency(c->gstreamer_src, &l);
+	printf("  \"packet_latency\": {\n");
+	printf("    \"frames\": %" PRIu64 ",\n", l.frames);
+	print_packet_latency("first", l.frames, l.first_total_us, l.first_max_us, false);
+	print_packet_latency("last", l.frames, l.last_total_us, l.last_max_us, true);
+	printf("  },\n");
+	printf("  \"readback_stalls\": %" PRIu64 ",\n", c->readback.stalls);
+	printf("  \"readback_overruns\": %" PRIu64 ",\n", c->readback.overruns);
+	printf("  \"skipped\": {\"encoder_backlog\": %" PRIu64 ", \"readbacks_in_flight\": %" PRIu64
+	       ", \"unchanged\": %" PRIu64 "}\n",
+	       c->backlog.skipped_encoder, c->backlog.skipped_readback, c->static_frames.skipped);
+	printf("}\n");
+}
+
+
+/*
+ *
+ * Main.
+ *
+ */
+
+static void
+print_usage(const char *name)
+{
+	fprintf(stderr,
+	        "Usage: %s [--frames N] [--rate HZ]\n"
+	        "\n"
+	        "  -f, --frames N  frames to commit, default %u\n"
+	        "  -r, --rate HZ   commit rate, default %u\n"
+	        "\n"
+	        "The compositor is configured with the usual EMS_* environment variables.\n"
+	        "Set VK_ICD_FILENAMES to the lavapipe ICD to run without a GPU.\n",
+	        name, DEFAULT_FRAMES, DEFAULT_RATE_HZ);
+}
+
+static bool
+parse_args(int argc, char *argv[], struct bench_args *out_args)
+{
+	static const struct option options[] = {
+	    {"frames", required_argument, NULL, 'f'},
+	    {"rate", required_argument, NULL, 'r'},
+	    {"help", no_argument, NULL, 'h'},
+	    {NULL, 0, NULL, 0},
+	};
+
+	out_args->frames = DEFAULT_FRAMES;
+	out_args->rate_hz = DEFAULT_RATE_HZ;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "f:r:h", options, NULL)) != -1) {
+		switch (opt) {
+		case 'f': out_args->frames = (uint32_t)strtoul(optarg, NULL, 10); break;
+		case 'r': out_args->rate_hz = (uint32_t)strtoul(optarg, NULL, 10); break;
+		default: return false;
+		}
+	}
+
+	return out_args->frames > 0 && out_args->rate_hz > 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_args args;
+	if (!parse_args(argc, argv, &args)) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	struct xrt_instance *xinst = NULL;
+	xrt_result_t xret = xrt_instance_create(NULL, &xinst);
+	if (xret != XRT_SUCCESS) {
+		U_LOG_E("xrt_instance_create: %i", xret);
+		return 1;
+	}
+
+	// The instance is ours, it came from ems_instance.cpp linked in.
+	struct ems_instance *emsi = container_of(xinst, struct ems_instance, xinst_base);
+
+	struct ems_compositor *c = NULL;
+	xret = ems_compositor_create(*emsi, &c);
+	if (xret != XRT_SUCCESS) {
+		U_LOG_E("ems_compositor_create: %i", xret);
+		xrt_instance_destroy(&xinst);
+		return 1;
+	}
+
+	struct xrt_compositor *xc = &c->base.base.base;
+	struct bench_eye eyes[2] = {};
+	int result = 1;
+
+	if (!create_eye(c, 0, &eyes[0]) || !create_eye(c, 1, &eyes[1])) {
+		goto out;
+	}
+
+	{
+		struct xrt_begin_session_info begin_info = {};
+		begin_info.view_type = XRT_VIEW_TYPE_STEREO;
+		xrt_comp_begin_session(xc, &begin_info);
+
+		uint64_t interval_ns = U_TIME_1S_IN_NS / args.rate_hz;
+		std::vector<uint64_t> commit_us;
+		commit_us.reserve(args.frames);
+
+		uint64_t start_ns = os_monotonic_get_ns();
+		uint64_t next_ns = start_ns;
+
+		for (uint32_t i = 0; i < args.frames; i++) {
+			commit_us.push_back(run_frame(c, eyes));
+
+			// Fixed rate, don't catch up on frames we were late for.
+			next_ns += interval_ns;
+			uint64_t now_ns = os_monotonic_get_ns();
+			if (now_ns < next_ns) {
+				os_nanosleep((int64_t)(next_ns - now_ns));
+			} else {
+				next_ns = now_ns;
+			}
+		}
+
+		wait_for_readbacks(c);
+
+		double seconds = (double)(os_monotonic_get_ns() - start_ns) / (double)U_TIME_1S_IN_NS;
+
+		// Not counted in the time above, the encoder isn't ours to pace.
+		wait_for_packets(c);
+
+		print_results(c, &args, commit_us, seconds);
+
+		xrt_comp_end_session(xc);
+	}
+
+	result = 0;
+
+out:
+	xrt_swapchain_reference(&eyes[0].xsc, NULL);
+	xrt_swapchain_reference(&eyes[1].xsc, NULL);
+	xrt_comp_destroy(&xc);
+	xrt_instance_destroy(&xinst);
+
+	return result;
+}